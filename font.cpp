@@ -1,12 +1,39 @@
 #include "font.h"
 
 #include <fstream>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_set>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define FONT_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined( __AVX2__ )
+#define FONT_USE_AVX2
+#include <immintrin.h>
+#endif
 
 #include "ft2build.h"
 #include FT_FREETYPE_H
-
-#define MAX_TEX_SIZE 8192
-#define MIN_TEX_SIZE 128
+#include FT_SIZES_H
+#include FT_OUTLINE_H
 
 #define FONT_VERTEX 0
 #define FONT_TEXCOORD 1
@@ -16,9 +43,46 @@
 #define FONT_FACE 5
 #define FONT_TRANSFORM 6
 #define FONT_FILTER 7
-
-wchar_t buf[2] = {-1, L'\0'};
-std::wstring cachestring = std::wstring(buf) + L" 0123456789a�bcde�fghi�jklmno���pqrstu���vwxyzA�BCDE�FGHI�JKLMNO���PQRSTU���VWXYZ+!%/=()|$[]<>#&@{},.~-?:_;*`^'\"";
+#define FONT_LAYER 8
+
+//vbo slot of the packed instance stream
+#define FONT_INSTANCES 2
+//vbo slots of the layer projections (shader storage binding 0) and the indirect draws
+#define FONT_LAYERS 3
+#define FONT_INDIRECT 4
+//vbo slot used while rendering a static block into its surface
+#define FONT_BLOCK 6
+
+//world labels: glyph instances, the label records (storage binding 1) and the indirect draws (storage binding 3 when culling)
+#define FONT_WORLD_GLYPHS 7
+#define FONT_WORLD_LABELS 8
+#define FONT_WORLD_COMMANDS 9
+
+//gpu layout: codepoints, glyph and kerning tables, block totals, instances and the status record (indirect draw + missing list)
+#define FONT_GPU_CODEPOINTS 10
+#define FONT_GPU_GLYPHS 11
+#define FONT_GPU_KERNING 12
+#define FONT_GPU_BLOCKS 13
+#define FONT_GPU_INSTANCES 14
+#define FONT_GPU_STATUS 15
+
+//vbo slot of the texels the pack shader writes into the packed atlas (storage binding 0)
+#define FONT_PACK 16
+
+//codepoints per layout workgroup, local_size_x of layout.cs
+#define FONT_GPU_BLOCK_SIZE 256
+//missing glyphs and kerning pairs one gpu layout can report
+#define FONT_GPU_MISSING 1024
+//bytes before the missing list in the status record
+#define FONT_GPU_STATUS_HEADER ( sizeof( GLuint ) * 6 )
+
+//instances per diffed chunk of a slot
+#define FONT_SLOT_CHUNK 64
+
+//default warmup set, latin with the hungarian accented letters
+static const char32_t cachestring[] = U" 0123456789a\u00E1bcde\u00E9fghi\u00EDjklmno\u00F3\u00F6\u0151pqrstu\u00FA\u00FC\u0171vwxyz"
+                                      U"A\u00C1BCDE\u00C9FGHI\u00CDJKLMNO\u00D3\u00D6\u0150PQRSTU\u00DA\u00DC\u0170VWXYZ"
+                                      U"+!%/=()|$[]<>#&@{},.~-?:_;*`^'\"";
 
 struct glyph
 {
@@ -31,9 +95,120 @@ struct glyph
   FT_Vector advance;
   FT_UInt glyphid;
   unsigned int cache_index;
+  unsigned int page; //atlas page
+  unsigned int cell_bytes; //atlas texels, all mip levels
+};
+
+struct font_size_info
+{
+  size_t atlas_bytes;
+  unsigned int last_used; //frame
+};
+
+struct font_file
+{
+  void* data; //read only mapping of the whole file
+  size_t size;
+  void* handle; //platform mapping handle
+  FT_Face face;
+  unsigned int refs;
+  std::map< unsigned int, font_glyph_map > glyphs; //by size, then codepoint
+  std::unordered_map< uint64_t, float > kerning; //by size and codepoint pair
+  std::map< unsigned int, font_size_info > sizes;
+  unsigned long long hash; //of the whole file, computed when glyph runs need it
+};
+
+//maps a whole file read only, returns 0 on failure
+static void* map_file( const std::string& filename, size_t& size, void*& handle )
+{
+  size = 0;
+  handle = 0;
+
+#ifdef _WIN32
+  HANDLE f = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+
+  if( f == INVALID_HANDLE_VALUE )
+    return 0;
+
+  LARGE_INTEGER li;
+  GetFileSizeEx( f, &li );
+  HANDLE m = li.QuadPart > 0 ? CreateFileMappingA( f, 0, PAGE_READONLY, 0, 0, 0 ) : 0;
+  CloseHandle( f );
+
+  if( !m )
+    return 0;
+
+  void* data = MapViewOfFile( m, FILE_MAP_READ, 0, 0, 0 );
+
+  if( !data )
+  {
+    CloseHandle( m );
+    return 0;
+  }
+
+  size = ( size_t )li.QuadPart;
+  handle = m;
+  return data;
+#else
+  int fd = open( filename.c_str(), O_RDONLY );
+
+  if( fd < 0 )
+    return 0;
+
+  struct stat st;
+
+  if( fstat( fd, &st ) != 0 || st.st_size == 0 )
+  {
+    close( fd );
+    return 0;
+  }
+
+  void* data = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+
+  if( data == MAP_FAILED )
+    return 0;
+
+  size = st.st_size;
+  return data;
+#endif
+}
+
+static void unmap_file( void* data, size_t size, void* handle )
+{
+  if( !data )
+    return;
+
+#ifdef _WIN32
+  UnmapViewOfFile( data );
+  CloseHandle( ( HANDLE )handle );
+#else
+  ( void )handle;
+  munmap( data, size );
+#endif
+}
+
+//holds the cache write lock for a scope
+struct font_cache_write
+{
+  font_rw_lock& lock;
+
+  font_cache_write( font_rw_lock& l ) : lock( l )
+  {
+    lock.lock();
+  }
+
+  ~font_cache_write()
+  {
+    lock.unlock();
+  }
 };
 
-library::library() : the_library( 0 ), tex( 0 ), texsampler_point( 0 ), texsampler_linear( 0 ), vao( 0 ), the_shader( 0 ), is_set_up( false )
+library::library() : the_library( 0 ), tex( 0 ), texsampler_point( 0 ), texsampler_linear( 0 ), texsampler_mip( 0 ), mip_levels( 1 ), page_count( 0 ), page_capacity( 0 ), current_page( 0 ), vao( 0 ), frame( 0 ), trim_frames( 0 ), trimmed_sizes( 0 ), generation( 0 ), the_shader( 0 ), the_blit_shader( 0 ), blit_vao( 0 ), the_world_shader( 0 ), the_world_cull_shader( 0 ), world_vao( 0 ), the_layout_shader( 0 ), the_pack_shader( 0 ), atlas_format( FONT_ATLAS_R8 ), atlas_error_sq( 0 ), atlas_error_texels( 0 ), atlas_error_max( 0 ), gpu_vao( 0 ), max_texture_size( 0 ),
+  gl_valid( false ), gl_dirty( false ), gl_calls( 0 ), gl_calls_skipped( 0 ), last_gl_calls( 0 ), last_gl_calls_skipped( 0 ), gl_gets( 0 ), last_gl_gets( 0 ), gl_capture( FONT_CAPTURE_ONCE ), is_set_up( false ), releases( 0 ),
+  frame_uploads( 0 ), defrag_tex( 0 ), defrag_pages( 0 ), defrag_page( 0 ), defrag_row_h( 0 ), defrag_next( 0 ), defrag_generation( 0 ), defrag_releases( 0 ),
+  defrag_checked( ( unsigned int )-1 ), defrag_budget_us( 0 ), defrag_fill( 0.5f ), defrag_passes( 0 ),
+  heap_allocs( 0 ), heap_allocs_mark( 0 ), frame_heap_allocs( 0 )
 {
   for( int c = 0; c < FONT_LIB_VBO_SIZE; ++c )
     vbos[c] = 0;
@@ -51,14 +226,42 @@ void library::destroy()
 {
   glDeleteSamplers( 1, &texsampler_point );
   glDeleteSamplers( 1, &texsampler_linear );
+  glDeleteSamplers( 1, &texsampler_mip );
+  restore_gl_state();
   glDeleteTextures( 1, &tex );
+  glDeleteTextures( 1, &defrag_tex );
   glDeleteVertexArrays( 1, &vao );
+  glDeleteVertexArrays( 1, &blit_vao );
+  glDeleteVertexArrays( 1, &world_vao );
+  glDeleteVertexArrays( 1, &gpu_vao );
   glDeleteBuffers( FONT_LIB_VBO_SIZE, vbos );
   glDeleteProgram( the_shader );
+  glDeleteProgram( the_blit_shader );
+  glDeleteProgram( the_world_shader );
+  glDeleteProgram( the_world_cull_shader );
+  glDeleteProgram( the_layout_shader );
+  glDeleteProgram( the_pack_shader );
 }
 
 library::~library()
 {
+  {
+    std::lock_guard<std::mutex> lock( workers.m );
+    workers.quit = true;
+  }
+
+  workers.wake.notify_all();
+
+  for( auto& t : workers.threads )
+    t.join();
+
+  //maps destroyed after this find no pool and leave the freed chunks alone, see pool_free
+  for( auto& p : node_pools )
+    for( auto c : p.chunks )
+      delete [] c;
+
+  node_pools.clear();
+
   if( the_library )
   {
     FT_Error error;
@@ -71,777 +274,5809 @@ library::~library()
   }
 }
 
-void library::delete_glyphs()
+//runs 'work' on the calling thread and on threads - 1 pool workers, returns when all of them are done
+//the workers are started the first time they are needed and kept until the library goes away
+void library::run_on_threads( unsigned int threads, const std::function<void()>& work )
 {
-  texture_pen = mm::uvec2(1);
-  texture_row_h = 0;
-  texsize = mm::uvec2(0);
+  font_worker_pool& p = workers;
 
-  font_data.clear();
+  if( threads < 2 )
+  {
+    work();
+    return;
+  }
+
+  std::lock_guard<std::mutex> one_run( p.runs );
 
-  for( auto& c : instances )
   {
-    (*c->the_face->glyphs).clear();
+    std::lock_guard<std::mutex> lock( p.m );
+
+    while( p.threads.size() < threads - 1 )
+      p.threads.push_back( std::thread( &library::run_worker, this ) );
+
+    p.work = &work;
+    p.wanted = p.running = threads - 1;
+    ++p.round;
   }
+
+  p.wake.notify_all();
+  work();
+
+  std::unique_lock<std::mutex> lock( p.m );
+  p.done.wait( lock, [&]() { return p.running == 0; } );
+  p.work = 0;
 }
 
-void library::set_up()
+//a pool worker: joins every run that still wants workers, at most once per run
+void library::run_worker()
 {
-  if( is_set_up ) return;
+  font_worker_pool& p = workers;
+  size_t seen = 0;
+  std::unique_lock<std::mutex> lock( p.m );
 
-  texture_pen = mm::uvec2( 0 );
-  texsize = mm::uvec2( 0 );
+  for( ;; )
+  {
+    p.wake.wait( lock, [&]() { return p.quit || ( p.round != seen && p.wanted > 0 ); } );
 
-  glGenTextures( 1, &tex );
+    if( p.quit )
+      return;
 
-  glGenSamplers( 1, &texsampler_point );
-  glGenSamplers( 1, &texsampler_linear );
+    seen = p.round;
+    --p.wanted;
+    const std::function<void()>* work = p.work;
 
-  glSamplerParameteri( texsampler_point, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-  glSamplerParameteri( texsampler_point, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-  glSamplerParameteri( texsampler_point, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-  glSamplerParameteri( texsampler_point, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    lock.unlock();
+    ( *work )();
+    lock.lock();
 
-  glSamplerParameteri( texsampler_linear, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-  glSamplerParameteri( texsampler_linear, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-  glSamplerParameteri( texsampler_linear, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-  glSamplerParameteri( texsampler_linear, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    if( --p.running == 0 )
+      p.done.notify_one();
+  }
+}
 
-  std::vector<unsigned> faces;
-  std::vector<float> vertices;
-  std::vector<float> texcoords;
-  faces.resize( 2 * 3 );
-  vertices.resize( 4 * 2 );
-  texcoords.resize( 4 * 2 );
+void library::delete_glyphs()
+{
+  font_cache_write w( cache_lock );
 
-  faces[0*3+0] = 2;
-  faces[0*3+1] = 1;
-  faces[0*3+2] = 0;
+  //keep the allocated layers, just start packing from the first page again
+  texture_pen = mm::uvec2(0);
+  texture_row_h = 0;
+  page_count = 0;
+  current_page = 0;
+  free_pages.clear();
+  page_live.clear();
 
-  faces[1*3+0] = 0;
-  faces[1*3+1] = 3;
-  faces[1*3+2] = 2;
+  font_data.clear();
+  font_data_free.clear();
+  ++generation;
+  //every cell is gone, queued and drained records have to be redone too
+  ++releases;
 
-  vertices[0*2+0] = 0;
-  vertices[0*2+1] = 0;
+  for( auto& c : instances )
+  {
+    (*c->the_face->glyphs).clear();
+  }
 
-  vertices[1*2+0] = 0;
-  vertices[1*2+1] = 1;
+  for( auto& f : font_files )
+  {
+    f.second->sizes.clear();
+  }
+}
 
-  vertices[2*2+0] = 1;
-  vertices[2*2+1] = 1;
+void library::release_glyph( const glyph& g )
+{
+  font_data_free.push_back( g.cache_index );
+  ++releases;
 
-  vertices[3*2+0] = 1;
-  vertices[3*2+1] = 0;
+  if( g.page < page_live.size() && --page_live[g.page] == 0 )
+  {
+    if( g.page == current_page )
+    {
+      //nothing left on it, start packing it from scratch
+      texture_pen = mm::uvec2( 0 );
+      texture_row_h = 0;
+    }
+    else
+    {
+      free_pages.push_back( g.page );
+    }
+  }
+}
 
-  texcoords[0*2+0] = 0;
-  texcoords[0 * 2 + 1] = 0;
+void library::trim_size( font_file* f, unsigned int size )
+{
+  auto it = f->glyphs.find( size );
 
-  texcoords[1 * 2 + 0] = 0;
-  texcoords[1 * 2 + 1] = 1;
+  if( it != f->glyphs.end() )
+  {
+    for( auto& g : it->second )
+      release_glyph( g.second );
 
-  texcoords[2*2+0] = 1;
-  texcoords[2 * 2 + 1] = 1;
+    f->glyphs.erase( it );
+  }
 
-  texcoords[3*2+0] = 1;
-  texcoords[3 * 2 + 1] = 0;
+  for( auto k = f->kerning.begin(); k != f->kerning.end(); )
+  {
+    if( ( k->first >> 42 ) == size )
+      k = f->kerning.erase( k );
+    else
+      ++k;
+  }
 
-  glGenVertexArrays( 1, &vao );
-  glBindVertexArray( vao );
+  f->sizes.erase( size );
+  ++trimmed_sizes;
+}
 
-  glGenBuffers( 1, &vbos[FONT_VERTEX] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_VERTEX] );
-  glBufferData( GL_ARRAY_BUFFER, sizeof( float ) * 2 * vertices.size(), &vertices[0], GL_STATIC_DRAW );
-  glEnableVertexAttribArray( FONT_VERTEX );
-  glVertexAttribPointer( FONT_VERTEX, 2, GL_FLOAT, false, 0, 0 );
+void library::get_usage( font_file* f, font_budget& b )
+{
+  b = font_budget();
 
-  glGenBuffers( 1, &vbos[FONT_TEXCOORD] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_TEXCOORD] );
-  glBufferData( GL_ARRAY_BUFFER, sizeof( float ) * 2 * texcoords.size(), &texcoords[0], GL_STATIC_DRAW );
-  glEnableVertexAttribArray( FONT_TEXCOORD );
-  glVertexAttribPointer( FONT_TEXCOORD, 2, GL_FLOAT, false, 0, 0 );
+  for( auto& s : f->glyphs )
+    b.glyphs += s.second.size();
 
-  glGenBuffers( 1, &vbos[FONT_VERTSCALEBIAS] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_VERTSCALEBIAS] );
-  glEnableVertexAttribArray( FONT_VERTSCALEBIAS );
-  glVertexAttribPointer( FONT_VERTSCALEBIAS, 4, GL_FLOAT, false, sizeof( mm::vec4 ), 0 );
-  glVertexAttribDivisor( FONT_VERTSCALEBIAS, 1 );
+  for( auto& s : f->sizes )
+    b.atlas_bytes += s.second.atlas_bytes;
 
-  glGenBuffers( 1, &vbos[FONT_TEXSCALEBIAS] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_TEXSCALEBIAS] );
-  glEnableVertexAttribArray( FONT_TEXSCALEBIAS );
-  glVertexAttribPointer( FONT_TEXSCALEBIAS, 4, GL_FLOAT, false, sizeof( mm::vec4 ), 0 );
-  glVertexAttribDivisor( FONT_TEXSCALEBIAS, 1 );
+  b.font_data = b.glyphs;
+}
 
-  glGenBuffers( 1, &vbos[FONT_COLOR] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_COLOR] );
-  glEnableVertexAttribArray( FONT_COLOR );
-  glVertexAttribPointer( FONT_COLOR, 4, GL_FLOAT, false, sizeof( mm::vec4 ), 0 );
-  glVertexAttribDivisor( FONT_COLOR, 1 );
+static bool over_budget( const font_budget& used, const font_budget& b )
+{
+  return ( b.atlas_bytes && used.atlas_bytes > b.atlas_bytes ) ||
+         ( b.glyphs && used.glyphs > b.glyphs ) ||
+         ( b.font_data && used.font_data > b.font_data );
+}
 
-  glGenBuffers( 1, &vbos[FONT_FACE] );
-  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, vbos[FONT_FACE] );
-  glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof( unsigned ) * 3 * faces.size(), &faces[0], GL_STATIC_DRAW );
-  glGenBuffers( 1, &vbos[FONT_TRANSFORM] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_TRANSFORM] );
-  
-  for( int c = 0; c < 4; ++c )
-  {
-    glEnableVertexAttribArray( FONT_TRANSFORM + c );
-    glVertexAttribPointer( FONT_TRANSFORM + c, 4, GL_FLOAT, false, sizeof( mm::mat4 ), ((char*)0) + sizeof( mm::vec4 ) * c  );
-    glVertexAttribDivisor( FONT_TRANSFORM + c , 1 );
-  } 
+//least recently drawn size that wasn't drawn this frame, of one file or of all of them
+static bool find_lru_size( const std::map< std::pair< std::string, unsigned int >, font_file* >& files, font_file* only, unsigned int frame, font_file*& f, unsigned int& size )
+{
+  bool found = false;
+  unsigned int oldest = frame;
 
-  glGenBuffers( 1, &vbos[FONT_FILTER] );
-  glBindBuffer( GL_ARRAY_BUFFER, vbos[FONT_FILTER] );
-  glEnableVertexAttribArray( FONT_FILTER+3 );
-  glVertexAttribPointer( FONT_FILTER+3, 1, GL_FLOAT, false, sizeof( float ), 0 );
-  glVertexAttribDivisor( FONT_FILTER+3, 1 );
+  for( auto& ff : files )
+  {
+    if( only && ff.second != only )
+      continue;
 
-  glBindVertexArray( 0 );
+    for( auto& s : ff.second->sizes )
+    {
+      if( s.second.last_used < oldest )
+      {
+        oldest = s.second.last_used;
+        f = ff.second;
+        size = s.first;
+        found = true;
+      }
+    }
+  }
 
-  is_set_up = true;
+  return found;
 }
 
-bool library::expand_tex()
+//runs at the end of a frame, nothing drawn in this frame is touched
+void library::trim()
 {
-  glBindTexture( GL_TEXTURE_RECTANGLE, tex );
+  font_cache_write w( cache_lock );
 
-  if( texsize.x == 0 || texsize.y == 0 )
+  if( trim_frames > 0 )
   {
-    texsize.x = MAX_TEX_SIZE;
-    texsize.y = MIN_TEX_SIZE;
+    for( auto& ff : font_files )
+    {
+      std::vector<unsigned int> old;
 
-    GLubyte* buf = new GLubyte[texsize.x * texsize.y];
-    memset( buf, 0, texsize.x * texsize.y * sizeof( GLubyte ) );
+      for( auto& s : ff.second->sizes )
+        if( s.second.last_used + trim_frames < frame )
+          old.push_back( s.first );
 
-    glTexParameteri( GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-    glTexParameteri( GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-    glTexParameteri( GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-    glTexParameteri( GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-    glTexParameteri( GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE );
-    glTexImage2D( GL_TEXTURE_RECTANGLE, 0, GL_R8, texsize.x, texsize.y, 0, GL_RED, GL_UNSIGNED_BYTE, buf );
+      for( auto& s : old )
+        trim_size( ff.second, s );
+    }
+  }
 
-    texture_pen.x = 1;
-    texture_pen.y = 1;
-    texture_row_h = 0;
+  font_budget used;
+  font_file* f;
+  unsigned int size;
 
-    delete [] buf;
-  }
-  else
+  for( auto& i : instances )
   {
-    GLubyte* buf = new GLubyte[texsize.x * texsize.y];
+    if( !i->the_face || !i->the_face->file )
+      continue;
+
+    get_usage( i->the_face->file, used );
 
-    glGetTexImage( GL_TEXTURE_RECTANGLE, 0, GL_RED, GL_UNSIGNED_BYTE, buf );
+    while( over_budget( used, i->budget ) && find_lru_size( font_files, i->the_face->file, frame, f, size ) )
+    {
+      trim_size( f, size );
+      get_usage( f, used );
+    }
+  }
 
-    int tmp_height = texsize.y;
-    texsize.y += MIN_TEX_SIZE;
+  for( ;; )
+  {
+    font_budget total, u;
 
-    if( texsize.y > MAX_TEX_SIZE ) //can't expand tex further
+    for( auto& ff : font_files )
     {
-      return false;
+      get_usage( ff.second, u );
+      total.atlas_bytes += u.atlas_bytes;
+      total.glyphs += u.glyphs;
     }
 
-    GLubyte* tmpbuf = new GLubyte[texsize.x * texsize.y];
-    memset( tmpbuf, 0, texsize.x * texsize.y * sizeof( GLubyte ) );
+    total.font_data = font_data.size() - font_data_free.size();
 
-    glTexImage2D( GL_TEXTURE_RECTANGLE, 0, GL_R8, texsize.x, texsize.y, 0, GL_RED, GL_UNSIGNED_BYTE, tmpbuf );
-    glTexSubImage2D( GL_TEXTURE_RECTANGLE, 0, 0, 0, texsize.x, tmp_height, GL_RED, GL_UNSIGNED_BYTE, buf );
+    if( !over_budget( total, budget ) || !find_lru_size( font_files, 0, frame, f, size ) )
+      break;
 
-    delete [] buf;
-    delete [] tmpbuf;
+    trim_size( f, size );
   }
-
-  return true;
 }
 
-font_inst::face::face() : size( 0 ), the_face( 0 ), glyphs( 0 ) {}
+font_stats library::get_stats()
+{
+  font_stats s;
+  s.frame = frame;
+  s.pages = page_count - free_pages.size();
+  s.free_pages = free_pages.size();
+  s.page_capacity = page_capacity;
+
+  s.texture_bytes = 0;
+  s.cached_blocks = 0;
+  s.surface_bytes = 0;
+  s.upload_bytes = 0;
+  s.gl_calls = last_gl_calls;
+  s.gl_calls_skipped = last_gl_calls_skipped;
+  s.gl_gets = last_gl_gets;
+
+  //packed layers hold four pages in four bytes, bc4 is half a byte per texel
+  for( unsigned int l = 0; l < mip_levels; ++l )
+  {
+    size_t level = ( size_t )( FONT_ATLAS_PAGE_SIZE >> l ) * ( FONT_ATLAS_PAGE_SIZE >> l );
+    size_t pages = page_capacity + ( defrag_tex ? defrag_pages : 0 );
+
+    if( atlas_format == FONT_ATLAS_PACKED )
+      s.texture_bytes += level * 4 * get_layers( page_capacity );
+    else if( atlas_format == FONT_ATLAS_BC4 )
+      s.texture_bytes += level / 2 * pages;
+    else
+      s.texture_bytes += level * pages;
+  }
+
+  s.atlas_format = atlas_format;
+  s.pool_nodes = 0;
+  s.pool_capacity = 0;
+
+  for( auto& p : node_pools )
+  {
+    s.pool_nodes += p.live;
+    s.pool_capacity += p.chunks.size() * FONT_POOL_CHUNK;
+  }
+
+  s.heap_allocs = heap_allocs;
+  s.frame_heap_allocs = frame_heap_allocs;
+  s.atlas_error_rms = atlas_error_texels ? ( float )std::sqrt( ( double )atlas_error_sq / atlas_error_texels ) : 0;
+  s.atlas_error_max = ( float )atlas_error_max;
+
+  s.defrag_passes = defrag_passes;
+  s.defrag_moves = defrag_tex ? defrag_moves.size() - defrag_next : 0;
+
+  s.atlas_bytes = 0;
+  s.glyphs = 0;
+
+  for( auto& ff : font_files )
+  {
+    font_budget u;
+    get_usage( ff.second, u );
+    s.atlas_bytes += u.atlas_bytes;
+    s.glyphs += u.glyphs;
+  }
+
+  s.font_data = font_data.size() - font_data_free.size();
+  s.font_data_free = font_data_free.size();
+  s.trimmed_sizes = trimmed_sizes;
+  return s;
+}
 
-font_inst::face::face( const std::string& filename, unsigned int index )
+font_file* library::acquire_font_file( const std::string& filename, unsigned int index )
 {
-  FT_Error error;
-  error = FT_New_Face( ( FT_Library )library::get().get_library(), filename.c_str(), index, ( FT_Face* )&the_face );
+  auto key = std::make_pair( filename, index );
+  auto it = font_files.find( key );
 
-  upos = 0;
-  uthick = 0;
+  if( it != font_files.end() )
+  {
+    ++it->second->refs;
+    return it->second;
+  }
 
-  FT_Matrix matrix = { (int)((1.0 / 64.0f) * 0x10000L),
-                       (int)((0.0)         * 0x10000L),
-                       (int)((0.0)         * 0x10000L),
-                       (int)((1.0)         * 0x10000L) };
-  FT_Select_Charmap( *( FT_Face* )&the_face, FT_ENCODING_UNICODE );
-  FT_Set_Transform( *( FT_Face* )&the_face, &matrix, NULL );
+  font_file* f = new font_file();
+  f->data = map_file( filename, f->size, f->handle );
+
+  if( !f->data )
+  {
+    std::cerr << "Couldn't open file: " << filename << std::endl;
+    delete f;
+    return 0;
+  }
 
-  glyphs = new std::map< unsigned int, std::map<uint32_t, glyph> >();
+  FT_Error error = FT_New_Memory_Face( ( FT_Library )the_library, ( const FT_Byte* )f->data, ( FT_Long )f->size, index, &f->face );
 
   if( error )
   {
     std::cerr << "Error loading font face: " << filename << std::endl;
-    the_face = 0;
+    unmap_file( f->data, f->size, f->handle );
+    delete f;
+    return 0;
   }
-}
 
-font_inst::face::~face()
-{
-  //TODO invalidate glyphs in the library, and its tex
-  FT_Done_Face( ( FT_Face )the_face );
-  delete glyphs;
+  FT_Matrix matrix = { (int)((1.0 / 64.0f) * 0x10000L),
+                       (int)((0.0)         * 0x10000L),
+                       (int)((0.0)         * 0x10000L),
+                       (int)((1.0)         * 0x10000L) };
+  FT_Select_Charmap( f->face, FT_ENCODING_UNICODE );
+  FT_Set_Transform( f->face, &matrix, NULL );
+
+  f->refs = 1;
+  font_files[key] = f;
+  return f;
 }
 
-void font_inst::face::set_size( unsigned int val )
+void library::release_font_file( font_file* f )
 {
-  if( the_face )
-  {
-    size = val;
+  if( !f || --f->refs > 0 )
+    return;
 
-    FT_Set_Char_Size( ( FT_Face )the_face, size * 100.0f * 64.0f, 0.0f, 72 * 64.0f, 72 );
-    asc = ( ( ( FT_Face )the_face )->size->metrics.ascender / 64.0f ) / 100.0f;
-    desc = ( ( ( FT_Face )the_face )->size->metrics.descender / 64.0f ) / 100.0f;
-    h = ( ( ( FT_Face )the_face )->size->metrics.height / 64.0f ) / 100.0f;
-    gap = h - asc + desc;
-    
-    upos = ( ( FT_Face )the_face )->underline_position / (64.0f*64.0f) * size;
-    upos = std::round( upos );
-    
-    if( upos > -2 )
+  for( auto it = font_files.begin(); it != font_files.end(); ++it )
+  {
+    if( it->second == f )
     {
-      upos = -2;
+      font_files.erase( it );
+      break;
     }
+  }
 
-    uthick = ( ( FT_Face )the_face )->underline_thickness / (64.0f*64.0f) * size;
-    uthick = std::round( uthick );
+  //word widths are keyed by the file's address, another file may get it
+  word_widths.clear();
 
-    if( uthick < 1 )
-    {
-      uthick = 1;
-    }
+  {
+    font_cache_write w( cache_lock );
 
-    FT_Set_Char_Size( ( FT_Face )the_face, size * 64.0f, 0.0f, 72 * 64.0f, 72 );
+    //its cells, font data slots and page counts go back to the atlas, release_glyph bumps releases
+    for( auto& s : f->glyphs )
+      for( auto& g : s.second )
+        release_glyph( g.second );
+
+    f->glyphs.clear();
+    ++generation;
   }
+
+  FT_Done_Face( f->face ); //also frees the sizes of the faces using it
+  unmap_file( f->data, f->size, f->handle );
+  delete f;
 }
 
-bool font_inst::face::load_glyph( unsigned int val )
+void library::capture_gl_state()
 {
-  if( ( *glyphs )[size].count( val ) == 0 && the_face )
+  font_gl_state& s = gl_caller;
+
+  s.cull = glIsEnabled( GL_CULL_FACE );
+  s.depth = glIsEnabled( GL_DEPTH_TEST );
+  s.blend = glIsEnabled( GL_BLEND );
+  glGetIntegerv( GL_BLEND_SRC_RGB, &s.blend_src_rgb );
+  glGetIntegerv( GL_BLEND_DST_RGB, &s.blend_dst_rgb );
+  glGetIntegerv( GL_BLEND_SRC_ALPHA, &s.blend_src_alpha );
+  glGetIntegerv( GL_BLEND_DST_ALPHA, &s.blend_dst_alpha );
+  glGetIntegerv( GL_CURRENT_PROGRAM, &s.program );
+  glGetIntegerv( GL_VERTEX_ARRAY_BINDING, &s.vao );
+  glGetIntegerv( GL_DRAW_FRAMEBUFFER_BINDING, &s.draw_framebuffer );
+  glGetIntegerv( GL_VIEWPORT, s.viewport );
+  glGetIntegerv( GL_UNPACK_ALIGNMENT, &s.unpack_alignment );
+  glGetIntegerv( GL_ARRAY_BUFFER_BINDING, &s.array_buffer );
+  glGetIntegerv( GL_DRAW_INDIRECT_BUFFER_BINDING, &s.indirect_buffer );
+  glGetIntegerv( GL_SHADER_STORAGE_BUFFER_BINDING, &s.storage_buffer );
+
+  for( int c = 0; c < 8; ++c )
+    glGetIntegeri_v( GL_SHADER_STORAGE_BUFFER_BINDING, c, &s.storage_buffers[c] );
+
+  GLboolean mask;
+  glGetBooleanv( GL_DEPTH_WRITEMASK, &mask );
+  s.depth_mask = mask;
+
+  GLint active;
+  glGetIntegerv( GL_ACTIVE_TEXTURE, &active );
+  s.active_texture = active - GL_TEXTURE0;
+
+  for( int c = 0; c < 3; ++c )
+  {
+    glActiveTexture( GL_TEXTURE0 + c );
+    glGetIntegerv( GL_TEXTURE_BINDING_2D, &s.texture_2d[c] );
+    glGetIntegerv( GL_TEXTURE_BINDING_2D_ARRAY, &s.texture_array[c] );
+    glGetIntegerv( GL_SAMPLER_BINDING, &s.sampler[c] );
+  }
+
+  glActiveTexture( active );
+  gl_gets += 34; //the glIsEnabled and glGet* calls above
+
+  gl_current = gl_caller;
+  gl_valid = true;
+  gl_dirty = false;
+}
+
+void library::restore_gl_state()
+{
+  if( !gl_valid || !gl_dirty )
+    return;
+
+  const font_gl_state& s = gl_caller;
+
+  set_capability( GL_CULL_FACE, s.cull != 0 );
+  set_capability( GL_DEPTH_TEST, s.depth != 0 );
+  set_capability( GL_BLEND, s.blend != 0 );
+  set_blend_func( s.blend_src_rgb, s.blend_dst_rgb, s.blend_src_alpha, s.blend_dst_alpha );
+  use_program( s.program );
+  bind_vertex_array( s.vao );
+  bind_draw_framebuffer( s.draw_framebuffer );
+  set_viewport( s.viewport[0], s.viewport[1], s.viewport[2], s.viewport[3] );
+  set_unpack_alignment( s.unpack_alignment );
+  bind_buffer( GL_ARRAY_BUFFER, s.array_buffer );
+  bind_buffer( GL_DRAW_INDIRECT_BUFFER, s.indirect_buffer );
+  set_depth_mask( s.depth_mask != 0 );
+
+  for( int c = 0; c < 8; ++c )
+    bind_storage_buffer( c, s.storage_buffers[c] );
+
+  bind_buffer( GL_SHADER_STORAGE_BUFFER, s.storage_buffer ); //after the indexed ones, they set the generic binding too
+
+  for( int c = 0; c < 3; ++c )
+  {
+    bind_texture( c, GL_TEXTURE_2D, s.texture_2d[c] );
+    bind_texture( c, GL_TEXTURE_2D_ARRAY, s.texture_array[c] );
+    bind_sampler( c, s.sampler[c] );
+  }
+
+  set_active_texture( s.active_texture );
+
+  gl_dirty = false;
+}
+
+void library::forget_texture( GLuint t )
+{
+  for( int c = 0; c < 3; ++c )
+  {
+    if( gl_current.texture_2d[c] == ( GLint )t )
+      gl_current.texture_2d[c] = 0;
+
+    if( gl_current.texture_array[c] == ( GLint )t )
+      gl_current.texture_array[c] = 0;
+  }
+}
+
+//counts the call, true if it has to be issued
+bool library::gl_count( bool changed )
+{
+  if( !changed )
+  {
+    ++gl_calls_skipped;
+    return false;
+  }
+
+  ++gl_calls;
+  gl_dirty = true;
+  return true;
+}
+
+bool library::gl_changed( GLint& cached, GLint val )
+{
+  if( !gl_count( cached != val ) )
+    return false;
+
+  cached = val;
+  return true;
+}
+
+void library::set_capability( GLenum cap, bool val )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  GLint& cached = cap == GL_CULL_FACE ? gl_current.cull : cap == GL_DEPTH_TEST ? gl_current.depth : gl_current.blend;
+
+  if( gl_changed( cached, val ) )
+  {
+    if( val )
+      glEnable( cap );
+    else
+      glDisable( cap );
+  }
+}
+
+void library::set_blend_func( GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  font_gl_state& s = gl_current;
+
+  //one call sets all four
+  if( gl_count( s.blend_src_rgb != ( GLint )src_rgb || s.blend_dst_rgb != ( GLint )dst_rgb ||
+                s.blend_src_alpha != ( GLint )src_alpha || s.blend_dst_alpha != ( GLint )dst_alpha ) )
+  {
+    s.blend_src_rgb = src_rgb;
+    s.blend_dst_rgb = dst_rgb;
+    s.blend_src_alpha = src_alpha;
+    s.blend_dst_alpha = dst_alpha;
+    glBlendFuncSeparate( src_rgb, dst_rgb, src_alpha, dst_alpha );
+  }
+}
+
+void library::use_program( GLuint p )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.program, p ) )
+    glUseProgram( p );
+}
+
+void library::bind_vertex_array( GLuint v )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.vao, v ) )
+    glBindVertexArray( v );
+}
+
+void library::bind_draw_framebuffer( GLuint f )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.draw_framebuffer, f ) )
+    glBindFramebuffer( GL_DRAW_FRAMEBUFFER, f );
+}
+
+void library::set_viewport( GLint x, GLint y, GLint w, GLint h )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  GLint* v = gl_current.viewport;
+
+  if( gl_count( v[0] != x || v[1] != y || v[2] != w || v[3] != h ) )
+  {
+    v[0] = x;
+    v[1] = y;
+    v[2] = w;
+    v[3] = h;
+    glViewport( x, y, w, h );
+  }
+}
+
+void library::set_unpack_alignment( GLint a )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.unpack_alignment, a ) )
+    glPixelStorei( GL_UNPACK_ALIGNMENT, a );
+}
+
+void library::bind_buffer( GLenum target, GLuint b )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  GLint& cached = target == GL_ARRAY_BUFFER ? gl_current.array_buffer : target == GL_DRAW_INDIRECT_BUFFER ? gl_current.indirect_buffer : gl_current.storage_buffer;
+
+  if( gl_changed( cached, b ) )
+    glBindBuffer( target, b );
+}
+
+void library::bind_storage_buffer( GLuint index, GLuint b )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.storage_buffers[index], b ) )
+  {
+    glBindBufferBase( GL_SHADER_STORAGE_BUFFER, index, b );
+    gl_current.storage_buffer = b;
+  }
+}
+
+void library::set_depth_mask( bool val )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.depth_mask, val ) )
+    glDepthMask( val );
+}
+
+void library::set_active_texture( GLint unit )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.active_texture, unit ) )
+    glActiveTexture( GL_TEXTURE0 + unit );
+}
+
+void library::bind_texture( GLint unit, GLenum target, GLuint t )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  GLint& cached = target == GL_TEXTURE_2D ? gl_current.texture_2d[unit] : gl_current.texture_array[unit];
+
+  if( gl_changed( cached, t ) )
+  {
+    set_active_texture( unit );
+    glBindTexture( target, t );
+  }
+}
+
+void library::bind_sampler( GLint unit, GLuint s )
+{
+  if( !gl_valid )
+    capture_gl_state();
+
+  if( gl_changed( gl_current.sampler[unit], s ) )
+    glBindSampler( unit, s );
+}
+
+//sets up the quad and the instance stream on the currently bound vao
+void library::set_instance_attribs( GLuint buffer, size_t offset )
+{
+  bind_buffer( GL_ARRAY_BUFFER, vbos[FONT_VERTEX] );
+  glEnableVertexAttribArray( FONT_VERTEX );
+  glVertexAttribPointer( FONT_VERTEX, 2, GL_FLOAT, false, 0, 0 );
+
+  bind_buffer( GL_ARRAY_BUFFER, vbos[FONT_TEXCOORD] );
+  glEnableVertexAttribArray( FONT_TEXCOORD );
+  glVertexAttribPointer( FONT_TEXCOORD, 2, GL_FLOAT, false, 0, 0 );
+
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, vbos[FONT_FACE] );
+
+  font_instance i;
+  char* base = ( char* )0 + offset;
+  GLsizei stride = sizeof( font_instance );
+
+  bind_buffer( GL_ARRAY_BUFFER, buffer );
+
+  glEnableVertexAttribArray( FONT_VERTSCALEBIAS );
+  glVertexAttribPointer( FONT_VERTSCALEBIAS, 4, GL_FLOAT, false, stride, base + ( ( char* )&i.vertscalebias - ( char* )&i ) );
+  glVertexAttribDivisor( FONT_VERTSCALEBIAS, 1 );
+
+  glEnableVertexAttribArray( FONT_TEXSCALEBIAS );
+  glVertexAttribPointer( FONT_TEXSCALEBIAS, 4, GL_FLOAT, false, stride, base + ( ( char* )&i.texscalebias - ( char* )&i ) );
+  glVertexAttribDivisor( FONT_TEXSCALEBIAS, 1 );
+
+  glEnableVertexAttribArray( FONT_COLOR );
+  glVertexAttribPointer( FONT_COLOR, 4, GL_FLOAT, false, stride, base + ( ( char* )&i.color - ( char* )&i ) );
+  glVertexAttribDivisor( FONT_COLOR, 1 );
+
+  for( int c = 0; c < 4; ++c )
+  {
+    glEnableVertexAttribArray( FONT_TRANSFORM + c );
+    glVertexAttribPointer( FONT_TRANSFORM + c, 4, GL_FLOAT, false, stride, base + ( ( char* )&i.transform - ( char* )&i ) + sizeof( mm::vec4 ) * c );
+    glVertexAttribDivisor( FONT_TRANSFORM + c , 1 );
+  }
+
+  glEnableVertexAttribArray( FONT_FILTER+3 );
+  glVertexAttribPointer( FONT_FILTER+3, 1, GL_FLOAT, false, stride, base + ( ( char* )&i.filter - ( char* )&i ) );
+  glVertexAttribDivisor( FONT_FILTER+3, 1 );
+
+  glEnableVertexAttribArray( FONT_LAYER+3 );
+  glVertexAttribPointer( FONT_LAYER+3, 1, GL_FLOAT, false, stride, base + ( ( char* )&i.layer - ( char* )&i ) );
+  glVertexAttribDivisor( FONT_LAYER+3, 1 );
+}
+
+void library::set_up()
+{
+  if( is_set_up ) return;
+
+  texture_pen = mm::uvec2( 0 );
+  page_count = 0;
+  current_page = 0;
+
+  glGenSamplers( 1, &texsampler_point );
+  glGenSamplers( 1, &texsampler_linear );
+  glGenSamplers( 1, &texsampler_mip );
+
+  glSamplerParameteri( texsampler_point, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+  glSamplerParameteri( texsampler_point, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+  glSamplerParameteri( texsampler_point, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+  glSamplerParameteri( texsampler_point, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+
+  glSamplerParameteri( texsampler_linear, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+  glSamplerParameteri( texsampler_linear, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+  glSamplerParameteri( texsampler_linear, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+  glSamplerParameteri( texsampler_linear, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+
+  glSamplerParameteri( texsampler_mip, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+  glSamplerParameteri( texsampler_mip, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+  glSamplerParameteri( texsampler_mip, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+  glSamplerParameteri( texsampler_mip, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+
+  std::vector<unsigned> faces;
+  std::vector<float> vertices;
+  std::vector<float> texcoords;
+  faces.resize( 2 * 3 );
+  vertices.resize( 4 * 2 );
+  texcoords.resize( 4 * 2 );
+
+  faces[0*3+0] = 2;
+  faces[0*3+1] = 1;
+  faces[0*3+2] = 0;
+
+  faces[1*3+0] = 0;
+  faces[1*3+1] = 3;
+  faces[1*3+2] = 2;
+
+  vertices[0*2+0] = 0;
+  vertices[0*2+1] = 0;
+
+  vertices[1*2+0] = 0;
+  vertices[1*2+1] = 1;
+
+  vertices[2*2+0] = 1;
+  vertices[2*2+1] = 1;
+
+  vertices[3*2+0] = 1;
+  vertices[3*2+1] = 0;
+
+  texcoords[0*2+0] = 0;
+  texcoords[0 * 2 + 1] = 0;
+
+  texcoords[1 * 2 + 0] = 0;
+  texcoords[1 * 2 + 1] = 1;
+
+  texcoords[2*2+0] = 1;
+  texcoords[2 * 2 + 1] = 1;
+
+  texcoords[3*2+0] = 1;
+  texcoords[3 * 2 + 1] = 0;
+
+  glGetIntegerv( GL_MAX_TEXTURE_SIZE, &max_texture_size );
+
+  glGenVertexArrays( 1, &vao );
+  bind_vertex_array( vao );
+
+  glGenBuffers( 1, &vbos[FONT_VERTEX] );
+  bind_buffer( GL_ARRAY_BUFFER, vbos[FONT_VERTEX] );
+  glBufferData( GL_ARRAY_BUFFER, sizeof( float ) * vertices.size(), &vertices[0], GL_STATIC_DRAW );
+
+  glGenBuffers( 1, &vbos[FONT_TEXCOORD] );
+  bind_buffer( GL_ARRAY_BUFFER, vbos[FONT_TEXCOORD] );
+  glBufferData( GL_ARRAY_BUFFER, sizeof( float ) * texcoords.size(), &texcoords[0], GL_STATIC_DRAW );
+
+  glGenBuffers( 1, &vbos[FONT_FACE] );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, vbos[FONT_FACE] );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof( unsigned ) * faces.size(), &faces[0], GL_STATIC_DRAW );
+
+  glGenBuffers( 1, &vbos[FONT_INSTANCES] );
+  set_instance_attribs( vbos[FONT_INSTANCES], 0 );
+
+  glGenBuffers( 1, &vbos[FONT_LAYERS] );
+  glGenBuffers( 1, &vbos[FONT_INDIRECT] );
+  glGenBuffers( 1, &vbos[FONT_BLOCK] );
+
+  glGenVertexArrays( 1, &blit_vao );
+
+  glGenBuffers( 1, &vbos[FONT_WORLD_GLYPHS] );
+  glGenBuffers( 1, &vbos[FONT_WORLD_LABELS] );
+  glGenBuffers( 1, &vbos[FONT_WORLD_COMMANDS] );
+
+  glGenVertexArrays( 1, &world_vao );
+  bind_vertex_array( world_vao );
+  set_instance_attribs( vbos[FONT_WORLD_GLYPHS], 0 );
+
+  glGenBuffers( 1, &vbos[FONT_GPU_CODEPOINTS] );
+  glGenBuffers( 1, &vbos[FONT_GPU_GLYPHS] );
+  glGenBuffers( 1, &vbos[FONT_GPU_KERNING] );
+  glGenBuffers( 1, &vbos[FONT_GPU_BLOCKS] );
+  glGenBuffers( 1, &vbos[FONT_GPU_INSTANCES] );
+  glGenBuffers( 1, &vbos[FONT_GPU_STATUS] );
+
+  bind_buffer( GL_SHADER_STORAGE_BUFFER, vbos[FONT_GPU_STATUS] );
+  glBufferData( GL_SHADER_STORAGE_BUFFER, FONT_GPU_STATUS_HEADER + sizeof( GLuint ) * 2 * FONT_GPU_MISSING, 0, GL_DYNAMIC_COPY );
+
+  glGenVertexArrays( 1, &gpu_vao );
+  bind_vertex_array( gpu_vao );
+  set_instance_attribs( vbos[FONT_GPU_INSTANCES], 0 );
+
+  restore_gl_state();
+
+  is_set_up = true;
+}
+
+bool library::add_page()
+{
+  if( !free_pages.empty() )
+  {
+    current_page = free_pages.back();
+    free_pages.pop_back();
+    texture_pen = mm::uvec2( 0 );
+    texture_row_h = 0;
+    return true;
+  }
+
+  if( page_count >= FONT_ATLAS_MAX_PAGES ) //can't expand tex further
+  {
+    return false;
+  }
+
+  if( page_count == page_capacity )
+  {
+    //grow the layer capacity geometrically, the copy stays on the gpu
+    unsigned int new_capacity = page_capacity ? std::min( page_capacity * 2, ( unsigned int )FONT_ATLAS_MAX_PAGES ) : get_channels();
+
+    GLuint new_tex;
+    alloc_tex( new_tex, new_capacity );
+
+    for( unsigned int l = 0; l < mip_levels && page_count > 0; ++l )
+    {
+      glCopyImageSubData( tex, GL_TEXTURE_2D_ARRAY, l, 0, 0, 0,
+                          new_tex, GL_TEXTURE_2D_ARRAY, l, 0, 0, 0,
+                          FONT_ATLAS_PAGE_SIZE >> l, FONT_ATLAS_PAGE_SIZE >> l, get_layers( page_count ) );
+    }
+
+    glDeleteTextures( 1, &tex );
+    forget_texture( tex );
+    tex = new_tex;
+    page_capacity = new_capacity;
+  }
+
+  //pages are not cleared, every glyph is uploaded with an empty gutter
+  current_page = page_count++;
+  page_live.resize( page_count, 0 );
+  texture_pen = mm::uvec2( 0 );
+  texture_row_h = 0;
+
+  return true;
+}
+
+//scratch buffers only grow, a growth counts as a trip to the heap
+GLubyte* library::get_scratch( std::vector<GLubyte>& v, size_t n )
+{
+  if( n > v.capacity() )
+    ++heap_allocs;
+
+  if( v.size() < n )
+    v.resize( n );
+
+  return v.empty() ? 0 : &v[0];
+}
+
+void* library::pool_alloc( size_t size )
+{
+  //the maps allocate nodes one by one, anything else goes to the heap
+  if( size < sizeof( void* ) )
+    size = sizeof( void* );
+
+  font_node_pool* pool = 0;
+
+  for( auto& p : node_pools )
+  {
+    if( p.size == size )
+      pool = &p;
+  }
+
+  if( !pool )
+  {
+    font_node_pool p;
+    p.size = size;
+    p.free_list = 0;
+    p.live = 0;
+    node_pools.push_back( p );
+    pool = &node_pools.back();
+  }
+
+  if( !pool->free_list )
+  {
+    //a new chunk, threaded onto the free list
+    char* chunk = new char[size * FONT_POOL_CHUNK];
+    pool->chunks.push_back( chunk );
+    ++heap_allocs;
+
+    for( int c = FONT_POOL_CHUNK - 1; c >= 0; --c )
+    {
+      *( void** )( chunk + c * size ) = pool->free_list;
+      pool->free_list = chunk + c * size;
+    }
+  }
+
+  void* r = pool->free_list;
+  pool->free_list = *( void** )r;
+  ++pool->live;
+  return r;
+}
+
+void library::pool_free( void* p, size_t size )
+{
+  if( size < sizeof( void* ) )
+    size = sizeof( void* );
+
+  for( auto& n : node_pools )
+  {
+    if( n.size == size )
+    {
+      *( void** )p = n.free_list;
+      n.free_list = p;
+      --n.live;
+      return;
+    }
+  }
+}
+
+void* font_pool_alloc( size_t size )
+{
+  return library::get().pool_alloc( size );
+}
+
+void font_pool_free( void* p, size_t size )
+{
+  library::get().pool_free( p, size );
+}
+
+//layers of the atlas' storage format for the given number of pages
+void library::alloc_tex( GLuint& t, unsigned int pages )
+{
+  GLenum format = atlas_format == FONT_ATLAS_PACKED ? GL_RGBA8 : atlas_format == FONT_ATLAS_BC4 ? GL_COMPRESSED_RED_RGTC1 : GL_R8;
+
+  glGenTextures( 1, &t );
+  bind_texture( 0, GL_TEXTURE_2D_ARRAY, t );
+  glTexStorage3D( GL_TEXTURE_2D_ARRAY, mip_levels, format, FONT_ATLAS_PAGE_SIZE, FONT_ATLAS_PAGE_SIZE, get_layers( pages ) );
+}
+
+//palette of a bc4 block, 8 interpolated values if r0 > r1, else 6 plus 0 and 255
+static void bc4_palette( int r0, int r1, int* p )
+{
+  p[0] = r0;
+  p[1] = r1;
+
+  if( r0 > r1 )
+  {
+    for( int c = 1; c < 7; ++c )
+      p[c + 1] = ( ( 7 - c ) * r0 + c * r1 + 3 ) / 7;
+  }
+  else
+  {
+    for( int c = 1; c < 5; ++c )
+      p[c + 1] = ( ( 5 - c ) * r0 + c * r1 + 2 ) / 5;
+
+    p[6] = 0;
+    p[7] = 255;
+  }
+}
+
+//picks the nearest palette entry for each texel, returns the squared error
+static unsigned int bc4_indices( const int* p, const GLubyte* texels, unsigned long long& bits, int& max_error )
+{
+  unsigned int error = 0;
+  bits = 0;
+
+  for( int c = 0; c < 16; ++c )
+  {
+    int best = 0, best_d = 256;
+
+    for( int i = 0; i < 8; ++i )
+    {
+      int d = std::abs( p[i] - texels[c] );
+
+      if( d < best_d )
+      {
+        best = i;
+        best_d = d;
+      }
+    }
+
+    bits |= ( unsigned long long )best << ( 3 * c );
+    error += best_d * best_d;
+    max_error = std::max( max_error, best_d );
+  }
+
+  return error;
+}
+
+//encodes a 4x4 block, trying the min/max ramp and the ramp between the inner values with exact 0 and 255
+//glyph edges are mostly black, white and a few values in between, the second mode usually wins there
+static unsigned int bc4_encode( const GLubyte* texels, GLubyte* block, int& max_error )
+{
+  int lo = 255, hi = 0, inner_lo = 255, inner_hi = 0;
+
+  for( int c = 0; c < 16; ++c )
+  {
+    lo = std::min( lo, ( int )texels[c] );
+    hi = std::max( hi, ( int )texels[c] );
+
+    if( texels[c] > 0 && texels[c] < 255 )
+    {
+      inner_lo = std::min( inner_lo, ( int )texels[c] );
+      inner_hi = std::max( inner_hi, ( int )texels[c] );
+    }
+  }
+
+  if( inner_lo > inner_hi )
+    inner_lo = inner_hi = lo;
+
+  int p[8];
+  unsigned long long bits;
+  int r0 = inner_lo, r1 = inner_hi, max6 = 0;
+  bc4_palette( r0, r1, p );
+  unsigned int error = bc4_indices( p, texels, bits, max6 );
+
+  if( hi > lo && error )
+  {
+    unsigned long long bits8;
+    int max8 = 0;
+    bc4_palette( hi, lo, p );
+    unsigned int error8 = bc4_indices( p, texels, bits8, max8 );
+
+    if( error8 < error )
+    {
+      r0 = hi;
+      r1 = lo;
+      bits = bits8;
+      error = error8;
+      max6 = max8;
+    }
+  }
+
+  max_error = std::max( max_error, max6 );
+
+  block[0] = ( GLubyte )r0;
+  block[1] = ( GLubyte )r1;
+
+  for( int c = 0; c < 6; ++c )
+    block[c + 2] = ( GLubyte )( bits >> ( 8 * c ) );
+
+  return error;
+}
+
+void library::upload_level( unsigned int page, unsigned int level, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const GLubyte* data )
+{
+  if( atlas_format == FONT_ATLAS_PACKED )
+  {
+    //r8 can't be written into one channel of an rgba8 texture by the upload path, the pack shader merges it
+    size_t bytes = ( w * h + 3 ) / 4 * 4;
+    GLubyte* texels = get_scratch( encode_scratch, bytes );
+    memcpy( texels, data, w * h );
+    memset( texels + w * h, 0, bytes - w * h );
+
+    bind_buffer( GL_SHADER_STORAGE_BUFFER, vbos[FONT_PACK] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, bytes, texels, GL_STREAM_DRAW );
+
+    use_program( the_pack_shader );
+    glUniform4i( 0, x, y, w, h );
+    glUniform1i( 1, page / 4 );
+    glUniform1i( 2, page % 4 );
+    bind_storage_buffer( 0, vbos[FONT_PACK] );
+    glBindImageTexture( 0, tex, level, GL_TRUE, 0, GL_READ_WRITE, GL_RGBA8 );
+
+    glDispatchCompute( ( w + 7 ) / 8, ( h + 7 ) / 8, 1 );
+    glMemoryBarrier( GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT );
+    return;
+  }
+
+  if( atlas_format == FONT_ATLAS_BC4 )
+  {
+    //cells are 4x4 block aligned on every level, see get_align
+    unsigned int bx = w / 4, by = h / 4;
+    GLubyte* blocks = get_scratch( encode_scratch, bx * by * 8 );
+
+    for( unsigned int yy = 0; yy < by; ++yy )
+    {
+      for( unsigned int xx = 0; xx < bx; ++xx )
+      {
+        GLubyte texels[16];
+
+        for( int r = 0; r < 4; ++r )
+          memcpy( texels + r * 4, data + ( yy * 4 + r ) * w + xx * 4, 4 );
+
+        atlas_error_sq += bc4_encode( texels, blocks + ( yy * bx + xx ) * 8, atlas_error_max );
+      }
+    }
+
+    atlas_error_texels += w * h;
+
+    bind_texture( 0, GL_TEXTURE_2D_ARRAY, tex );
+    glCompressedTexSubImage3D( GL_TEXTURE_2D_ARRAY, level, x, y, page, w, h, 1, GL_COMPRESSED_RED_RGTC1, ( GLsizei )( bx * by * 8 ), blocks );
+    return;
+  }
+
+  bind_texture( 0, GL_TEXTURE_2D_ARRAY, tex );
+  glTexSubImage3D( GL_TEXTURE_2D_ARRAY, level, x, y, page, w, h, 1, GL_RED, GL_UNSIGNED_BYTE, data );
+}
+
+void library::upload_cell( unsigned int page, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const GLubyte* data )
+{
+  upload_level( page, 0, x, y, w, h, data );
+
+  if( mip_levels < 2 )
+    return;
+
+  //cells are aligned to get_align() so each level maps to its own texels
+  //only the dirty cell is filtered and uploaded, the rest of the chain is untouched
+  const GLubyte* src = data;
+  GLubyte* dst = get_scratch( mip_scratch, w * h / 2 );
+
+  for( unsigned int l = 1; l < mip_levels; ++l )
+  {
+    unsigned int sw = w;
+    w /= 2;
+    h /= 2;
+    x /= 2;
+    y /= 2;
+
+    for( unsigned int yy = 0; yy < h; ++yy )
+    {
+      for( unsigned int xx = 0; xx < w; ++xx )
+      {
+        const GLubyte* s0 = src + ( yy * 2 ) * sw + xx * 2;
+        const GLubyte* s1 = s0 + sw;
+        dst[yy * w + xx] = ( GLubyte )( ( s0[0] + s0[1] + s1[0] + s1[1] + 2 ) / 4 );
+      }
+    }
+
+    upload_level( page, l, x, y, w, h, dst );
+
+    src = dst;
+    dst += w * h;
+  }
+}
+
+void library::set_mip_levels( unsigned int levels )
+{
+  if( levels == mip_levels )
+    return;
+
+  //storage levels are immutable, start over with a new texture
+  delete_glyphs();
+  glDeleteTextures( 1, &tex );
+  forget_texture( tex );
+  tex = 0;
+  page_capacity = 0;
+  mip_levels = levels;
+}
+
+void library::set_atlas_format( int format )
+{
+  if( format == atlas_format )
+    return;
+
+  if( format == FONT_ATLAS_PACKED && !the_pack_shader )
+  {
+    std::cerr << "The packed atlas needs the pack shader." << std::endl;
+    return;
+  }
+
+  //same as a new mip chain, the storage format is immutable
+  delete_glyphs();
+  glDeleteTextures( 1, &tex );
+  forget_texture( tex );
+  tex = 0;
+  page_capacity = 0;
+  atlas_format = format;
+  atlas_error_sq = 0;
+  atlas_error_texels = 0;
+  atlas_error_max = 0;
+}
+
+//where a glyph's cell is, the inverse of the placement in load_glyph
+void library::get_cell( const glyph& g, font_defrag_move& m )
+{
+  unsigned int gutter = get_gutter();
+  unsigned int align = get_align();
+
+  m.g = ( glyph* )&g;
+  m.page = g.page;
+  m.x = ( unsigned int )std::floor( g.texcoords[0] + 0.5f ) - g.page * FONT_ATLAS_PAGE_SIZE - gutter;
+  m.y = ( unsigned int )std::floor( g.texcoords[1] + 0.5f ) - gutter;
+  m.w = ( ( unsigned int )g.w + 2 * gutter + align - 1 ) / align * align;
+  m.h = ( ( unsigned int )g.h + 2 * gutter + align - 1 ) / align * align;
+}
+
+//shelf packs m after the pen, the same way load_glyph does
+static void pack_cell( font_defrag_move& m, unsigned int& page, mm::uvec2& pen, GLint& row_h )
+{
+  if( pen.x + m.w > FONT_ATLAS_PAGE_SIZE )
+  {
+    pen.y += row_h;
+    pen.x = 0;
+    row_h = 0;
+  }
+
+  if( pen.y + m.h > FONT_ATLAS_PAGE_SIZE )
+  {
+    ++page;
+    pen = mm::uvec2( 0 );
+    row_h = 0;
+  }
+
+  m.new_page = page;
+  m.new_x = pen.x;
+  m.new_y = pen.y;
+
+  pen.x += m.w;
+  row_h = std::max( row_h, ( GLint )m.h );
+}
+
+//measures the fragmentation, and if compaction pays off plans it and allocates the target texture
+bool library::plan_defrag()
+{
+  //fragmentation only grows when glyphs are released
+  //packed pages share layers, a cell copy would carry the other three channels along
+  if( defrag_checked == releases || page_count < 1 || atlas_format == FONT_ATLAS_PACKED )
+    return false;
+
+  defrag_checked = releases;
+  defrag_moves.clear();
+
+  size_t live = 0;
+
+  for( auto& f : font_files )
+  {
+    for( auto& s : f.second->glyphs )
+    {
+      for( auto& g : s.second )
+      {
+        font_defrag_move m;
+        get_cell( g.second, m );
+        live += m.w * m.h;
+        defrag_moves.push_back( m );
+      }
+    }
+  }
+
+  if( live >= defrag_fill * page_capacity * FONT_ATLAS_PAGE_SIZE * FONT_ATLAS_PAGE_SIZE )
+  {
+    defrag_moves.clear();
+    return false;
+  }
+
+  //tallest first keeps the shelves tight
+  std::sort( defrag_moves.begin(), defrag_moves.end(), []( const font_defrag_move& a, const font_defrag_move& b )
+  {
+    return a.h != b.h ? a.h > b.h : a.w > b.w;
+  } );
+
+  defrag_page = 0;
+  defrag_pen = mm::uvec2( 0 );
+  defrag_row_h = 0;
+
+  for( auto& m : defrag_moves )
+    pack_cell( m, defrag_page, defrag_pen, defrag_row_h );
+
+  defrag_pages = defrag_page + 1;
+
+  if( defrag_pages >= page_capacity )
+  {
+    defrag_moves.clear();
+    return false;
+  }
+
+  alloc_tex( defrag_tex, defrag_pages );
+  restore_gl_state();
+
+  defrag_next = 0;
+  defrag_generation = generation;
+  defrag_releases = releases;
+  return true;
+}
+
+void library::drop_defrag()
+{
+  glDeleteTextures( 1, &defrag_tex );
+  forget_texture( defrag_tex );
+  defrag_tex = 0;
+  defrag_moves.clear();
+  defrag_next = 0;
+}
+
+//copies cells until the frame's budget is spent, the pass is swapped in once all are there
+void library::defrag_step()
+{
+  if( !defrag_budget_us || frame_uploads )
+    return;
+
+  if( defrag_tex && ( defrag_generation != generation || defrag_releases != releases ) )
+    drop_defrag();
+
+  if( !defrag_tex && !plan_defrag() )
+    return;
+
+  auto start = std::chrono::steady_clock::now();
+
+  while( defrag_next < defrag_moves.size() )
+  {
+    //gutters are copied along, and cells are aligned so every mip level maps to its own texels
+    const font_defrag_move& m = defrag_moves[defrag_next++];
+
+    for( unsigned int l = 0; l < mip_levels; ++l )
+    {
+      glCopyImageSubData( tex, GL_TEXTURE_2D_ARRAY, l, m.x >> l, m.y >> l, m.page,
+                          defrag_tex, GL_TEXTURE_2D_ARRAY, l, m.new_x >> l, m.new_y >> l, m.new_page,
+                          m.w >> l, m.h >> l, 1 );
+    }
+
+    if( std::chrono::duration_cast< std::chrono::microseconds >( std::chrono::steady_clock::now() - start ).count() >= defrag_budget_us )
+      break;
+  }
+
+  if( defrag_next == defrag_moves.size() && !finish_defrag() )
+    drop_defrag();
+}
+
+//end of frame, nothing refers to the old texture coordinates anymore
+bool library::finish_defrag()
+{
+  //glyphs rasterized on the busy frames in between are packed after the planned ones
+  std::unordered_set<glyph*> moved;
+  size_t planned = defrag_moves.size();
+
+  for( auto& m : defrag_moves )
+    moved.insert( m.g );
+
+  for( auto& f : font_files )
+  {
+    for( auto& s : f.second->glyphs )
+    {
+      for( auto& g : s.second )
+      {
+        if( moved.count( &g.second ) )
+          continue;
+
+        font_defrag_move m;
+        get_cell( g.second, m );
+        pack_cell( m, defrag_page, defrag_pen, defrag_row_h );
+
+        if( defrag_page >= defrag_pages )
+          return false;
+
+        defrag_moves.push_back( m );
+      }
+    }
+  }
+
+  for( size_t c = planned; c < defrag_moves.size(); ++c )
+  {
+    const font_defrag_move& m = defrag_moves[c];
+
+    for( unsigned int l = 0; l < mip_levels; ++l )
+    {
+      glCopyImageSubData( tex, GL_TEXTURE_2D_ARRAY, l, m.x >> l, m.y >> l, m.page,
+                          defrag_tex, GL_TEXTURE_2D_ARRAY, l, m.new_x >> l, m.new_y >> l, m.new_page,
+                          m.w >> l, m.h >> l, 1 );
+    }
+  }
+
+  font_cache_write w( cache_lock );
+
+  page_live.assign( defrag_pages, 0 );
+
+  for( auto& m : defrag_moves )
+  {
+    float dx = ( float )( ( int )( m.new_page * FONT_ATLAS_PAGE_SIZE + m.new_x ) - ( int )( m.page * FONT_ATLAS_PAGE_SIZE + m.x ) );
+    float dy = ( float )( ( int )m.new_y - ( int )m.y );
+
+    m.g->texcoords[0] += dx;
+    m.g->texcoords[1] += dy;
+    m.g->texcoords[2] += dx;
+    m.g->texcoords[3] += dy;
+    m.g->page = m.new_page;
+
+    fontscalebias& fsb = font_data[m.g->cache_index];
+    fsb.texscalebias.z += dx;
+    fsb.texscalebias.w += dy;
+
+    ++page_live[m.new_page];
+  }
+
+  glDeleteTextures( 1, &tex );
+  forget_texture( tex );
+  tex = defrag_tex;
+  defrag_tex = 0;
+
+  page_count = defrag_pages;
+  page_capacity = defrag_pages;
+  current_page = defrag_page;
+  texture_pen = defrag_pen;
+  texture_row_h = defrag_row_h;
+  free_pages.clear();
+
+  defrag_moves.clear();
+  defrag_next = 0;
+  ++defrag_passes;
+
+  //every glyph moved, laid out instances kept across frames are stale
+  ++generation;
+  ++releases;
+  defrag_checked = releases;
+
+  return true;
+}
+
+font_inst::face::face() : size( 0 ), the_face( 0 ), the_size( 0 ), file( 0 ), glyphs( 0 ) {}
+
+font_inst::face::face( const std::string& filename, unsigned int index ) : size( 0 ), the_face( 0 ), the_size( 0 ), file( 0 ), glyphs( 0 )
+{
+  upos = 0;
+  uthick = 0;
+
+  file = library::get().acquire_font_file( filename, index );
+
+  if( file )
+  {
+    the_face = file->face;
+    glyphs = &file->glyphs;
+
+    FT_Error error = FT_New_Size( ( FT_Face )the_face, ( FT_Size* )&the_size );
+
+    if( error )
+    {
+      std::cerr << "Error creating font size: " << filename << std::endl;
+      library::get().release_font_file( file );
+      file = 0;
+      the_face = 0;
+      the_size = 0;
+    }
+  }
+
+  if( !file )
+  {
+    //keep a private empty cache so lookups stay valid
+    glyphs = new std::map< unsigned int, font_glyph_map >();
+  }
+}
+
+font_inst::face::~face()
+{
+  if( file )
+  {
+    FT_Done_Size( ( FT_Size )the_size );
+    library::get().release_font_file( file );
+  }
+  else
+  {
+    delete glyphs;
+  }
+}
+
+//the FT_Face is shared, make our size the active one before using it
+void font_inst::face::activate()
+{
+  if( the_face && ( ( FT_Face )the_face )->size != ( FT_Size )the_size )
+    FT_Activate_Size( ( FT_Size )the_size );
+}
+
+font_inst::~font_inst()
+{
+  auto& instances = library::get().instances;
+  instances.erase( std::remove( instances.begin(), instances.end(), this ), instances.end() );
+  delete the_face;
+}
+
+void font_inst::face::set_size( unsigned int val )
+{
+  if( the_face )
+  {
+    size = val;
+
+    activate();
+    FT_Set_Char_Size( ( FT_Face )the_face, size * 100.0f * 64.0f, 0.0f, 72 * 64.0f, 72 );
+    asc = ( ( ( FT_Face )the_face )->size->metrics.ascender / 64.0f ) / 100.0f;
+    desc = ( ( ( FT_Face )the_face )->size->metrics.descender / 64.0f ) / 100.0f;
+    h = ( ( ( FT_Face )the_face )->size->metrics.height / 64.0f ) / 100.0f;
+    gap = h - asc + desc;
+    
+    upos = ( ( FT_Face )the_face )->underline_position / (64.0f*64.0f) * size;
+    upos = std::round( upos );
+    
+    if( upos > -2 )
+    {
+      upos = -2;
+    }
+
+    uthick = ( ( FT_Face )the_face )->underline_thickness / (64.0f*64.0f) * size;
+    uthick = std::round( uthick );
+
+    if( uthick < 1 )
+    {
+      uthick = 1;
+    }
+
+    FT_Set_Char_Size( ( FT_Face )the_face, size * 64.0f, 0.0f, 72 * 64.0f, 72 );
+  }
+}
+
+//built-in rasterizer: outline edges accumulate signed area and cover into a float buffer,
+//a running sum along each row then gives the coverage (nonzero winding, approximated by the absolute sum)
+//the accumulation rows are w + 2 wide, edges touching the right border write past w
+struct font_raster
+{
+  float* acc;
+  int stride, w, h;
+  float left, top; //outline units to pixels: x - left, top - y
+  float x, y; //pen, in pixels
+};
+
+static void raster_line( font_raster& r, float x0, float y0, float x1, float y1 )
+{
+  if( y0 == y1 )
+    return;
+
+  float dir = 1;
+
+  if( y0 > y1 )
+  {
+    std::swap( x0, x1 );
+    std::swap( y0, y1 );
+    dir = -1;
+  }
+
+  float dxdy = ( x1 - x0 ) / ( y1 - y0 );
+  float x = x0;
+
+  if( y0 < 0 )
+    x -= y0 * dxdy;
+
+  int ystart = std::max( ( int )y0, 0 );
+  int yend = std::min( ( int )std::ceil( y1 ), r.h );
+
+  for( int y = ystart; y < yend; ++y )
+  {
+    float* row = r.acc + y * r.stride;
+    float dy = std::min( ( float )( y + 1 ), y1 ) - std::max( ( float )y, y0 );
+    float xnext = x + dxdy * dy;
+    float d = dy * dir;
+    float xa = std::max( std::min( x, xnext ), 0.0f );
+    float xb = std::min( std::max( x, xnext ), ( float )r.w );
+    float xa_floor = std::floor( xa );
+    int xai = ( int )xa_floor;
+    int xbi = ( int )std::ceil( xb );
+
+    if( xbi <= xai + 1 )
+    {
+      //within one pixel: the part right of the edge's midpoint goes to the next pixel
+      float xm = 0.5f * ( xa + xb ) - xa_floor;
+      row[xai] += d - d * xm;
+      row[xai + 1] += d * xm;
+    }
+    else
+    {
+      //spans pixels: trapezoid areas at the ends, a constant step in between
+      float s = 1.0f / ( xb - xa );
+      float xaf = xa - xa_floor;
+      float a0 = 0.5f * s * ( 1 - xaf ) * ( 1 - xaf );
+      float xbf = xb - xbi + 1;
+      float am = 0.5f * s * xbf * xbf;
+
+      row[xai] += d * a0;
+
+      if( xbi == xai + 2 )
+      {
+        row[xai + 1] += d * ( 1 - a0 - am );
+      }
+      else
+      {
+        float a1 = s * ( 1.5f - xaf );
+        row[xai + 1] += d * ( a1 - a0 );
+
+        for( int xi = xai + 2; xi < xbi - 1; ++xi )
+          row[xi] += d * s;
+
+        float a2 = a1 + ( xbi - xai - 3 ) * s;
+        row[xbi - 1] += d * ( 1 - a2 - am );
+      }
+
+      row[xbi] += d * am;
+    }
+
+    x = xnext;
+  }
+}
+
+static void raster_to( font_raster& r, float x, float y )
+{
+  raster_line( r, r.x, r.y, x, y );
+  r.x = x;
+  r.y = y;
+}
+
+//curves are flattened to within ~1/10 pixel
+#define FONT_RASTER_TOLERANCE 0.1f
+
+static int raster_move_to( const FT_Vector* to, void* user )
+{
+  font_raster& r = *( font_raster* )user;
+  r.x = to->x / 64.0f - r.left;
+  r.y = r.top - to->y / 64.0f;
+  return 0;
+}
+
+static int raster_line_to( const FT_Vector* to, void* user )
+{
+  font_raster& r = *( font_raster* )user;
+  raster_to( r, to->x / 64.0f - r.left, r.top - to->y / 64.0f );
+  return 0;
+}
+
+static int raster_conic_to( const FT_Vector* control, const FT_Vector* to, void* user )
+{
+  font_raster& r = *( font_raster* )user;
+  float x0 = r.x, y0 = r.y;
+  float x1 = control->x / 64.0f - r.left, y1 = r.top - control->y / 64.0f;
+  float x2 = to->x / 64.0f - r.left, y2 = r.top - to->y / 64.0f;
+
+  //the deviation from the chord is |p0 - 2p1 + p2| / 4, a segment of n takes 1/n^2 of it
+  float dd = std::sqrt( ( x0 - 2 * x1 + x2 ) * ( x0 - 2 * x1 + x2 ) + ( y0 - 2 * y1 + y2 ) * ( y0 - 2 * y1 + y2 ) );
+  int n = 1 + ( int )std::sqrt( dd / ( 4 * FONT_RASTER_TOLERANCE ) );
+
+  for( int c = 1; c <= n; ++c )
+  {
+    float t = ( float )c / n, u = 1 - t;
+    raster_to( r, u * u * x0 + 2 * u * t * x1 + t * t * x2, u * u * y0 + 2 * u * t * y1 + t * t * y2 );
+  }
+
+  return 0;
+}
+
+static int raster_cubic_to( const FT_Vector* control1, const FT_Vector* control2, const FT_Vector* to, void* user )
+{
+  font_raster& r = *( font_raster* )user;
+  float x0 = r.x, y0 = r.y;
+  float x1 = control1->x / 64.0f - r.left, y1 = r.top - control1->y / 64.0f;
+  float x2 = control2->x / 64.0f - r.left, y2 = r.top - control2->y / 64.0f;
+  float x3 = to->x / 64.0f - r.left, y3 = r.top - to->y / 64.0f;
+
+  float ddx = std::max( std::abs( x0 - 2 * x1 + x2 ), std::abs( x1 - 2 * x2 + x3 ) );
+  float ddy = std::max( std::abs( y0 - 2 * y1 + y2 ), std::abs( y1 - 2 * y2 + y3 ) );
+  int n = 1 + ( int )std::sqrt( 3 * std::sqrt( ddx * ddx + ddy * ddy ) / ( 4 * FONT_RASTER_TOLERANCE ) );
+
+  for( int c = 1; c <= n; ++c )
+  {
+    float t = ( float )c / n, u = 1 - t;
+    float a = u * u * u, b = 3 * u * u * t, d = 3 * u * t * t, e = t * t * t;
+    raster_to( r, a * x0 + b * x1 + d * x2 + e * x3, a * y0 + b * y1 + d * y2 + e * y3 );
+  }
+
+  return 0;
+}
+
+//running sums of the accumulated rows, 8 or 4 texels at a time where available
+static void raster_coverage( const float* acc, int stride, int w, int h, unsigned char* dst, int dst_stride )
+{
+  for( int y = 0; y < h; ++y )
+  {
+    const float* row = acc + y * stride;
+    unsigned char* out = dst + y * dst_stride;
+    int x = 0;
+    float sum = 0;
+
+#if defined( FONT_USE_AVX2 )
+    __m256 offset = _mm256_setzero_ps();
+    const __m256 abs_mask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7FFFFFFF ) );
+
+    for( ; x + 8 <= w; x += 8 )
+    {
+      //prefix sums within the two 128 bit lanes, then the low lane's total carried to the high one
+      __m256 v = _mm256_loadu_ps( row + x );
+      v = _mm256_add_ps( v, _mm256_castsi256_ps( _mm256_slli_si256( _mm256_castps_si256( v ), 4 ) ) );
+      v = _mm256_add_ps( v, _mm256_castsi256_ps( _mm256_slli_si256( _mm256_castps_si256( v ), 8 ) ) );
+      __m256 low = _mm256_shuffle_ps( v, v, 0xFF );
+      v = _mm256_add_ps( v, _mm256_permute2f128_ps( low, low, 0x08 ) );
+      v = _mm256_add_ps( v, offset );
+      offset = _mm256_shuffle_ps( v, v, 0xFF );
+      offset = _mm256_permute2f128_ps( offset, offset, 0x11 );
+
+      __m256 c = _mm256_min_ps( _mm256_and_ps( v, abs_mask ), _mm256_set1_ps( 1.0f ) );
+      __m256i i = _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( c, _mm256_set1_ps( 255.0f ) ), _mm256_set1_ps( 0.5f ) ) );
+      __m128i p = _mm_packs_epi32( _mm256_castsi256_si128( i ), _mm256_extractf128_si256( i, 1 ) );
+      _mm_storel_epi64( ( __m128i* )( out + x ), _mm_packus_epi16( p, p ) );
+    }
+
+    sum = _mm_cvtss_f32( _mm256_castps256_ps128( offset ) );
+#elif defined( FONT_USE_SSE2 )
+    __m128 offset = _mm_setzero_ps();
+    const __m128 abs_mask = _mm_castsi128_ps( _mm_set1_epi32( 0x7FFFFFFF ) );
+
+    for( ; x + 4 <= w; x += 4 )
+    {
+      __m128 v = _mm_loadu_ps( row + x );
+      v = _mm_add_ps( v, _mm_castsi128_ps( _mm_slli_si128( _mm_castps_si128( v ), 4 ) ) );
+      v = _mm_add_ps( v, _mm_castsi128_ps( _mm_slli_si128( _mm_castps_si128( v ), 8 ) ) );
+      v = _mm_add_ps( v, offset );
+      offset = _mm_shuffle_ps( v, v, 0xFF );
+
+      __m128 c = _mm_min_ps( _mm_and_ps( v, abs_mask ), _mm_set1_ps( 1.0f ) );
+      __m128i i = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( 255.0f ) ), _mm_set1_ps( 0.5f ) ) );
+      i = _mm_packs_epi32( i, i );
+      i = _mm_packus_epi16( i, i );
+      int packed = _mm_cvtsi128_si32( i );
+      memcpy( out + x, &packed, 4 );
+    }
+
+    sum = _mm_cvtss_f32( offset );
+#endif
+
+    for( ; x < w; ++x )
+    {
+      sum += row[x];
+      float c = std::min( std::abs( sum ), 1.0f );
+      out[x] = ( unsigned char )( c * 255.0f + 0.5f );
+    }
+  }
+}
+
+//rasterizes an outline's w x h pixels from (left, top) on, in outline pixels (y up), rows go top down
+static void raster_outline( FT_Outline* outline, int left, int top, int w, int h, std::vector<float>& acc, unsigned char* dst, int dst_stride )
+{
+  font_raster r;
+  r.stride = w + 2;
+  r.w = w;
+  r.h = h;
+  r.left = ( float )left;
+  r.top = ( float )top;
+  r.x = r.y = 0;
+
+  acc.assign( ( size_t )r.stride * h, 0.0f );
+  r.acc = acc.empty() ? 0 : &acc[0];
+
+  if( !r.acc )
+    return;
+
+  FT_Outline_Funcs funcs;
+  funcs.move_to = raster_move_to;
+  funcs.line_to = raster_line_to;
+  funcs.conic_to = raster_conic_to;
+  funcs.cubic_to = raster_cubic_to;
+  funcs.shift = 0;
+  funcs.delta = 0;
+
+  FT_Outline_Decompose( outline, &funcs, &r );
+
+  raster_coverage( r.acc, r.stride, w, h, dst, dst_stride );
+}
+
+//the outline's control box rounded out to pixels, the box freetype renders
+static void raster_box( FT_GlyphSlot g, int& left, int& top, int& w, int& h )
+{
+  FT_BBox box;
+  FT_Outline_Get_CBox( &g->outline, &box );
+  left = ( int )( box.xMin >> 6 );
+  top = ( int )( ( box.yMax + 63 ) >> 6 );
+  w = ( int )( ( box.xMax + 63 ) >> 6 ) - left;
+  h = top - ( int )( box.yMin >> 6 );
+}
+
+bool font_inst::face::load_glyph( unsigned int val, int rasterizer )
+{
+  if( ( *glyphs )[size].count( val ) == 0 && the_face )
   {
     FT_Error error;
 
-    FT_GlyphSlot theglyph = FT_GlyphSlot();
+    FT_GlyphSlot theglyph = FT_GlyphSlot();
+    FT_GlyphSlotRec_ placeholder = FT_GlyphSlotRec_();
+
+    //the built-in rasterizer takes the same hinted outline freetype would render
+    bool builtin = false;
+
+    if( val != wchar_t(-1) )
+    {
+      activate();
+      error = FT_Load_Char( ( FT_Face )the_face, ( const FT_UInt )val, rasterizer == FONT_RASTER_BUILTIN ? FT_LOAD_NO_BITMAP | FT_LOAD_FORCE_AUTOHINT : FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT );
+
+      if( error )
+      {
+        std::cerr << "Error loading character: " << ( wchar_t )val << std::endl;
+      }
+
+      theglyph = ( ( FT_Face )the_face )->glyph;
+
+      if( rasterizer == FONT_RASTER_BUILTIN && !error )
+      {
+        builtin = theglyph->format == FT_GLYPH_FORMAT_OUTLINE;
+
+        if( !builtin )
+          FT_Render_Glyph( theglyph, FT_RENDER_MODE_NORMAL );
+      }
+    }
+    else
+    {
+      theglyph = &placeholder;
+      theglyph->advance.x = 0;
+      theglyph->advance.y = 0;
+      static unsigned char data[4*4*3] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                          -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                          -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                          -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
+      theglyph->bitmap.buffer = data;
+      theglyph->bitmap.rows = 4;
+      theglyph->bitmap.width = 4;
+      theglyph->bitmap.pitch = 4;
+      theglyph->bitmap_left = 0;
+      theglyph->bitmap_top = 0;
+    }
+
+    auto& texpen = library::get().get_texture_pen();
+    auto& texrowh = library::get().get_tex_row_h();
+
+    if( library::get().get_page_count() == 0 )
+    {
+      if( !library::get().add_page() )
+        return false;
+    }
+
+    FT_Bitmap* bitmap = &theglyph->bitmap;
+    int bw = bitmap->width;
+    int bh = bitmap->rows;
+    int left = theglyph->bitmap_left;
+    int top = theglyph->bitmap_top;
+
+    if( builtin )
+      raster_box( theglyph, left, top, bw, bh );
+
+    //a cell is the glyph plus an empty gutter, rounded up to the alignment
+    int gutter = library::get().get_gutter();
+    int align = library::get().get_align();
+    int cw = ( bw + 2 * gutter + align - 1 ) / align * align;
+    int ch = ( bh + 2 * gutter + align - 1 ) / align * align;
+
+    if( cw > FONT_ATLAS_PAGE_SIZE || ch > FONT_ATLAS_PAGE_SIZE )
+    {
+      std::cerr << "Glyph doesn't fit into an atlas page: " << val << std::endl;
+      bw = 0;
+      bh = 0;
+      cw = ( 2 * gutter + align - 1 ) / align * align;
+      ch = cw;
+    }
+
+    if( texpen.x + cw > FONT_ATLAS_PAGE_SIZE )
+    {
+      texpen.y += texrowh;
+      texpen.x = 0;
+      texrowh = 0;
+    }
+
+    if( texpen.y + ch > FONT_ATLAS_PAGE_SIZE )
+    {
+      if( !library::get().add_page() )
+      {
+        //tex expansion unsuccessful
+        return false;
+      }
+    }
+
+    //the gutter is uploaded too, so pages never need clearing
+    int glyph_size = cw * ch;
+    GLubyte* data = library::get().get_scratch( library::get().glyph_scratch, glyph_size );
+    memset( data, 0, glyph_size );
+
+    if( builtin && bw > 0 && bh > 0 )
+    {
+      //straight into the cell, bottom row first like the copy below
+      library& l = library::get();
+      size_t capacity = l.raster_scratch.capacity();
+      raster_outline( &theglyph->outline, left, top, bw, bh, l.raster_scratch, data + ( bh - 1 + gutter ) * cw + gutter, -cw );
+
+      if( l.raster_scratch.capacity() != capacity )
+        ++l.heap_allocs;
+    }
+    else if( !builtin )
+    {
+      int c = 0;
+
+      for( int y = 0; y < bh; y++ )
+      {
+        for( int x = 0; x < bw; x++ )
+        {
+          data[( x + gutter ) + ( bh - 1 - y + gutter ) * cw] = bitmap->buffer[c++];
+        }
+
+        c += bitmap->pitch - bw;
+      }
+    }
+
+    //cached, the caller's alignment comes back with restore_gl_state
+    library::get().set_unpack_alignment( 1 );
+
+    unsigned int page = library::get().get_current_page();
+
+    library::get().upload_cell( page, texpen.x, texpen.y, cw, ch, data );
+    ++library::get().frame_uploads;
+
+    glyph* g = &( *glyphs )[size][val];
+
+    g->glyphid = FT_Get_Char_Index( ( FT_Face )the_face, ( const FT_ULong )val );
+    
+    g->offset_x = ( float )left;
+    g->offset_y = ( float )top;
+    g->w = ( float )bw;
+    g->h = ( float )bh;
+    g->page = page;
+
+    //texcoords are in texels, the page index is carried in x as page * FONT_ATLAS_PAGE_SIZE
+    float ix = ( float )( page * FONT_ATLAS_PAGE_SIZE + texpen.x + gutter );
+    float iy = ( float )( texpen.y + gutter );
+
+    if( val != wchar_t(-1) )
+    {
+      g->texcoords[0] = ix - 0.5f;
+      g->texcoords[1] = iy - 0.5f;
+      g->texcoords[2] = ix + ( float )bw + 0.5f;
+      g->texcoords[3] = iy + ( float )bh + 0.5f;
+    }
+    else
+    {
+      g->texcoords[0] = ix;
+      g->texcoords[1] = iy;
+      g->texcoords[2] = ix + ( float )bw;
+      g->texcoords[3] = iy + ( float )bh;
+    }
+
+    g->cell_bytes = 0;
+
+    for( int l = 0; l < ( int )library::get().mip_levels; ++l )
+      g->cell_bytes += ( cw >> l ) * ( ch >> l );
+
+    ++library::get().page_live[page];
+
+    if( file )
+    {
+      //sizes that were only warmed up count as used now
+      auto ins = file->sizes.insert( std::make_pair( size, font_size_info() ) );
+
+      if( ins.second )
+        ins.first->second.last_used = library::get().get_frame();
+
+      ins.first->second.atlas_bytes += g->cell_bytes;
+    }
+
+    texpen.x += cw;
+
+    if( ch > texrowh )
+    {
+      texrowh = ch;
+    }
+
+    g->advance = theglyph->advance;
+  }
+  
+  return true;
+}
+
+float font_inst::face::kerning( const uint32_t prev, const uint32_t next )
+{
+  if( the_face )
+  {
+    if( next && FT_HAS_KERNING( ( ( FT_Face )the_face ) ) )
+    {
+      uint64_t key = ( ( uint64_t )size << 42 ) | ( ( uint64_t )( prev & 0x1FFFFF ) << 21 ) | ( next & 0x1FFFFF );
+      auto it = file->kerning.find( key );
+
+      if( it != file->kerning.end() )
+        return it->second;
+
+      //FT_Get_Kerning takes glyph indices, not codepoints
+      activate();
+      FT_Vector kern;
+      FT_Get_Kerning( ( FT_Face )the_face, FT_Get_Char_Index( ( FT_Face )the_face, prev ), FT_Get_Char_Index( ( FT_Face )the_face, next ), FT_KERNING_UNFITTED, &kern );
+      //rounded to 1/64 pixel like the advances, so pen positions are exact sums in any order (see layout.cs)
+      float k = std::floor( kern.x / 64.0f + 0.5f ) / 64.0f;
+      font_cache_write w( library::get().cache_lock );
+      file->kerning[key] = k;
+      return k;
+    }
+    else
+    {
+      return 0;
+    }
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+float font_inst::face::advance( const uint32_t current )
+{
+  auto s = glyphs->find( size );
+
+  if( s == glyphs->end() )
+    return 0;
+
+  auto g = s->second.find( current );
+  return g != s->second.end() ? g->second.advance.x / 64.0f : 0;
+}
+
+float font_inst::face::height()
+{
+  return h;
+}
+
+float font_inst::face::linegap()
+{
+  return gap;
+}
+
+float font_inst::face::ascender()
+{
+  return asc;
+}
+
+float font_inst::face::descender()
+{
+  return desc;
+}
+
+float font_inst::face::underline_position()
+{
+  return upos;
+}
+
+float font_inst::face::underline_thickness()
+{
+  return uthick;
+}
+
+glyph& font_inst::face::get_glyph( uint32_t i )
+{
+  return ( *glyphs )[size][i];
+}
+
+bool font_inst::face::has_glyph( uint32_t i )
+{
+  auto s = glyphs->find( size );
+  return s != glyphs->end() && s->second.count( i ) > 0;
+}
+
+const glyph* font_inst::face::find_glyph( uint32_t i )
+{
+  auto s = glyphs->find( size );
+
+  if( s == glyphs->end() )
+    return 0;
+
+  auto g = s->second.find( i );
+  return g != s->second.end() ? &g->second : 0;
+}
+
+bool font_inst::face::has_kerning( const uint32_t prev, const uint32_t next )
+{
+  if( !the_face || !next || !FT_HAS_KERNING( ( ( FT_Face )the_face ) ) )
+    return true;
+
+  uint64_t key = ( ( uint64_t )size << 42 ) | ( ( uint64_t )( prev & 0x1FFFFF ) << 21 ) | ( next & 0x1FFFFF );
+  return file->kerning.count( key ) > 0;
+}
+
+float font_inst::face::cached_kerning( const uint32_t prev, const uint32_t next )
+{
+  uint64_t key = ( ( uint64_t )size << 42 ) | ( ( uint64_t )( prev & 0x1FFFFF ) << 21 ) | ( next & 0x1FFFFF );
+  auto it = file->kerning.find( key );
+  return it != file->kerning.end() ? it->second : 0;
+}
+
+void font::set_size( font_inst& font_ptr, unsigned int s )
+{
+  //an explicit size ends zooming
+  font_ptr.zoom = 0;
+  font_ptr.zoom_scale = 1;
+  font_ptr.zoom_size = 0;
+  font_ptr.zoom_queue.clear();
+
+  switch_size( font_ptr, s );
+
+  //the placeholder is always needed for decorations
+  add_glyph( font_ptr, wchar_t(-1) );
+
+  std::vector<uint32_t> set;
+  font_warmup w = get_warmup_set( font_ptr, s, set );
+
+  font_ptr.warmup_queue.clear();
+
+  if( w.background )
+  {
+    //drained from the back, most important first
+    font_ptr.warmup_queue.assign( set.rbegin(), set.rend() );
+  }
+  else
+  {
+    for( auto& c : set )
+      add_glyph( font_ptr, c );
+  }
+
+  library::get().restore_gl_state();
+}
+
+void font::switch_size( font_inst& font_ptr, unsigned int s )
+{
+  font_cache_write w( library::get().cache_lock );
+  font_ptr.the_face->set_size( s );
+}
+
+//the glyphs the warmup policy of size s asks for, most important first
+font_warmup font::get_warmup_set( font_inst& font_ptr, unsigned int s, std::vector<uint32_t>& set )
+{
+  font_warmup w;
+
+  if( font_ptr.warmup.count( s ) )
+    w = font_ptr.warmup[s];
+  else if( font_ptr.warmup.count( 0 ) )
+    w = font_ptr.warmup[0];
+
+  set.clear();
+
+  if( w.mode == FONT_WARMUP_CHARSET )
+  {
+    if( w.charset.empty() )
+      set.assign( cachestring, cachestring + sizeof( cachestring ) / sizeof( cachestring[0] ) - 1 );
+    else
+      set = w.charset;
+  }
+  else if( w.mode == FONT_WARMUP_PROFILE )
+  {
+    //use this size's record, or every size's if this one was never drawn
+    std::map< uint32_t, unsigned int > counts;
+
+    if( font_ptr.usage.count( s ) )
+    {
+      counts = font_ptr.usage[s];
+    }
+    else
+    {
+      for( auto& u : font_ptr.usage )
+        for( auto& c : u.second )
+          counts[c.first] += c.second;
+    }
+
+    std::vector< std::pair< unsigned int, uint32_t > > order;
+
+    for( auto& c : counts )
+      order.push_back( std::make_pair( c.second, c.first ) );
+
+    std::sort( order.begin(), order.end(), []( const std::pair< unsigned int, uint32_t >& a, const std::pair< unsigned int, uint32_t >& b )
+    {
+      return a.first > b.first;
+    } );
+
+    for( auto& o : order )
+      set.push_back( o.second );
+  }
+
+  return w;
+}
+
+void font::set_zoom( font_inst& font_ptr, float size )
+{
+  font_inst::face* fc = font_ptr.the_face;
+
+  if( !fc || !fc->file || size < 1 )
+    return;
+
+  //queue_text reads the zoom and the cached sizes from other threads
+  font_cache_write w( library::get().cache_lock );
+
+  unsigned int frame = library::get().get_frame();
+
+  //still moving, the sizes passed on the way are never rasterized
+  if( !font_ptr.zoom || std::abs( size - font_ptr.zoom_anchor ) > zoom_hysteresis )
+  {
+    font_ptr.zoom_anchor = size;
+    font_ptr.zoom_frame = frame;
+  }
+
+  font_ptr.zoom = size;
+
+  //the nearest cached size is drawn, the current one is kept unless another is nearer by the hysteresis
+  //a size being rasterized only shows through zoom_size until it is complete, and
+  //sizes with far fewer glyphs than the drawn one (an abandoned zoom target) would rasterize on the spot
+  unsigned int drawn = fc->get_size();
+  float nearest = std::abs( size - drawn ) - zoom_hysteresis;
+  auto current = fc->glyphs->find( drawn );
+  size_t enough = current != fc->glyphs->end() ? current->second.size() / 2 : 0;
+
+  for( auto& g : *fc->glyphs )
+  {
+    if( g.second.empty() || g.second.size() < enough || ( g.first == font_ptr.zoom_size && !font_ptr.zoom_queue.empty() ) )
+      continue;
+
+    float d = std::abs( size - g.first );
+
+    if( d < nearest )
+    {
+      nearest = d;
+      drawn = g.first;
+    }
+  }
+
+  if( drawn != fc->get_size() )
+    switch_size( font_ptr, drawn );
+
+  font_ptr.zoom_scale = size / drawn;
+
+  unsigned int exact = ( unsigned int )std::floor( size + 0.5f );
+
+  if( exact == drawn )
+  {
+    font_ptr.zoom_size = 0;
+    font_ptr.zoom_queue.clear();
+  }
+  else if( exact != font_ptr.zoom_size && frame - font_ptr.zoom_frame >= zoom_settle_frames )
+  {
+    //settled on a size that isn't cached, it goes through the warmup budget (see zoom_step)
+    std::vector<uint32_t> set;
+    get_warmup_set( font_ptr, exact, set );
+
+    font_ptr.zoom_size = exact;
+    font_ptr.zoom_queue.assign( set.rbegin(), set.rend() );
+    font_ptr.zoom_queue.push_back( wchar_t(-1) );
+  }
+}
+
+font_raster_report font::compare_rasterizers( font_inst& font_ptr, unsigned int size, unsigned int passes )
+{
+  font_raster_report r = font_raster_report();
+  r.size = size;
+
+  font_inst::face* fc = font_ptr.the_face;
+
+  if( !fc || !fc->the_face || !passes )
+    return r;
+
+  //the shared face runs at the benchmark size meanwhile, readers must not see it (see zoom_step)
+  font_cache_write lock( library::get().cache_lock );
+
+  unsigned int old_size = fc->get_size();
+  switch_size( font_ptr, size );
+
+  FT_Face face = ( FT_Face )fc->the_face;
+  std::vector<uint32_t> set( cachestring, cachestring + sizeof( cachestring ) / sizeof( cachestring[0] ) - 1 );
+  std::vector<float> acc;
+  std::vector<GLubyte> out;
+  int left, top, w, h;
+
+  r.glyphs = set.size();
+
+  auto start = std::chrono::steady_clock::now();
+
+  for( unsigned int p = 0; p < passes; ++p )
+    for( auto& c : set )
+      FT_Load_Char( face, c, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT );
+
+  auto middle = std::chrono::steady_clock::now();
+
+  for( unsigned int p = 0; p < passes; ++p )
+  {
+    for( auto& c : set )
+    {
+      FT_Load_Char( face, c, FT_LOAD_NO_BITMAP | FT_LOAD_FORCE_AUTOHINT );
+      raster_box( face->glyph, left, top, w, h );
+
+      if( w > 0 && h > 0 )
+      {
+        out.resize( w * h );
+        raster_outline( &face->glyph->outline, left, top, w, h, acc, &out[0], w );
+      }
+    }
+  }
+
+  auto end = std::chrono::steady_clock::now();
+
+  double count = ( double )passes * set.size();
+  r.freetype_per_sec = ( float )( count / std::chrono::duration<double>( middle - start ).count() );
+  r.builtin_per_sec = ( float )( count / std::chrono::duration<double>( end - middle ).count() );
+
+  //coverage, compared over the union of both boxes, in outline pixels (y up)
+  double sum = 0;
+  size_t texels = 0, over = 0;
+
+  for( auto& c : set )
+  {
+    FT_Load_Char( face, c, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT );
+    FT_Bitmap& b = face->glyph->bitmap;
+    int fl = face->glyph->bitmap_left, ft = face->glyph->bitmap_top, fw = b.width, fh = b.rows;
+    std::vector<GLubyte> reference( fh * b.pitch );
+
+    if( !reference.empty() )
+      memcpy( &reference[0], b.buffer, reference.size() );
+
+    FT_Load_Char( face, c, FT_LOAD_NO_BITMAP | FT_LOAD_FORCE_AUTOHINT );
+    raster_box( face->glyph, left, top, w, h );
+    out.assign( std::max( w * h, 1 ), 0 );
+
+    if( w > 0 && h > 0 )
+      raster_outline( &face->glyph->outline, left, top, w, h, acc, &out[0], w );
+
+    if( left != fl || top != ft || w != fw || h != fh )
+      ++r.box_differs;
+
+    for( int y = std::min( top - h, ft - fh ); y < std::max( top, ft ); ++y )
+    {
+      for( int x = std::min( left, fl ); x < std::max( left + w, fl + fw ); ++x )
+      {
+        int a = x >= fl && x < fl + fw && y < ft && y >= ft - fh ? reference[( ft - 1 - y ) * b.pitch + x - fl] : 0;
+        int o = x >= left && x < left + w && y < top && y >= top - h ? out[( top - 1 - y ) * w + x - left] : 0;
+        int d = std::abs( a - o );
+
+        sum += d;
+        ++texels;
+        over += d > 16;
+        r.max_diff = std::max( r.max_diff, d );
+      }
+    }
+  }
+
+  r.mean_diff = texels ? ( float )( sum / texels ) : 0;
+  r.over_16 = texels ? ( float )over / texels : 0;
+
+  switch_size( font_ptr, old_size );
+  return r;
+}
+
+//rasterizes part of the zoom's exact size, and switches to it once it is complete
+void font::zoom_step( font_inst& font_ptr, unsigned int& budget )
+{
+  if( !font_ptr.zoom_size )
+    return;
+
+  //the size is switched away and back, readers must not see the zoom size in between
+  font_cache_write w( library::get().cache_lock );
+
+  font_inst::face* fc = font_ptr.the_face;
+  unsigned int drawn = fc->get_size();
+
+  if( budget > 0 && !font_ptr.zoom_queue.empty() )
+  {
+    switch_size( font_ptr, font_ptr.zoom_size );
+
+    while( budget > 0 && !font_ptr.zoom_queue.empty() )
+    {
+      add_glyph( font_ptr, font_ptr.zoom_queue.back() );
+      font_ptr.zoom_queue.pop_back();
+      --budget;
+    }
+
+    switch_size( font_ptr, drawn );
+  }
+
+  if( font_ptr.zoom_queue.empty() && ( unsigned int )std::floor( font_ptr.zoom + 0.5f ) == font_ptr.zoom_size )
+  {
+    switch_size( font_ptr, font_ptr.zoom_size );
+    font_ptr.zoom_scale = font_ptr.zoom / font_ptr.zoom_size;
+    font_ptr.zoom_size = 0;
+  }
+}
+
+std::vector<font_size_usage> font::get_memory_usage( font_inst& font_ptr )
+{
+  std::vector<font_size_usage> r;
+
+  if( !font_ptr.the_face || !font_ptr.the_face->file )
+    return r;
+
+  font_file* f = font_ptr.the_face->file;
+
+  for( auto& s : f->sizes )
+  {
+    font_size_usage u;
+    u.size = s.first;
+    u.glyphs = f->glyphs.count( s.first ) ? f->glyphs[s.first].size() : 0;
+    u.atlas_bytes = s.second.atlas_bytes;
+    u.last_used = s.second.last_used;
+    r.push_back( u );
+  }
+
+  return r;
+}
+
+bool font::save_glyph_profile( font_inst& font_ptr, const std::string& filename )
+{
+  std::ofstream f( filename.c_str() );
+
+  if( !f )
+  {
+    std::cerr << "Couldn't open file: " << filename << std::endl;
+    return false;
+  }
+
+  //one 'size codepoint count' triplet per line
+  f << "glyph_profile 1" << std::endl;
+
+  for( auto& u : font_ptr.usage )
+    for( auto& c : u.second )
+      f << u.first << " " << c.first << " " << c.second << std::endl;
+
+  return true;
+}
+
+bool font::load_glyph_profile( font_inst& font_ptr, const std::string& filename )
+{
+  std::ifstream f( filename.c_str() );
+
+  if( !f )
+    return false;
+
+  std::string magic;
+  int version = 0;
+  f >> magic >> version;
+
+  if( magic != "glyph_profile" || version != 1 )
+  {
+    std::cerr << "Invalid glyph profile: " << filename << std::endl;
+    return false;
+  }
+
+  unsigned int size, count;
+  uint32_t c;
+
+  //merged into the live histogram, so a profile can be refined across runs
+  while( f >> size >> c >> count )
+    font_ptr.usage[size][c] += count;
+
+  return true;
+}
+
+void font::add_glyph( font_inst& font_ptr, uint32_t c, int counter )
+{
+  if( font_ptr.the_face->has_glyph( c ) )
+    return;
+
+  font_cache_write w( library::get().cache_lock );
+
+  if( !font_ptr.the_face->load_glyph( c, font_ptr.rasterizer ) )
+  {
+    if( counter > 9 ) //at max 10 tries
+    {
+      exit( 1 ); //couldn't get enough memory or something... (extreme case) 
+    }
+
+    library::get().delete_glyphs();
+    add_glyph( font_ptr, c, ++counter );
+    return;
+  }
+
+  auto& g = font_ptr.the_face->get_glyph( c );
+
+  mm::vec2 vertbias = mm::vec2( g.offset_x - 0.5f, -0.5f - ( g.h - g.offset_y ) );
+  mm::vec2 vertscale = mm::vec2( g.offset_x + g.w + 0.5f, 0.5f + g.h - ( g.h - g.offset_y ) ) - vertbias;
+
+  //texcoords
+  mm::vec2 texbias = mm::vec2( g.texcoords[0], g.texcoords[1] );
+  mm::vec2 texscale = mm::vec2( g.texcoords[2], g.texcoords[3] ) - texbias;
+
+  g.cache_index = library::get().add_font_data( fontscalebias( vertscale, vertbias, texscale, texbias ) );
+}
+
+void font::load_font( const std::string& filename, font_inst& font_ptr, unsigned int size )
+{
+  std::cout << "-Loading: " << filename << std::endl;
+
+  library::get().set_up();
+  resize( screensize );
+
+  //the file itself is mapped and parsed once, shared between instances
+  delete font_ptr.the_face;
+  font_ptr.the_face = new font_inst::face( filename, 0 );
+
+  set_size( font_ptr, size );
+
+  auto& instances = library::get().instances;
+
+  if( std::find( instances.begin(), instances.end(), &font_ptr ) == instances.end() )
+    instances.push_back( &font_ptr );
+}
+
+void font::resize( const mm::uvec2& ss )
+{
+  screensize = ss;
+  font_frame.set_ortographic( 0.0f, ( float )ss.x, 0.0f, ( float )ss.y, 0.0f, 1.0f );
+  layers_dirty = true; //screen space layer projections
+}
+
+
+//these special unicode characters denote the text markup begin/end
+#define FONT_UNDERLINE_BEGIN L'\uE000'
+#define FONT_UNDERLINE_END L'\uE001'
+#define FONT_OVERLINE_BEGIN L'\uE002'
+#define FONT_OVERLINE_END L'\uE003'
+#define FONT_STRIKETHROUGH_BEGIN L'\uE004'
+#define FONT_STRIKETHROUGH_END L'\uE005'
+#define FONT_HIGHLIGHT_BEGIN L'\uE006'
+#define FONT_HIGHLIGHT_END L'\uE007'
+
+static bool is_special( uint32_t c )
+{
+  return c == FONT_UNDERLINE_BEGIN ||
+         c == FONT_UNDERLINE_END ||
+         c == FONT_OVERLINE_BEGIN ||
+         c == FONT_OVERLINE_END ||
+         c == FONT_STRIKETHROUGH_BEGIN ||
+         c == FONT_STRIKETHROUGH_END ||
+         c == FONT_HIGHLIGHT_BEGIN ||
+         c == FONT_HIGHLIGHT_END;
+}
+
+#define FONT_REPLACEMENT_CHAR 0xFFFD
+
+//decoders write at most one codepoint per input code unit
+//invalid sequences decode to U+FFFD
+static size_t decode_utf8( const unsigned char* s, size_t len, uint32_t* out )
+{
+  uint32_t* o = out;
+  size_t c = 0;
+
+  while( c < len )
+  {
+#ifdef FONT_USE_SSE2
+    //ascii fast path: validate and widen 16 bytes at a time
+    while( c + 16 <= len )
+    {
+      __m128i v = _mm_loadu_si128( ( const __m128i* )( s + c ) );
+
+      if( _mm_movemask_epi8( v ) )
+        break;
+
+      __m128i zero = _mm_setzero_si128();
+      __m128i lo = _mm_unpacklo_epi8( v, zero );
+      __m128i hi = _mm_unpackhi_epi8( v, zero );
+      _mm_storeu_si128( ( __m128i* )( o + 0 ), _mm_unpacklo_epi16( lo, zero ) );
+      _mm_storeu_si128( ( __m128i* )( o + 4 ), _mm_unpackhi_epi16( lo, zero ) );
+      _mm_storeu_si128( ( __m128i* )( o + 8 ), _mm_unpacklo_epi16( hi, zero ) );
+      _mm_storeu_si128( ( __m128i* )( o + 12 ), _mm_unpackhi_epi16( hi, zero ) );
+      o += 16;
+      c += 16;
+    }
+
+    if( c >= len )
+      break;
+#endif
+
+    unsigned char b = s[c];
+
+    if( b < 0x80 )
+    {
+      *o++ = b;
+      ++c;
+      continue;
+    }
+
+    int extra;
+    uint32_t cp, min;
+
+    if( ( b & 0xE0 ) == 0xC0 )
+    {
+      extra = 1;
+      cp = b & 0x1F;
+      min = 0x80;
+    }
+    else if( ( b & 0xF0 ) == 0xE0 )
+    {
+      extra = 2;
+      cp = b & 0x0F;
+      min = 0x800;
+    }
+    else if( ( b & 0xF8 ) == 0xF0 )
+    {
+      extra = 3;
+      cp = b & 0x07;
+      min = 0x10000;
+    }
+    else
+    {
+      *o++ = FONT_REPLACEMENT_CHAR;
+      ++c;
+      continue;
+    }
+
+    int i = 1;
+
+    for( ; i <= extra && c + i < len; ++i )
+    {
+      if( ( s[c + i] & 0xC0 ) != 0x80 )
+        break;
+
+      cp = ( cp << 6 ) | ( s[c + i] & 0x3F );
+    }
+
+    if( i <= extra || cp < min || cp > 0x10FFFF || ( cp >= 0xD800 && cp <= 0xDFFF ) )
+    {
+      //skip the lead byte and whatever continuation bytes we consumed
+      *o++ = FONT_REPLACEMENT_CHAR;
+      c += i;
+      continue;
+    }
+
+    *o++ = cp;
+    c += extra + 1;
+  }
+
+  return o - out;
+}
+
+static size_t decode_utf16( const char16_t* s, size_t len, uint32_t* out )
+{
+  uint32_t* o = out;
+  size_t c = 0;
+
+  while( c < len )
+  {
+#ifdef FONT_USE_SSE2
+    //surrogate-free fast path: 8 units at a time
+    while( c + 8 <= len )
+    {
+      __m128i v = _mm_loadu_si128( ( const __m128i* )( s + c ) );
+      //unsigned ( v - 0xD800 ) < 0x800, done as a biased signed compare
+      __m128i t = _mm_xor_si128( _mm_sub_epi16( v, _mm_set1_epi16( ( short )0xD800 ) ), _mm_set1_epi16( ( short )0x8000 ) );
+
+      if( _mm_movemask_epi8( _mm_cmplt_epi16( t, _mm_set1_epi16( ( short )0x8800 ) ) ) )
+        break;
+
+      __m128i zero = _mm_setzero_si128();
+      _mm_storeu_si128( ( __m128i* )( o + 0 ), _mm_unpacklo_epi16( v, zero ) );
+      _mm_storeu_si128( ( __m128i* )( o + 4 ), _mm_unpackhi_epi16( v, zero ) );
+      o += 8;
+      c += 8;
+    }
+
+    if( c >= len )
+      break;
+#endif
+
+    uint32_t u = s[c];
+
+    if( u < 0xD800 || u > 0xDFFF )
+    {
+      *o++ = u;
+      ++c;
+    }
+    else if( u <= 0xDBFF && c + 1 < len && s[c + 1] >= 0xDC00 && s[c + 1] <= 0xDFFF )
+    {
+      *o++ = 0x10000 + ( ( u - 0xD800 ) << 10 ) + ( s[c + 1] - 0xDC00 );
+      c += 2;
+    }
+    else
+    {
+      *o++ = FONT_REPLACEMENT_CHAR;
+      ++c;
+    }
+  }
+
+  return o - out;
+}
+
+static size_t decode_utf32( const char32_t* s, size_t len, uint32_t* out )
+{
+  memcpy( out, s, len * sizeof( uint32_t ) );
+
+  for( size_t c = 0; c < len; ++c )
+  {
+    if( out[c] > 0x10FFFF || ( out[c] >= 0xD800 && out[c] <= 0xDFFF ) )
+      out[c] = FONT_REPLACEMENT_CHAR;
+  }
+
+  return len;
+}
+
+size_t font::decode( const font_text* segments, size_t count )
+{
+  return decode( segments, count, codepoints );
+}
+
+size_t font::decode( const font_text* segments, size_t count, std::vector<uint32_t>& out )
+{
+  size_t needed = 0;
+
+  for( size_t c = 0; c < count; ++c )
+    needed += segments[c].length;
+
+  //+1 so that the lookahead past the last char stays in bounds
+  if( out.size() < needed + 1 )
+    out.resize( needed + 1 );
+
+  size_t size = 0;
+
+  for( size_t c = 0; c < count; ++c )
+  {
+    const font_text& t = segments[c];
+
+    switch( t.enc )
+    {
+      case font_text::utf8:
+        size += decode_utf8( ( const unsigned char* )t.data, t.length, &out[size] );
+        break;
+      case font_text::utf16:
+        size += decode_utf16( ( const char16_t* )t.data, t.length, &out[size] );
+        break;
+      case font_text::utf32:
+        size += decode_utf32( ( const char32_t* )t.data, t.length, &out[size] );
+        break;
+    }
+  }
+
+  out[size] = 0;
+
+  return size;
+}
+
+mm::vec2 font::add_to_render_list( const std::wstring& txt, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  font_text t( txt );
+  return add_to_render_list( &t, 1, font_ptr, color, mat, highlight_color, line_height, f );
+}
+
+mm::vec2 font::add_to_render_list( const char* txt, size_t length, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  font_text t( txt, length );
+  return add_to_render_list( &t, 1, font_ptr, color, mat, highlight_color, line_height, f );
+}
+
+mm::vec2 font::add_to_render_list( const char16_t* txt, size_t length, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  font_text t( txt, length );
+  return add_to_render_list( &t, 1, font_ptr, color, mat, highlight_color, line_height, f );
+}
+
+mm::vec2 font::add_to_render_list( const char32_t* txt, size_t length, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  font_text t( txt, length );
+  return add_to_render_list( &t, 1, font_ptr, color, mat, highlight_color, line_height, f );
+}
+
+mm::vec2 font::add_to_render_list( const font_text* segments, size_t count, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  size_t size = decode( segments, count );
+  size_t begin = layers[current_layer].list.size();
+  font_sink out( layers[current_layer].list, ( float )current_layer );
+  mm::vec2 p = layout( &codepoints[0], size, font_ptr, color, mat, highlight_color, line_height, f, out );
+  submit( current_layer, begin );
+  return p;
+}
+
+size_t font::layout_to_buffer( const font_text* segments, size_t count, font_inst& font_ptr, font_instance* buffer, size_t capacity, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f, mm::vec2* lastpos )
+{
+  size_t size = decode( segments, count );
+  font_sink out( buffer, capacity );
+  mm::vec2 p = layout( &codepoints[0], size, font_ptr, color, mat, highlight_color, line_height, f, out );
+
+  if( lastpos )
+    *lastpos = p;
+
+  return out.count;
+}
+
+size_t font::layout_to_buffer( const font_text& text, font_inst& font_ptr, font_instance* buffer, size_t capacity, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f, mm::vec2* lastpos )
+{
+  return layout_to_buffer( &text, 1, font_ptr, buffer, capacity, color, mat, highlight_color, line_height, f, lastpos );
+}
+
+font_atlas_binding font::get_atlas_binding()
+{
+  library& l = library::get();
+
+  font_atlas_binding b;
+  b.texture = l.get_tex();
+  b.target = GL_TEXTURE_2D_ARRAY;
+  b.sampler_point = l.texsampler_point;
+  b.sampler_linear = l.texsampler_linear;
+  b.sampler_mip = l.texsampler_mip;
+  b.shader = l.get_shader();
+  b.page_size = ( float )FONT_ATLAS_PAGE_SIZE;
+  b.channels = ( int )l.get_channels();
+  b.projection = font_frame.projection_matrix;
+  return b;
+}
+
+void font::set_instance_attribs( GLuint buffer, size_t offset )
+{
+  library::get().set_instance_attribs( buffer, offset );
+  library::get().restore_gl_state();
+}
+
+mm::vec2 font::layout( const uint32_t* txt, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f, font_sink& out, font_markup* m, const float* spacing )
+{
+  font_markup& mk = m ? *m : markup;
+
+  //decorations are drawn with the placeholder glyph, it may have been evicted
+  add_glyph( font_ptr, wchar_t(-1) );
+
+  if( font_ptr.the_face->file )
+  {
+    font_ptr.the_face->file->sizes[font_ptr.the_face->get_size()].last_used = library::get().get_frame();
+
+    //its glyphs are drawn as they come in
+    if( font_ptr.zoom_size )
+      font_ptr.the_face->file->sizes[font_ptr.zoom_size].last_used = library::get().get_frame();
+  }
+
+  float vert_advance = font_ptr.the_face->height() - font_ptr.the_face->linegap();
+  vert_advance *= line_height;
+
+  mm::vec2 lastpos;
+
+  //usage profiling counts into a map, that stays on one thread, and so do the codepoints of a sink
+  if( layout_threads < 2 || size < FONT_PARALLEL_MIN || font_ptr.profiling || out.codepoints ||
+      !layout_parallel( txt, size, font_ptr, color, mat, highlight_color, vert_advance, f, out, mk, spacing, lastpos ) )
+  {
+    lastpos = layout_range( txt, 0, size, size, 0, mk, font_ptr, color, mat, highlight_color, vert_advance, f, true, out, spacing );
+  }
+
+  //glyph uploads may have touched the texture bindings
+  library::get().restore_gl_state();
+
+  return lastpos;
+}
+
+//lays out txt[begin, end), begin is 0 or a newline, 'line' counts the newlines before it
+//without loading only the caches are read, so ranges can run on several threads
+mm::vec2 font::layout_range( const uint32_t* txt, size_t begin, size_t end, size_t size, int line, font_markup& m, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float vert_advance, float f, bool loading, font_sink& out, const float* spacing, font_hit_index* hits )
+{
+  font_inst::face* fc = font_ptr.the_face;
+  library& l = library::get();
+
+  //zooming: laid out at the drawn size and scaled about the origin
+  //glyphs already rasterized at the exact size replace the scaled ones, on the scaled pen positions
+  float zs = font_ptr.zoom_scale;
+  //a full atlas empties the maps while loading (see library::delete_glyphs), so it is found again once the generation moved
+  auto find_exact = [&]() -> const font_glyph_map*
+  {
+    if( !font_ptr.zoom_size )
+      return 0;
+
+    auto e = fc->glyphs->find( font_ptr.zoom_size );
+    return e != fc->glyphs->end() ? &e->second : 0;
+  };
+
+  const font_glyph_map* exact = find_exact();
+  unsigned int exact_generation = l.generation;
+
+  float xx = 0;
+
+  //multiplied rather than accumulated so the gpu layout and the chunks get the same bits
+  float yy = vert_advance * ( line + 1 );
+
+  for( int c = ( int )begin; c < int( end ); c++ )
+  {
+    if( txt[c] == L'\n' )
+    {
+      //a range may start at the newline ending the line before it, that caret isn't ours
+      //(unless it is the first codepoint, then that line is empty and it is 0 anyway)
+      if( hits && ( c == 0 || c != ( int )begin ) )
+        hits->x[c] = xx * zs;
+
+      ++line;
+      yy = vert_advance * ( line + 1 );
+      xx = 0;
+    }
+
+    if( c > 0 && txt[c] != L'\n' && !is_special(txt[c]) )
+    {
+      xx += loading ? fc->kerning( txt[c - 1], txt[c] ) : fc->cached_kerning( txt[c - 1], txt[c] );
+    }
+
+    if( hits && txt[c] != L'\n' )
+      hits->x[c] = xx * zs;
+
+    if( txt[c] == FONT_UNDERLINE_BEGIN )
+      m.underline = true;
+    else if( txt[c] == FONT_UNDERLINE_END )
+      m.underline = false;
+    else if( txt[c] == FONT_OVERLINE_BEGIN )
+      m.overline = true;
+    else if( txt[c] == FONT_OVERLINE_END )
+      m.overline = false;
+    else if( txt[c] == FONT_STRIKETHROUGH_BEGIN )
+      m.strikethrough = true;
+    else if( txt[c] == FONT_STRIKETHROUGH_END )
+      m.strikethrough = false;
+    else if( txt[c] == FONT_HIGHLIGHT_BEGIN )
+      m.highlight = true;
+    else if( txt[c] == FONT_HIGHLIGHT_END )
+      m.highlight = false;
+
+    float finalx = xx * zs;
+    mm::vec3 pos = mm::vec3( finalx, ( float )screensize.y - yy * zs, 0 );
+
+    float advancex = 0;
+    
+    //txt[size] is a terminating 0, see decode()
+    size_t i = 0;
+    for( i = c; i < size; ++i )
+    {
+      if( !is_special( txt[i] ) )
+        break;
+    }
+
+    //spaces need their advance too, and the lookahead may not be cached yet
+    if( loading && i < size && txt[i] != L'\n' )
+      add_glyph( font_ptr, txt[i] );
+
+    advancex = fc->advance( txt[i] );
+
+    const glyph* placeholder = m.highlight || m.strikethrough || m.underline || m.overline ? fc->find_glyph( wchar_t(-1) ) : 0;
+
+    if( m.highlight && placeholder )
+    {
+      fontscalebias copy = l.get_font_data( placeholder->cache_index );
+      
+      //vert bias
+      copy.vertscalebias.w = fc->descender();
+
+      //hori bias
+      copy.vertscalebias.z = 0.0f;
+      
+      //hori scale
+      copy.vertscalebias.x = advancex;
+
+      //vert scale
+      copy.vertscalebias.y = fc->height() + fc->linegap();
+
+      copy.vertscalebias *= zs;
+      out.push( font_instance( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ), copy.texscalebias, highlight_color, mat, f ) );
+    }
+
+    if( m.strikethrough && placeholder )
+    {
+      fontscalebias copy = l.get_font_data( placeholder->cache_index );
+      
+      //vert bias
+      copy.vertscalebias.w = fc->ascender() * 0.33f;
+
+      //hori bias
+      copy.vertscalebias.z = 0;
+      
+      //hori scale
+      copy.vertscalebias.x = advancex;
+
+      //vert scale
+      copy.vertscalebias.y = fc->underline_thickness();
+
+      copy.vertscalebias *= zs;
+      out.push( font_instance( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ), copy.texscalebias, color, mat, f ) );
+    }
+
+    if( m.underline && placeholder )
+    {
+      fontscalebias copy = l.get_font_data( placeholder->cache_index );
+      
+      //vert bias
+      copy.vertscalebias.w = fc->underline_position();
+
+      //hori bias
+      copy.vertscalebias.z = 0.0f;
+      
+      //hori scale
+      copy.vertscalebias.x = advancex;
+
+      //vert scale
+      copy.vertscalebias.y = fc->underline_thickness();
+
+      copy.vertscalebias *= zs;
+      out.push( font_instance( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ), copy.texscalebias, color, mat, f ) );
+    }
+
+    if( m.overline && placeholder )
+    {
+      fontscalebias copy = l.get_font_data( placeholder->cache_index );
+      
+      //vert bias
+      copy.vertscalebias.w = fc->ascender();
+
+      //hori bias
+      copy.vertscalebias.z = 0.0f;
+      
+      //hori scale
+      copy.vertscalebias.x = advancex;
+
+      //vert scale
+      copy.vertscalebias.y = fc->underline_thickness();
+
+      copy.vertscalebias *= zs;
+      out.push( font_instance( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ), copy.texscalebias, color, mat, f ) );
+    }
+
+    if( ( size_t )c < size && txt[c] != L' ' && txt[c] != L'\n' && !is_special(txt[c]) )
+    {
+      if( loading )
+      {
+        add_glyph( font_ptr, txt[c] );
+
+        if( font_ptr.profiling )
+          ++font_ptr.usage[fc->get_size()][txt[c]];
+      }
+
+      const glyph* g = fc->find_glyph( txt[c] );
+
+      if( g )
+      {
+        if( exact_generation != l.generation )
+        {
+          exact = find_exact();
+          exact_generation = l.generation;
+        }
+
+        auto e = exact ? exact->find( txt[c] ) : font_glyph_map::const_iterator();
+
+        if( exact && e != exact->end() )
+        {
+          const fontscalebias& thefsb = l.get_font_data( e->second.cache_index );
+          out.push( font_instance( mm::vec4( thefsb.vertscalebias.xy, thefsb.vertscalebias.zw + pos.xy ), thefsb.texscalebias, color, mat, f ), txt[c] );
+        }
+        else
+        {
+          const fontscalebias& thefsb = l.get_font_data( g->cache_index );
+          out.push( font_instance( mm::vec4( thefsb.vertscalebias.xy * zs, thefsb.vertscalebias.zw * zs + pos.xy ), thefsb.texscalebias, color, mat, f ), txt[c] );
+        }
+      }
+    }
+
+    if( !is_special(txt[c]) )
+      xx += fc->advance( txt[c] );
+
+    if( spacing )
+      xx += spacing[c];
+  }
+
+  if( hits )
+    hits->x[end] = xx * zs;
+
+  return mm::vec2( xx * zs, ( yy - vert_advance ) * zs );
+}
+
+//fnv-1a
+static unsigned long long hash_bytes( const void* data, size_t size, unsigned long long h = 14695981039346656037ULL )
+{
+  const unsigned char* p = ( const unsigned char* )data;
+
+  for( size_t c = 0; c < size; ++c )
+  {
+    h ^= p[c];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+unsigned int font::get_layer( const std::string& name )
+{
+  auto it = layer_names.find( name );
+
+  if( it != layer_names.end() )
+    return it->second;
+
+  font_layer l;
+  l.name = name;
+  layers.push_back( l );
+
+  unsigned int id = layers.size() - 1;
+  layer_names[name] = id;
+  layers_dirty = true;
+  return id;
+}
+
+void font::set_layer( unsigned int layer )
+{
+  if( layer >= layers.size() )
+  {
+    std::cerr << "Invalid font layer: " << layer << std::endl;
+    return;
+  }
+
+  current_layer = layer;
+}
+
+void font::set_layer_params( unsigned int layer, const font_layer_params& p )
+{
+  if( layer >= layers.size() )
+  {
+    std::cerr << "Invalid font layer: " << layer << std::endl;
+    return;
+  }
+
+  layers[layer].params = p;
+  layers_dirty = true;
+}
+
+//the instances of one submission, matched to last frame's slot of the same order
+void font::submit( unsigned int layer, size_t begin )
+{
+  font_layer& y = layers[layer];
+
+  if( y.submissions == y.slots.size() )
+    y.slots.push_back( font_slot() );
+
+  font_slot& s = y.slots[y.submissions++];
+  s.begin = begin;
+  s.count = y.list.size() - begin;
+  s.hash = hash_bytes( &s.count, sizeof( s.count ) );
+
+  if( s.count )
+    s.hash = hash_bytes( &y.list[begin], sizeof( font_instance ) * s.count, s.hash );
+
+  layers_dirty = true;
+}
+
+//appends slot instances [begin, end) to the pending upload, padding past the slot's count
+void font::upload_range( const font_layer& y, const font_slot& s, size_t begin, size_t end, size_t& run_offset )
+{
+  if( !upload_scratch.empty() && run_offset + upload_scratch.size() != s.offset + begin )
+  {
+    glBufferSubData( GL_ARRAY_BUFFER, sizeof( font_instance ) * run_offset, sizeof( font_instance ) * upload_scratch.size(), &upload_scratch[0] );
+    upload_bytes += sizeof( font_instance ) * upload_scratch.size();
+    upload_scratch.clear();
+  }
+
+  if( upload_scratch.empty() )
+    run_offset = s.offset + begin;
+
+  size_t valid = s.count > begin ? std::min( end, s.count ) : begin;
+  upload_scratch.insert( upload_scratch.end(), y.list.begin() + s.begin + begin, y.list.begin() + s.begin + valid );
+
+  //degenerate padding, zero sized quads
+  font_instance pad( mm::vec4( 0 ), mm::vec4( 0 ), mm::vec4( 0 ), mm::mat4::identity, 0 );
+  pad.layer = 0;
+  upload_scratch.resize( upload_scratch.size() + end - valid, pad );
+}
+
+//every layer lives in one buffer, only the chunks that changed since the last upload are sent
+void font::upload_layers()
+{
+  if( !layers_dirty )
+    return;
+
+  library& l = library::get();
+
+  //place the slots, they keep their offset while everything before them fits
+  size_t total = 0;
+
+  //slots not submitted yet this frame (their layer is drawn later) keep their room, they are trimmed in end_frame
+  for( auto& y : layers )
+  {
+    y.first = total;
+    y.count = 0;
+
+    for( size_t c = 0; c < y.slots.size(); ++c )
+    {
+      font_slot& s = y.slots[c];
+      size_t capacity = s.capacity;
+
+      //grow with some headroom, shrink with hysteresis
+      if( c < y.submissions && ( s.count > capacity || s.count * 2 < capacity ) )
+        capacity = ( s.count + s.count / 4 + 15 ) & ~( size_t )15;
+
+      if( capacity != s.capacity || total != s.offset )
+      {
+        s.capacity = capacity;
+        s.offset = total;
+        s.placed = false;
+      }
+
+      total += s.capacity;
+
+      if( c < y.submissions )
+        y.count = total - y.first;
+    }
+  }
+
+  l.bind_buffer( GL_ARRAY_BUFFER, l.vbos[FONT_INSTANCES] );
+
+  if( total > instance_capacity )
+  {
+    //new storage, everything goes up again
+    instance_capacity = std::max( total, instance_capacity * 2 );
+    glBufferData( GL_ARRAY_BUFFER, sizeof( font_instance ) * instance_capacity, 0, GL_DYNAMIC_DRAW );
+
+    for( auto& y : layers )
+      for( auto& s : y.slots )
+        s.placed = false;
+  }
+
+  //changed chunks of changed slots, neighbouring ones are merged into one upload
+  size_t run_offset = 0;
+  upload_scratch.clear();
+
+  for( auto& y : layers )
+  {
+    //the rest still refer to last frame's list, they go up once submitted
+    for( size_t c = 0; c < y.submissions; ++c )
+    {
+      font_slot& s = y.slots[c];
+
+      if( s.placed && s.hash == s.uploaded_hash )
+        continue;
+
+      size_t chunk_count = ( s.capacity + FONT_SLOT_CHUNK - 1 ) / FONT_SLOT_CHUNK;
+
+      if( !s.placed )
+        s.chunks.assign( chunk_count, 0 );
+
+      for( size_t k = 0; k < chunk_count; ++k )
+      {
+        size_t begin = k * FONT_SLOT_CHUNK;
+        size_t end = std::min( begin + FONT_SLOT_CHUNK, s.capacity );
+        size_t valid = s.count > begin ? std::min( end, s.count ) - begin : 0;
+
+        unsigned long long h = hash_bytes( &valid, sizeof( valid ) );
+
+        if( valid )
+          h = hash_bytes( &y.list[s.begin + begin], sizeof( font_instance ) * valid, h );
+
+        if( !s.placed || h != s.chunks[k] )
+        {
+          upload_range( y, s, begin, end, run_offset );
+          s.chunks[k] = h;
+        }
+      }
+
+      s.placed = true;
+      s.uploaded_hash = s.hash;
+    }
+  }
+
+  if( !upload_scratch.empty() )
+  {
+    glBufferSubData( GL_ARRAY_BUFFER, sizeof( font_instance ) * run_offset, sizeof( font_instance ) * upload_scratch.size(), &upload_scratch[0] );
+    upload_bytes += sizeof( font_instance ) * upload_scratch.size();
+  }
+
+  std::vector<mm::mat4> projections;
+  projections.reserve( layers.size() );
+
+  for( auto& c : layers )
+    projections.push_back( c.params.screen_projection ? font_frame.projection_matrix : c.params.projection );
+
+  unsigned long long h = hash_bytes( &projections[0], sizeof( mm::mat4 ) * projections.size() );
+
+  if( h != projection_hash )
+  {
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_LAYERS] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( mm::mat4 ) * projections.size(), &projections[0], GL_DYNAMIC_DRAW );
+    upload_bytes += sizeof( mm::mat4 ) * projections.size();
+    projection_hash = h;
+  }
+
+  layers_dirty = false;
+}
+
+static bool same_target( const font_layer_params& a, const font_layer_params& b )
+{
+  return a.blend == b.blend && a.framebuffer == b.framebuffer &&
+         a.viewport.x == b.viewport.x && a.viewport.y == b.viewport.y &&
+         a.viewport.z == b.viewport.z && a.viewport.w == b.viewport.w;
+}
+
+void library::set_blend_mode( int blend )
+{
+  if( blend == FONT_BLEND_PREMULTIPLIED )
+    set_blend_func( GL_ONE, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+  else if( blend == FONT_BLEND_ADDITIVE )
+    set_blend_func( GL_SRC_ALPHA, GL_ONE, GL_SRC_ALPHA, GL_ONE );
+  else
+    set_blend_func( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+}
+
+void font::render_layer( unsigned int layer )
+{
+  render_layers( &layer, 1 );
+}
+
+void font::render_layers( const unsigned int* ids, size_t count )
+{
+  for( size_t c = 0; c < count; ++c )
+  {
+    if( ids[c] >= layers.size() )
+    {
+      std::cerr << "Invalid font layer: " << ids[c] << std::endl;
+      return;
+    }
+  }
+
+  upload_layers();
+
+  library& l = library::get();
+
+  //layers without their own target draw into the caller's
+  const font_gl_state& caller = l.gl_caller;
+
+  l.set_capability( GL_CULL_FACE, false );
+  l.set_capability( GL_DEPTH_TEST, false );
+  l.set_capability( GL_BLEND, true );
+
+  l.bind_shader();
+
+  //mvp is now only the projection matrix, layer instances use their own
+  mm::mat4 mat = font_frame.projection_matrix;
+  glUniformMatrix4fv( 0, 1, false, &mat[0].x );
+  glUniform1f( 1, ( float )FONT_ATLAS_PAGE_SIZE );
+  glUniform1i( 5, ( GLint )l.get_channels() );
+
+  l.bind_storage_buffer( 0, l.vbos[FONT_LAYERS] );
+
+  l.bind_texture();
+
+  l.bind_vao();
+
+  l.bind_buffer( GL_DRAW_INDIRECT_BUFFER, l.vbos[FONT_INDIRECT] );
+
+  //consecutive layers with the same blend and target go into one multi draw
+  for( size_t c = 0; c < count; )
+  {
+    const font_layer_params& p = layers[ids[c]].params;
+
+    size_t end = c + 1;
+
+    while( end < count && same_target( p, layers[ids[end]].params ) )
+      ++end;
+
+    l.bind_draw_framebuffer( p.framebuffer >= 0 ? p.framebuffer : caller.draw_framebuffer );
+
+    if( p.viewport.z > 0 && p.viewport.w > 0 )
+      l.set_viewport( p.viewport.x, p.viewport.y, p.viewport.z, p.viewport.w );
+    else
+      l.set_viewport( caller.viewport[0], caller.viewport[1], caller.viewport[2], caller.viewport[3] );
+
+    l.set_blend_mode( p.blend );
+
+    //count, instance count, first index, base vertex, base instance
+    draw_commands.clear();
+
+    for( size_t d = c; d < end; ++d )
+    {
+      const font_layer& y = layers[ids[d]];
+
+      if( !y.count )
+        continue;
+
+      GLuint cmd[5] = { 6, ( GLuint )y.count, 0, 0, ( GLuint )y.first };
+      draw_commands.insert( draw_commands.end(), cmd, cmd + 5 );
+    }
+
+    size_t draws = draw_commands.size() / 5;
+
+    if( draws == 1 )
+    {
+      glDrawElementsInstancedBaseInstance( GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, draw_commands[1], draw_commands[4] );
+    }
+    else if( draws > 1 )
+    {
+      glBufferData( GL_DRAW_INDIRECT_BUFFER, sizeof( GLuint ) * draw_commands.size(), &draw_commands[0], GL_STREAM_DRAW );
+      glMultiDrawElementsIndirect( GL_TRIANGLES, GL_UNSIGNED_INT, 0, draws, 0 );
+    }
+
+    draw_blocks( ids + c, end - c );
+
+    c = end;
+  }
+
+  l.restore_gl_state();
+}
+
+void font::render()
+{
+  //only grows when a layer is added
+  while( render_ids.size() < layers.size() )
+    render_ids.push_back( render_ids.size() );
+
+  render_layers( &render_ids[0], layers.size() );
+
+  end_frame();
+}
+
+void font::end_frame()
+{
+  for( auto& c : layers )
+  {
+    //submissions that stopped coming give up their room
+    c.slots.resize( c.submissions );
+    c.list.clear();
+    c.blocks.clear();
+    c.submissions = 0;
+  }
+
+  last_upload_bytes = upload_bytes;
+  upload_bytes = 0;
+
+  library& l = library::get();
+  l.last_gl_calls = l.gl_calls;
+  l.last_gl_calls_skipped = l.gl_calls_skipped;
+  l.gl_calls = 0;
+  l.gl_calls_skipped = 0;
+  l.last_gl_gets = l.gl_gets;
+  l.gl_gets = 0;
+
+  //forget blocks that are not drawn anymore
+  unsigned int trim_frames = library::get().trim_frames;
+
+  for( auto it = blocks.begin(); it != blocks.end(); )
+  {
+    if( trim_frames > 0 && library::get().get_frame() - it->second.last_used > trim_frames )
+    {
+      release_block( it->second );
+      it = blocks.erase( it );
+    }
+    else
+      ++it;
+  }
+
+  layers_dirty = true;
+
+  library::get().trim();
+  ++library::get().frame;
+
+  l.frame_heap_allocs = l.heap_allocs - l.heap_allocs_mark;
+  l.heap_allocs_mark = l.heap_allocs;
+
+  //compaction goes on while nothing new is rasterized, warmup below counts toward the next frame
+  l.defrag_step();
+  l.frame_uploads = 0;
+
+  //background warmup, a few glyphs per frame, after drawing so this frame's list stays valid
+  unsigned int budget = warmup_budget;
+
+  for( auto& i : library::get().instances )
+  {
+    while( budget > 0 && !i->warmup_queue.empty() )
+    {
+      add_glyph( *i, i->warmup_queue.back() );
+      i->warmup_queue.pop_back();
+      --budget;
+    }
+
+    zoom_step( *i, budget );
+  }
+  library::get().restore_gl_state();
+
+  //the first call of the next frame captures the caller's state again
+  if( library::get().gl_capture == FONT_CAPTURE_EVERY_FRAME )
+    library::get().invalidate_gl_state();
+}
+
+mm::vec2 font::add_static_block( const std::string& id, const font_text* segments, size_t count, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f, int mode )
+{
+  size_t size = decode( segments, count );
+
+  font_inst* fp = &font_ptr;
+  unsigned int font_size = font_ptr.the_face->get_size();
+  unsigned long long h = hash_bytes( &codepoints[0], sizeof( uint32_t ) * size );
+  h = hash_bytes( &fp, sizeof( fp ), h );
+  h = hash_bytes( &font_size, sizeof( font_size ), h );
+  h = hash_bytes( &font_ptr.zoom_scale, sizeof( font_ptr.zoom_scale ), h );
+  h = hash_bytes( &color, sizeof( color ), h );
+  h = hash_bytes( &mat, sizeof( mat ), h );
+  h = hash_bytes( &highlight_color, sizeof( highlight_color ), h );
+  h = hash_bytes( &line_height, sizeof( line_height ), h );
+  h = hash_bytes( &f, sizeof( f ), h );
+  h = hash_bytes( &screensize, sizeof( screensize ), h );
+
+  unsigned int frame = library::get().get_frame();
+  font_block& b = blocks[id];
+
+  if( b.hash != h )
+  {
+    release_block( b );
+    b.hash = h;
+    b.stable_frames = 0;
+  }
+  else if( b.last_used != frame )
+  {
+    ++b.stable_frames;
+  }
+
+  b.last_used = frame;
+
+  //the cached surfaces are drawn with the blit shader, without it blocks stay instances
+  bool cached = library::get().the_blit_shader && ( mode == FONT_BLOCK_CACHED ||
+                ( mode == FONT_BLOCK_AUTO && b.glyphs >= block_min_glyphs && b.stable_frames >= block_stable_frames ) );
+
+  if( cached && ( b.fbo || render_block( b, size, font_ptr, color, mat, highlight_color, line_height, f ) ) )
+  {
+    layers[current_layer].blocks.push_back( &b );
+    return b.lastpos;
+  }
+
+  size_t begin = layers[current_layer].list.size();
+  font_sink out( layers[current_layer].list, ( float )current_layer );
+  b.lastpos = layout( &codepoints[0], size, font_ptr, color, mat, highlight_color, line_height, f, out );
+  b.glyphs = out.count;
+  submit( current_layer, begin );
+  return b.lastpos;
+}
+
+void font::release_block( font_block& b )
+{
+  if( !b.fbo )
+    return;
+
+  library& l = library::get();
+
+  glDeleteFramebuffers( 1, &b.fbo );
+  glDeleteTextures( 1, &b.tex );
+  l.forget_texture( b.tex );
+
+  if( l.gl_current.draw_framebuffer == ( GLint )b.fbo )
+    l.gl_current.draw_framebuffer = 0;
+
+  block_bytes -= ( size_t )b.rect.z * b.rect.w * 4;
+  b.fbo = 0;
+  b.tex = 0;
+}
+
+//evicts the least recently drawn surfaces, never the ones drawn this frame
+bool font::make_block_room( size_t bytes )
+{
+  unsigned int frame = library::get().get_frame();
+
+  while( block_bytes + bytes > block_budget )
+  {
+    font_block* lru = 0;
+
+    for( auto& c : blocks )
+    {
+      if( c.second.fbo && c.second.last_used != frame && ( !lru || c.second.last_used < lru->last_used ) )
+        lru = &c.second;
+    }
+
+    if( !lru )
+      return false;
+
+    release_block( *lru );
+  }
+
+  return true;
+}
+
+//lays the block out and renders it into a fitting premultiplied surface
+bool font::render_block( font_block& b, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  block_scratch.clear();
+  font_sink out( block_scratch );
+  b.lastpos = layout( &codepoints[0], size, font_ptr, color, mat, highlight_color, line_height, f, out );
+  b.glyphs = out.count;
+
+  if( block_scratch.empty() )
+    return false;
+
+  //pixel bounds of the transformed quads
+  mm::vec2 lo( FLT_MAX ), hi( -FLT_MAX );
+
+  for( auto& i : block_scratch )
+  {
+    for( int c = 0; c < 4; ++c )
+    {
+      mm::vec4 v = i.transform * mm::vec4( ( float )( c & 1 ), ( float )( c >> 1 ), 0, 1 );
+      mm::vec2 p = v.xy * i.vertscalebias.xy + i.vertscalebias.zw;
+      lo = mm::min( lo, p );
+      hi = mm::max( hi, p );
+    }
+  }
+
+  mm::ivec4 rect( ( int )std::floor( lo.x ) - 1, ( int )std::floor( lo.y ) - 1, 0, 0 );
+  rect.z = ( int )std::ceil( hi.x ) + 1 - rect.x;
+  rect.w = ( int )std::ceil( hi.y ) + 1 - rect.y;
+
+  library& l = library::get();
+
+  size_t bytes = ( size_t )rect.z * rect.w * 4;
+
+  if( rect.z > l.max_texture_size || rect.w > l.max_texture_size || !make_block_room( bytes ) )
+    return false;
+
+  b.rect = rect;
+  block_bytes += bytes;
+
+  glGenTextures( 1, &b.tex );
+  l.bind_texture( 0, GL_TEXTURE_2D, b.tex );
+  glTexStorage2D( GL_TEXTURE_2D, 1, GL_RGBA8, rect.z, rect.w );
+
+  glGenFramebuffers( 1, &b.fbo );
+  l.bind_draw_framebuffer( b.fbo );
+  glFramebufferTexture2D( GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, b.tex, 0 );
+
+  if( glCheckFramebufferStatus( GL_DRAW_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+  {
+    std::cerr << "Couldn't create a text block surface." << std::endl;
+    l.restore_gl_state();
+    release_block( b );
+    return false;
+  }
+
+  l.set_viewport( 0, 0, rect.z, rect.w );
+
+  GLfloat clear[4] = { 0, 0, 0, 0 };
+  glClearBufferfv( GL_COLOR, 0, clear );
+
+  l.set_capability( GL_CULL_FACE, false );
+  l.set_capability( GL_DEPTH_TEST, false );
+  l.set_capability( GL_BLEND, true );
+  //premultiplied color, alpha accumulates coverage
+  l.set_blend_func( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+
+  l.bind_shader();
+
+  mm::frame<float> surface_frame;
+  surface_frame.set_ortographic( ( float )rect.x, ( float )( rect.x + rect.z ), ( float )rect.y, ( float )( rect.y + rect.w ), 0.0f, 1.0f );
+  mm::mat4 proj = surface_frame.projection_matrix;
+  glUniformMatrix4fv( 0, 1, false, &proj[0].x );
+  glUniform1f( 1, ( float )FONT_ATLAS_PAGE_SIZE );
+  glUniform1i( 5, ( GLint )l.get_channels() );
+
+  l.bind_texture();
+  l.bind_vao();
+
+  //borrow the vao for the block's own buffer, the shared buffer may already hold this frame's layers
+  l.bind_buffer( GL_ARRAY_BUFFER, l.vbos[FONT_BLOCK] );
+  glBufferData( GL_ARRAY_BUFFER, sizeof( font_instance ) * block_scratch.size(), &block_scratch[0], GL_STREAM_DRAW );
+  l.set_instance_attribs( l.vbos[FONT_BLOCK], 0 );
+
+  glDrawElementsInstanced( GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, block_scratch.size() );
+
+  l.set_instance_attribs( l.vbos[FONT_INSTANCES], 0 );
+
+  l.restore_gl_state();
+
+  return true;
+}
+
+//one quad per cached block, called from render_layers with its state bound
+void font::draw_blocks( const unsigned int* ids, size_t count )
+{
+  library& l = library::get();
+  bool bound = false;
+
+  for( size_t c = 0; c < count; ++c )
+  {
+    const font_layer& y = layers[ids[c]];
+
+    if( y.blocks.empty() )
+      continue;
+
+    if( !bound )
+    {
+      l.use_program( l.the_blit_shader );
+      l.bind_vertex_array( l.blit_vao );
+      l.set_blend_func( GL_ONE, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+      bound = true;
+    }
+
+    mm::mat4 proj = y.params.screen_projection ? font_frame.projection_matrix : y.params.projection;
+    glUniformMatrix4fv( 0, 1, false, &proj[0].x );
+
+    for( auto b : y.blocks )
+    {
+      glUniform4f( 1, ( float )b->rect.x, ( float )b->rect.y, ( float )b->rect.z, ( float )b->rect.w );
+      l.bind_texture( 0, GL_TEXTURE_2D, b->tex );
+      glDrawArrays( GL_TRIANGLE_STRIP, 0, 4 );
+    }
+  }
+
+  if( bound )
+  {
+    l.bind_shader();
+    l.bind_vao();
+  }
+}
+
+font_stats font::get_stats()
+{
+  font_stats s = library::get().get_stats();
+  s.cached_blocks = 0;
+  s.surface_bytes = block_bytes;
+  s.upload_bytes = last_upload_bytes;
+  s.queue_chunks = 0;
+  s.queue_waits = queue_waits;
+  s.queue_dropped = queue_dropped;
+  s.queue_deferred = queue_deferred;
+
+  for( int c = 0; c < FONT_QUEUE_CHUNKS; ++c )
+  {
+    if( queue_used[c] )
+      ++s.queue_chunks;
+  }
+
+  for( auto& c : blocks )
+  {
+    if( c.second.fbo )
+      ++s.cached_blocks;
+  }
+
+  return s;
+}
+
+void font::destroy()
+{
+  for( auto& c : blocks )
+    release_block( c.second );
+
+  blocks.clear();
+
+  for( auto& c : layers )
+    c.blocks.clear();
+
+  if( gpu_fence )
+    glDeleteSync( gpu_fence );
+
+  gpu_fence = 0;
+  gpu_glyphs.clear(); //the tables get built and uploaded again
+
+  //producers have to be done by now
+  queue_frames.clear();
+  queue_head = 0;
+
+  for( int c = 0; c < FONT_QUEUE_CHUNKS; ++c )
+  {
+    delete queue_pool[c];
+    queue_pool[c] = 0;
+    queue_used[c] = false;
+  }
+
+  library::get().destroy();
+}
+
+size_t font::add_labels( const font_label_batch& batch, font_inst& font_ptr, const mm::vec4& color, float line_height, float f )
+{
+  if( !batch.count || !batch.text )
+    return 0;
+
+  library& l = library::get();
+
+  //decode everything once
+  label_codepoints.clear();
+  label_offsets.resize( batch.count + 1 );
+  label_instances.resize( batch.count + 1 );
+  label_line_advance.resize( batch.count );
+
+  for( size_t c = 0; c < batch.count; ++c )
+  {
+    size_t size = decode( &batch.text[c], 1 );
+    label_offsets[c] = label_codepoints.size();
+    label_codepoints.insert( label_codepoints.end(), codepoints.begin(), codepoints.begin() + size + 1 );
+  }
+
+  label_offsets[batch.count] = label_codepoints.size();
+
+  //serial pass: load missing glyphs and kerning, count instances
+  //if the atlas had to be emptied midway, earlier labels lost their glyphs, so go again
+  for( int tries = 0; tries < 2; ++tries )
+  {
+    unsigned int generation = l.generation;
+    font_inst* last_font = 0;
+    float va = 0;
+
+    label_instances[0] = 0;
+
+    for( size_t c = 0; c < batch.count; ++c )
+    {
+      font_inst& fi = batch.fonts && batch.fonts[c] ? *batch.fonts[c] : font_ptr;
+      font_inst::face* fc = fi.the_face;
+
+      if( &fi != last_font )
+      {
+        last_font = &fi;
+        va = ( fc->height() - fc->linegap() ) * line_height;
+
+        if( fc->file )
+          fc->file->sizes[fc->get_size()].last_used = l.get_frame();
+      }
+
+      label_line_advance[c] = va;
+
+      const uint32_t* txt = &label_codepoints[label_offsets[c]];
+      size_t size = label_offsets[c + 1] - label_offsets[c] - 1;
+      size_t n = 0;
+
+      for( size_t i = 0; i < size; ++i )
+      {
+        if( txt[i] == L'\n' || is_special( txt[i] ) )
+          continue;
+
+        add_glyph( fi, txt[i] );
+
+        if( i > 0 )
+          fc->kerning( txt[i - 1], txt[i] );
+
+        //only what layout_labels will find gets a slot
+        if( txt[i] != L' ' && fc->find_glyph( txt[i] ) )
+        {
+          ++n;
+
+          if( fi.profiling )
+            ++fi.usage[fc->get_size()][txt[i]];
+        }
+      }
+
+      label_instances[c + 1] = label_instances[c] + n;
+    }
+
+    if( generation == l.generation )
+      break;
+  }
+
+  l.restore_gl_state();
+
+  //one contiguous range, the workers fill disjoint parts of it
+  font_layer& y = layers[current_layer];
+  size_t begin = y.list.size();
+  size_t total = label_instances[batch.count];
+  y.list.resize( begin + total );
+
+  font_instance* out = total ? &y.list[begin] : 0;
+  float layer = ( float )current_layer;
+
+  unsigned int threads = ( unsigned int )std::min( ( size_t )label_threads, ( batch.count + 255 ) / 256 );
+
+  if( threads > 1 )
+  {
+    size_t chunk = ( batch.count + threads - 1 ) / threads;
+    std::atomic<unsigned int> next( 0 );
+
+    l.run_on_threads( threads, [&]()
+    {
+      for( unsigned int t; ( t = next++ ) < threads; )
+      {
+        size_t first = std::min( chunk * t, batch.count );
+        layout_labels( batch, font_ptr, color, f, layer, first, std::min( first + chunk, batch.count ), out );
+      }
+    } );
+  }
+  else
+  {
+    layout_labels( batch, font_ptr, color, f, layer, 0, batch.count, out );
+  }
+
+  submit( current_layer, begin );
+  return total;
+}
+
+//labels [first, last), only reads the glyph maps and the font data
+void font::layout_labels( const font_label_batch& batch, font_inst& font_ptr, const mm::vec4& color, float f, float layer, size_t first, size_t last, font_instance* out )
+{
+  library& l = library::get();
+
+  for( size_t c = first; c < last; ++c )
+  {
+    font_inst& fi = batch.fonts && batch.fonts[c] ? *batch.fonts[c] : font_ptr;
+    font_inst::face* fc = fi.the_face;
+
+    //zooming: laid out at the drawn size and scaled about the label's origin, like layout_range
+    float zs = fi.zoom_scale;
+
+    const uint32_t* txt = &label_codepoints[label_offsets[c]];
+    size_t size = label_offsets[c + 1] - label_offsets[c] - 1;
+    font_instance* dst = out + label_instances[c];
+    font_instance* end = out + label_instances[c + 1];
+
+    const mm::vec4& col = batch.color ? batch.color[c] : color;
+    const mm::mat4& mat = batch.transform_index ? batch.transforms[batch.transform_index[c]] : mm::mat4::identity;
+    mm::vec2 origin = batch.position ? batch.position[c] : mm::vec2( 0, ( float )screensize.y - label_line_advance[c] * zs );
+    mm::vec2 pen = mm::vec2( 0 );
+
+    for( size_t i = 0; i < size; ++i )
+    {
+      if( txt[i] == L'\n' )
+      {
+        pen = mm::vec2( 0, pen.y - label_line_advance[c] );
+        continue;
+      }
+
+      if( is_special( txt[i] ) )
+        continue;
+
+      if( i > 0 )
+        pen.x += fc->cached_kerning( txt[i - 1], txt[i] );
+
+      const glyph* g = fc->find_glyph( txt[i] );
+
+      if( !g )
+        continue;
+
+      if( txt[i] != L' ' && dst < end )
+      {
+        const fontscalebias& fsb = l.font_data[g->cache_index];
+        *dst = font_instance( mm::vec4( fsb.vertscalebias.xy * zs, ( fsb.vertscalebias.zw + pen ) * zs + origin ), fsb.texscalebias, col, mat, f );
+        dst->layer = layer;
+        ++dst;
+      }
+
+      pen.x += g->advance.x / 64.0f;
+    }
+
+    //a glyph lost after it was counted leaves its slot empty, it draws nothing
+    for( ; dst < end; ++dst )
+    {
+      *dst = font_instance( mm::vec4( 0 ), mm::vec4( 0 ), col, mat, f );
+      dst->layer = layer;
+    }
+  }
+}
+
+//lays the text out around its center, the label index goes into the layer attribute
+void font::layout_world_label( unsigned int id )
+{
+  font_world_text& t = world_texts[id];
+
+  t.glyphs.clear();
+  t.size = t.font->the_face->get_size();
+  font_sink out( t.glyphs, ( float )id );
+  layout( &t.text[0], t.text.size() - 1, *t.font, t.color, mm::mat4::identity, mm::vec4( 1 ), 1, t.filter, out );
+
+  mm::vec2 lo( FLT_MAX ), hi( -FLT_MAX );
+
+  for( auto& i : t.glyphs )
+  {
+    lo = mm::min( lo, i.vertscalebias.zw );
+    hi = mm::max( hi, i.vertscalebias.zw + i.vertscalebias.xy );
+  }
+
+  mm::vec2 center = t.glyphs.empty() ? mm::vec2( 0 ) : ( lo + hi ) * 0.5f;
+
+  for( auto& i : t.glyphs )
+    i.vertscalebias = mm::vec4( i.vertscalebias.xy, i.vertscalebias.zw - center );
+
+  world_labels[id].extent = t.glyphs.empty() ? 0 : mm::length( ( hi - lo ) * 0.5f );
+  world_glyphs_dirty = true;
+  world_labels_dirty = true;
+}
+
+unsigned int font::add_world_label( const font_text& text, font_inst& font_ptr, const font_world_label& l, const mm::vec4& color, float f )
+{
+  unsigned int id;
+
+  if( !world_free.empty() )
+  {
+    id = world_free.back();
+    world_free.pop_back();
+  }
+  else
+  {
+    id = world_labels.size();
+    world_labels.push_back( font_world_label() );
+    world_texts.push_back( font_world_text() );
+  }
+
+  world_labels[id] = l;
+  world_texts[id].alive = true;
+  world_texts[id].filter = f;
+  set_world_label_text( id, text, font_ptr, color );
+  return id;
+}
+
+void font::set_world_label_text( unsigned int id, const font_text& text, font_inst& font_ptr, const mm::vec4& color )
+{
+  if( id >= world_texts.size() || !world_texts[id].alive )
+  {
+    std::cerr << "Invalid world label: " << id << std::endl;
+    return;
+  }
+
+  font_world_text& t = world_texts[id];
+  size_t size = decode( &text, 1 );
+  t.text.assign( codepoints.begin(), codepoints.begin() + size + 1 );
+  t.font = &font_ptr;
+  t.color = color;
+  layout_world_label( id );
+}
+
+void font::set_world_label( unsigned int id, const font_world_label& l )
+{
+  if( id >= world_labels.size() || !world_texts[id].alive )
+  {
+    std::cerr << "Invalid world label: " << id << std::endl;
+    return;
+  }
+
+  float extent = world_labels[id].extent;
+  world_labels[id] = l;
+  world_labels[id].extent = extent;
+  world_labels_dirty = true;
+}
+
+void font::set_world_label_anchor( unsigned int id, const mm::vec3& anchor )
+{
+  if( id >= world_labels.size() || !world_texts[id].alive )
+  {
+    std::cerr << "Invalid world label: " << id << std::endl;
+    return;
+  }
+
+  world_labels[id].anchor_scale = mm::vec4( anchor, world_labels[id].anchor_scale.w );
+  world_labels_dirty = true;
+}
+
+void font::remove_world_label( unsigned int id )
+{
+  if( id >= world_texts.size() || !world_texts[id].alive )
+    return;
+
+  font_world_text& t = world_texts[id];
+  t.alive = false;
+  t.glyphs.clear();
+  t.text.clear();
+  t.font = 0;
+  world_free.push_back( id );
+  world_glyphs_dirty = true;
+}
+
+void font::render_world_labels( const mm::mat4& view, const mm::mat4& projection )
+{
+  library& l = library::get();
+
+  if( world_texts.size() == world_free.size() || !l.the_world_shader )
+    return;
+
+  //the atlas was emptied or glyphs were released, their cells may hold other glyphs now, lay everything out again
+  //if that filled the atlas and emptied it, once more
+  for( int tries = 0; tries < 2 && ( world_generation != l.generation || world_releases != l.releases ); ++tries )
+  {
+    world_generation = l.generation;
+    world_releases = l.releases;
+
+    for( unsigned int c = 0; c < world_texts.size(); ++c )
+    {
+      if( world_texts[c].alive )
+        layout_world_label( c );
+    }
+  }
+
+  //keep the sizes the labels were laid out at from being trimmed
+  for( auto& t : world_texts )
+  {
+    if( t.alive && t.font->the_face->file )
+      t.font->the_face->file->sizes[t.size].last_used = l.get_frame();
+  }
+
+  //glyphs only go up when some text changed
+  if( world_glyphs_dirty )
+  {
+    world_scratch.clear();
+
+    for( auto& t : world_texts )
+    {
+      t.first = world_scratch.size();
+      world_scratch.insert( world_scratch.end(), t.glyphs.begin(), t.glyphs.end() );
+    }
+
+    l.bind_buffer( GL_ARRAY_BUFFER, l.vbos[FONT_WORLD_GLYPHS] );
+
+    if( !world_scratch.empty() )
+      glBufferData( GL_ARRAY_BUFFER, sizeof( font_instance ) * world_scratch.size(), &world_scratch[0], GL_STATIC_DRAW );
+
+    upload_bytes += sizeof( font_instance ) * world_scratch.size();
+    world_glyphs_dirty = false;
+  }
+
+  if( world_labels_dirty )
+  {
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_WORLD_LABELS] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( font_world_label ) * world_labels.size(), &world_labels[0], GL_DYNAMIC_DRAW );
+    upload_bytes += sizeof( font_world_label ) * world_labels.size();
+    world_labels_dirty = false;
+  }
+
+  //one draw per label, back to front so overlapping labels blend right
+  world_order.clear();
+
+  for( unsigned int c = 0; c < world_texts.size(); ++c )
+  {
+    if( !world_texts[c].alive || world_texts[c].glyphs.empty() )
+      continue;
+
+    float depth = 0;
+
+    if( world_sort )
+      depth = ( view * mm::vec4( world_labels[c].anchor_scale.xyz, 1 ) ).z;
+
+    world_order.push_back( std::make_pair( depth, c ) );
+  }
+
+  if( world_order.empty() )
+    return;
+
+  if( world_sort )
+    std::sort( world_order.begin(), world_order.end() );
+
+  //count, instance count, first index, base vertex, base instance, label for the cull pass
+  world_commands.clear();
+
+  for( auto& o : world_order )
+  {
+    const font_world_text& t = world_texts[o.second];
+    GLuint cmd[6] = { 6, ( GLuint )t.glyphs.size(), 0, 0, ( GLuint )t.first, o.second };
+    world_commands.insert( world_commands.end(), cmd, cmd + 6 );
+  }
+
+  l.bind_buffer( GL_DRAW_INDIRECT_BUFFER, l.vbos[FONT_WORLD_COMMANDS] );
+  glBufferData( GL_DRAW_INDIRECT_BUFFER, sizeof( GLuint ) * world_commands.size(), &world_commands[0], GL_STREAM_DRAW );
+  upload_bytes += sizeof( GLuint ) * world_commands.size();
+
+  mm::vec2 viewport_size( ( float )screensize.x, ( float )screensize.y );
+
+  l.bind_storage_buffer( 1, l.vbos[FONT_WORLD_LABELS] );
+
+  //culled labels get an instance count of 0
+  if( world_gpu_cull && l.the_world_cull_shader )
+  {
+    l.use_program( l.the_world_cull_shader );
+    glUniformMatrix4fv( 0, 1, false, &view[0].x );
+    glUniformMatrix4fv( 2, 1, false, &projection[0].x );
+    glUniform2f( 3, viewport_size.x, viewport_size.y );
+    glUniform1ui( 4, ( GLuint )world_order.size() );
+
+    l.bind_storage_buffer( 3, l.vbos[FONT_WORLD_COMMANDS] );
+    glDispatchCompute( ( GLuint )( world_order.size() + 63 ) / 64, 1, 1 );
+    glMemoryBarrier( GL_COMMAND_BARRIER_BIT );
+  }
+
+  //depth is tested per label in the shader, labels don't occlude each other
+  l.set_capability( GL_CULL_FACE, false );
+  l.set_capability( GL_DEPTH_TEST, true );
+  l.set_depth_mask( false );
+  l.set_capability( GL_BLEND, true );
+  l.set_blend_mode( FONT_BLEND_ALPHA );
+
+  l.use_program( l.the_world_shader );
+  glUniformMatrix4fv( 0, 1, false, &view[0].x );
+  glUniform1f( 1, ( float )FONT_ATLAS_PAGE_SIZE );
+  glUniform1i( 5, ( GLint )l.get_channels() );
+  glUniformMatrix4fv( 2, 1, false, &projection[0].x );
+  glUniform2f( 3, viewport_size.x, viewport_size.y );
+
+  l.bind_texture();
+  l.bind_vertex_array( l.world_vao );
+
+  glMultiDrawElementsIndirect( GL_TRIANGLES, GL_UNSIGNED_INT, 0, world_order.size(), sizeof( GLuint ) * 6 );
+
+  l.restore_gl_state();
+}
+
+//loads what the last gpu layout reported missing, waits for it only if asked to
+void font::load_gpu_missing( bool wait )
+{
+  if( !gpu_fence )
+    return;
+
+  GLenum r = glClientWaitSync( gpu_fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0 );
+
+  if( r == GL_TIMEOUT_EXPIRED )
+    return;
+
+  glDeleteSync( gpu_fence );
+  gpu_fence = 0;
+
+  //the size changed since, the pairs would go to the wrong cache
+  if( r == GL_WAIT_FAILED || !gpu_font || gpu_font->the_face->get_size() != gpu_size )
+    return;
+
+  library& l = library::get();
+
+  GLuint count = 0;
+  l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_STATUS] );
+  glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, sizeof( GLuint ) * 5, sizeof( GLuint ), &count );
+
+  count = std::min( count, ( GLuint )FONT_GPU_MISSING );
+
+  if( !count )
+    return;
+
+  gpu_missing.resize( count * 2 );
+  glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, FONT_GPU_STATUS_HEADER, sizeof( GLuint ) * 2 * count, &gpu_missing[0] );
+
+  //glyphs come as ( codepoint, ~0 ), kerning pairs as ( prev, next )
+  for( GLuint c = 0; c < count; ++c )
+  {
+    if( gpu_missing[c * 2 + 1] == 0xFFFFFFFF )
+      add_glyph( *gpu_font, gpu_missing[c * 2] );
+    else
+      gpu_font->the_face->kerning( gpu_missing[c * 2], gpu_missing[c * 2 + 1] );
+  }
+}
+
+bool font::dispatch_gpu_layout( const uint32_t* txt, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, float line_height, float f )
+{
+  library& l = library::get();
+
+  if( !l.the_layout_shader || !size )
+    return false;
+
+  size_t blocks = ( size + FONT_GPU_BLOCK_SIZE - 1 ) / FONT_GPU_BLOCK_SIZE;
+
+  if( blocks > 65535 )
+  {
+    std::cerr << "Text too long for the gpu layout: " << size << " codepoints." << std::endl;
+    return false;
+  }
+
+  //what the previous layout found missing goes into the cache first
+  load_gpu_missing( false );
+
+  font_inst::face* fc = font_ptr.the_face;
+
+  if( fc->file )
+    fc->file->sizes[fc->get_size()].last_used = l.get_frame();
+
+  //the tables only change with the glyph cache: glyphs and pairs are only added by loading,
+  //anything taken out bumps releases or trimmed_sizes, an emptied or compacted atlas the generation
+  bool kerning = fc->file && FT_HAS_KERNING( ( ( FT_Face )fc->the_face ) );
+  auto s = fc->glyphs->find( fc->get_size() );
+  size_t glyphs = s != fc->glyphs->end() ? s->second.size() : 0;
+  size_t kerns = fc->file ? fc->file->kerning.size() : 0;
+
+  if( gpu_table_file != fc->file || gpu_table_size != fc->get_size() || gpu_table_generation != l.generation || gpu_table_releases != l.releases ||
+      gpu_table_glyphs != glyphs || gpu_table_kerns != kerns || gpu_table_trims != l.trimmed_sizes || gpu_glyphs.empty() )
+  {
+    gpu_table_file = fc->file;
+    gpu_table_size = fc->get_size();
+    gpu_table_generation = l.generation;
+    gpu_table_releases = l.releases;
+    gpu_table_glyphs = glyphs;
+    gpu_table_kerns = kerns;
+    gpu_table_trims = l.trimmed_sizes;
+
+    //glyphs are sorted by codepoint, as in the glyph map, the shader does a binary search
+    gpu_glyphs.clear();
+
+    if( s != fc->glyphs->end() )
+    {
+      for( auto& g : s->second )
+      {
+        const fontscalebias& fsb = l.font_data[g.second.cache_index];
+        font_gpu_glyph e;
+        e.vertscalebias = fsb.vertscalebias;
+        e.texscalebias = fsb.texscalebias;
+        e.code = g.first;
+        e.advance = ( int )g.second.advance.x;
+        e.pad[0] = e.pad[1] = 0;
+        gpu_glyphs.push_back( e );
+      }
+    }
+
+    gpu_kerns.clear();
+
+    if( kerning )
+    {
+      for( auto& k : fc->file->kerning )
+      {
+        if( ( k.first >> 42 ) != fc->get_size() )
+          continue;
+
+        font_gpu_kern e;
+        e.prev = ( uint32_t )( ( k.first >> 21 ) & 0x1FFFFF );
+        e.next = ( uint32_t )( k.first & 0x1FFFFF );
+        e.kern = ( int )std::floor( k.second * 64.0f + 0.5f );
+        e.pad = 0;
+        gpu_kerns.push_back( e );
+      }
+
+      std::sort( gpu_kerns.begin(), gpu_kerns.end(), []( const font_gpu_kern& a, const font_gpu_kern& b )
+      {
+        return a.prev < b.prev || ( a.prev == b.prev && a.next < b.next );
+      } );
+    }
+
+    gpu_glyph_count = gpu_glyphs.size();
+    gpu_kern_count = gpu_kerns.size();
+
+    //empty buffers can't be bound
+    if( gpu_glyphs.empty() )
+      gpu_glyphs.resize( 1 );
+
+    if( gpu_kerns.empty() )
+      gpu_kerns.resize( 1 );
+
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_GLYPHS] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( font_gpu_glyph ) * gpu_glyphs.size(), &gpu_glyphs[0], GL_STREAM_DRAW );
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_KERNING] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( font_gpu_kern ) * gpu_kerns.size(), &gpu_kerns[0], GL_STREAM_DRAW );
+
+    upload_bytes += sizeof( font_gpu_glyph ) * gpu_glyphs.size() + sizeof( font_gpu_kern ) * gpu_kerns.size();
+  }
+
+  l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_CODEPOINTS] );
+  glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( uint32_t ) * size, txt, GL_STREAM_DRAW );
+
+  upload_bytes += sizeof( uint32_t ) * size;
+
+  //one instance per codepoint at most
+  if( size > gpu_capacity )
+  {
+    gpu_capacity = blocks * FONT_GPU_BLOCK_SIZE;
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_BLOCKS] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( GLuint ) * 4 * blocks, 0, GL_DYNAMIC_COPY );
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_INSTANCES] );
+    glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof( font_instance ) * gpu_capacity, 0, GL_DYNAMIC_COPY );
+  }
+
+  //draw command with no instances yet, empty missing list
+  GLuint status[6] = { 6, 0, 0, 0, 0, 0 };
+  l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_STATUS] );
+  glBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, sizeof( status ), status );
+
+  float vert_advance = fc->height() - fc->linegap();
+  vert_advance *= line_height;
+
+  l.use_program( l.the_layout_shader );
+  glUniform1ui( 0, ( GLuint )size );
+  glUniform1ui( 2, ( GLuint )gpu_glyph_count );
+  glUniform1ui( 3, ( GLuint )gpu_kern_count );
+  glUniform1f( 4, vert_advance );
+  glUniform1f( 5, ( float )screensize.y );
+  glUniform4fv( 6, 1, &color.x );
+  glUniformMatrix4fv( 7, 1, false, &mat[0].x );
+  glUniform1f( 11, f );
+  glUniform1ui( 12, kerning ? 1 : 0 );
+  glUniform1ui( 13, ( GLuint )blocks );
+  glUniform1ui( 14, FONT_GPU_MISSING );
+
+  l.bind_storage_buffer( 0, l.vbos[FONT_GPU_CODEPOINTS] );
+  l.bind_storage_buffer( 1, l.vbos[FONT_GPU_GLYPHS] );
+  l.bind_storage_buffer( 2, l.vbos[FONT_GPU_KERNING] );
+  l.bind_storage_buffer( 3, l.vbos[FONT_GPU_BLOCKS] );
+  l.bind_storage_buffer( 4, l.vbos[FONT_GPU_INSTANCES] );
+  l.bind_storage_buffer( 5, l.vbos[FONT_GPU_STATUS] );
+
+  //block scans, the scan of the block totals, then the instances
+  glUniform1ui( 1, 0 );
+  glDispatchCompute( ( GLuint )blocks, 1, 1 );
+  glMemoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+
+  glUniform1ui( 1, 1 );
+  glDispatchCompute( 1, 1, 1 );
+  glMemoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+
+  glUniform1ui( 1, 2 );
+  glDispatchCompute( ( GLuint )blocks, 1, 1 );
+  glMemoryBarrier( GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT );
+
+  if( gpu_fence )
+    glDeleteSync( gpu_fence );
+
+  gpu_fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+  gpu_font = &font_ptr;
+  gpu_size = fc->get_size();
+
+  return true;
+}
+
+void font::render_gpu_text( const font_text& text, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, float line_height, float f )
+{
+  library& l = library::get();
+
+  size_t size = decode( &text, 1 );
+
+  if( !dispatch_gpu_layout( &codepoints[0], size, font_ptr, color, mat, line_height, f ) )
+  {
+    l.restore_gl_state();
+    return;
+  }
+
+  l.set_capability( GL_CULL_FACE, false );
+  l.set_capability( GL_DEPTH_TEST, false );
+  l.set_capability( GL_BLEND, true );
+  l.set_blend_mode( FONT_BLEND_ALPHA );
+
+  //the instances have no layer, they use the screen projection
+  l.bind_shader();
+  mm::mat4 proj = font_frame.projection_matrix;
+  glUniformMatrix4fv( 0, 1, false, &proj[0].x );
+  glUniform1f( 1, ( float )FONT_ATLAS_PAGE_SIZE );
+  glUniform1i( 5, ( GLint )l.get_channels() );
+
+  l.bind_texture();
+  l.bind_vertex_array( l.gpu_vao );
+
+  //the instance count was written by the layout
+  l.bind_buffer( GL_DRAW_INDIRECT_BUFFER, l.vbos[FONT_GPU_STATUS] );
+  glDrawElementsIndirect( GL_TRIANGLES, GL_UNSIGNED_INT, 0 );
+
+  l.restore_gl_state();
+}
+
+size_t font::verify_gpu_layout( const font_text& text, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, float line_height, float f )
+{
+  library& l = library::get();
+
+  //the cpu layout runs first and loads every glyph and kerning pair the gpu needs
+  size_t size = decode( &text, 1 );
+  std::vector<font_instance> cpu;
+  font_sink out( cpu );
+  layout( &codepoints[0], size, font_ptr, color, mat, mm::vec4( 1 ), line_height, f, out );
+
+  if( !dispatch_gpu_layout( &codepoints[0], size, font_ptr, color, mat, line_height, f ) )
+  {
+    std::cerr << "Couldn't run the gpu layout." << std::endl;
+    l.restore_gl_state();
+    return cpu.size();
+  }
+
+  GLuint count = 0;
+  l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_STATUS] );
+  glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, sizeof( GLuint ), sizeof( GLuint ), &count );
+
+  std::vector<font_instance> gpu( count );
+
+  if( count )
+  {
+    l.bind_buffer( GL_SHADER_STORAGE_BUFFER, l.vbos[FONT_GPU_INSTANCES] );
+    glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, sizeof( font_instance ) * count, &gpu[0] );
+  }
+
+  load_gpu_missing( true );
+  l.restore_gl_state();
+
+  //field by field, the tail padding is not written by the shader
+  font_instance i;
+  size_t compared = ( char* )&i.layer - ( char* )&i + sizeof( float );
+  size_t n = std::min( cpu.size(), gpu.size() );
+  size_t differ = std::max( cpu.size(), gpu.size() ) - n;
+
+  for( size_t c = 0; c < n; ++c )
+  {
+    if( memcmp( &cpu[c], &gpu[c], compared ) )
+      ++differ;
+  }
+
+  if( differ )
+    std::cerr << "Gpu layout: " << differ << " of " << cpu.size() << " instances differ from the cpu layout." << std::endl;
+
+  return differ;
+}
+
+//counts what the chunk produces and collects what it needs loaded, only reads the caches
+void font::scan_chunk( const uint32_t* txt, font_chunk& k, font_inst& font_ptr )
+{
+  font_inst::face* fc = font_ptr.the_face;
+
+  k.lines = 0;
+  k.glyphs = 0;
+  k.missing_glyphs.clear();
+  k.missing_kerning.clear();
+  k.glyphs_seen.clear();
+  k.pairs_seen.clear();
+
+  for( int d = 0; d < 4; ++d )
+  {
+    k.decorated[d] = 0;
+    k.inherited[d] = 0;
+    k.switched[d] = -1;
+  }
+
+  for( size_t c = k.begin; c < k.end; ++c )
+  {
+    uint32_t ch = txt[c];
+
+    if( ch == L'\n' )
+    {
+      ++k.lines;
+    }
+    else if( is_special( ch ) )
+    {
+      //begin/end pairs in font_markup order
+      k.switched[( ch - FONT_UNDERLINE_BEGIN ) / 2] = ( ch - FONT_UNDERLINE_BEGIN ) % 2 == 0;
+    }
+    else
+    {
+      if( !fc->has_glyph( ch ) && k.glyphs_seen.insert( ch ).second )
+        k.missing_glyphs.push_back( ch );
+
+      if( c > 0 && !fc->has_kerning( txt[c - 1], ch ) && k.pairs_seen.insert( ( ( uint64_t )txt[c - 1] << 32 ) | ch ).second )
+        k.missing_kerning.push_back( std::make_pair( txt[c - 1], ch ) );
+
+      if( ch != L' ' )
+        ++k.glyphs;
+    }
+
+    //decorations go under every character, see layout_range
+    for( int d = 0; d < 4; ++d )
+    {
+      if( k.switched[d] < 0 )
+        ++k.inherited[d];
+      else if( k.switched[d] )
+        ++k.decorated[d];
+    }
+  }
+}
+
+//chunks are scanned in parallel, then what they miss is loaded in one serial step,
+//then they are laid out in parallel into their own slice of the output
+//returns false if the text should be laid out serially after all
+bool font::layout_parallel( const uint32_t* txt, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float vert_advance, float f, font_sink& out, font_markup& mk, const float* spacing, mm::vec2& lastpos )
+{
+  library& l = library::get();
+  font_inst::face* fc = font_ptr.the_face;
+
+  if( !fc->find_glyph( wchar_t(-1) ) )
+    return false;
+
+  //cut at the first newline after every FONT_PARALLEL_CHUNK codepoints, the newline starts the next chunk
+  size_t n = 0;
+
+  for( size_t begin = 0; begin < size; ++n )
+  {
+    size_t end = std::min( begin + FONT_PARALLEL_CHUNK, size );
+
+    while( end < size && txt[end] != L'\n' )
+      ++end;
+
+    if( chunks.size() <= n )
+      chunks.resize( n + 1 );
+
+    chunks[n].begin = begin;
+    chunks[n].end = end;
+    begin = end;
+  }
+
+  if( n < 2 )
+    return false;
+
+  //workers pull chunks off a shared cursor, so a thread that got short lines takes more of them
+  unsigned int threads = ( unsigned int )std::min( ( size_t )layout_threads, n );
+  std::atomic<size_t> next( 0 );
+
+  l.run_on_threads( threads, [&]()
+  {
+    for( size_t c; ( c = next++ ) < n; )
+      scan_chunk( txt, chunks[c], font_ptr );
+  } );
+
+  unsigned int generation = l.generation;
+
+  for( size_t c = 0; c < n; ++c )
+  {
+    for( auto g : chunks[c].missing_glyphs )
+      add_glyph( font_ptr, g );
+
+    for( auto& p : chunks[c].missing_kerning )
+      fc->kerning( p.first, p.second );
+  }
+
+  //the atlas was emptied midway or a glyph didn't load, the counts are off
+  if( generation != l.generation || !fc->find_glyph( wchar_t(-1) ) )
+    return false;
+
+  for( size_t c = 0; c < n; ++c )
+  {
+    for( auto g : chunks[c].missing_glyphs )
+    {
+      if( !fc->find_glyph( g ) )
+        return false;
+    }
+  }
+
+  //each chunk's first line, first instance and markup state
+  font_markup m = mk;
+  size_t lines = 0, instances = 0;
 
-    if( val != wchar_t(-1) )
+  for( size_t c = 0; c < n; ++c )
+  {
+    font_chunk& k = chunks[c];
+    bool* state[4] = { &m.underline, &m.overline, &m.strikethrough, &m.highlight };
+
+    k.start = m;
+    k.first_line = lines;
+    k.first_instance = instances;
+
+    instances += k.glyphs;
+
+    for( int d = 0; d < 4; ++d )
     {
-      error = FT_Load_Char( ( FT_Face )the_face, ( const FT_UInt )val, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT );
+      instances += k.decorated[d] + ( *state[d] ? k.inherited[d] : 0 );
 
-      if( error )
+      if( k.switched[d] >= 0 )
+        *state[d] = k.switched[d] != 0;
+    }
+
+    lines += k.lines;
+  }
+
+  font_instance* base = 0;
+  size_t capacity = 0;
+
+  if( out.list )
+  {
+    size_t first = out.list->size();
+    out.list->resize( first + instances );
+    base = instances ? &( *out.list )[first] : 0;
+    capacity = instances;
+  }
+  else if( out.count < out.capacity )
+  {
+    base = out.data + out.count;
+    capacity = out.capacity - out.count;
+  }
+
+  next = 0;
+
+  l.run_on_threads( threads, [&]()
+  {
+    for( size_t c; ( c = next++ ) < n; )
+    {
+      font_chunk& k = chunks[c];
+      size_t count = ( c + 1 < n ? chunks[c + 1].first_instance : instances ) - k.first_instance;
+      size_t room = k.first_instance < capacity ? std::min( count, capacity - k.first_instance ) : 0;
+
+      font_sink s( room ? base + k.first_instance : 0, room );
+      s.layer = out.layer;
+
+      font_markup km = k.start;
+      mm::vec2 p = layout_range( txt, k.begin, k.end, size, ( int )k.first_line, km, font_ptr, color, mat, highlight_color, vert_advance, f, false, s, spacing );
+
+      if( c == n - 1 )
+        lastpos = p;
+    }
+  } );
+
+  mk = m;
+  out.count += instances;
+
+  return true;
+}
+
+//what a producer thread keeps between queue_text calls
+struct font_producer
+{
+  unsigned int id; //0 until the first call
+  unsigned int frame;
+  font_queue_chunk* first; //this frame's chunks, not published yet
+  font_queue_chunk* last;
+  font_markup markup;
+  std::vector<uint32_t> codepoints;
+  std::vector<font_instance> scratch;
+  font_chunk scan;
+
+  font_producer() : id( 0 ), frame( 0 ), first( 0 ), last( 0 ) {}
+};
+
+static thread_local font_producer producer;
+
+//any thread: takes a free chunk from the pool, waits for one at most queue_wait_us
+font_queue_chunk* font::claim_chunk()
+{
+  bool waited = false;
+  std::chrono::steady_clock::time_point start;
+
+  for( ;; )
+  {
+    for( int c = 0; c < FONT_QUEUE_CHUNKS; ++c )
+    {
+      bool expected = false;
+
+      if( !queue_used[c].load( std::memory_order_relaxed ) && queue_used[c].compare_exchange_strong( expected, true, std::memory_order_acquire ) )
       {
-        std::cerr << "Error loading character: " << ( wchar_t )val << std::endl;
+        //an unused slot is only touched by whoever claimed it
+        if( !queue_pool[c] )
+        {
+          font_queue_chunk* k = new font_queue_chunk;
+          k->slot = c;
+          k->instances.reserve( FONT_QUEUE_INSTANCES );
+          k->codepoints.reserve( FONT_QUEUE_CODEPOINTS );
+          k->records.reserve( FONT_QUEUE_RECORDS );
+          queue_pool[c] = k;
+        }
+
+        queue_pool[c]->next = 0;
+        return queue_pool[c];
       }
+    }
 
-      theglyph = ( ( FT_Face )the_face )->glyph;
+    if( !queue_wait_us )
+      return 0;
+
+    if( !waited )
+    {
+      waited = true;
+      ++queue_waits;
+      start = std::chrono::steady_clock::now();
     }
-    else
+    else if( std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count() > queue_wait_us )
     {
-      theglyph = new FT_GlyphSlotRec_();
-      theglyph->advance.x = 0;
-      theglyph->advance.y = 0;
-      static unsigned char data[4*4*3] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-                                          -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-                                          -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-                                          -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
-      theglyph->bitmap.buffer = data;
-      theglyph->bitmap.rows = 4;
-      theglyph->bitmap.width = 4;
-      theglyph->bitmap_left = 0;
-      theglyph->bitmap_top = 0;
+      return 0;
     }
 
-    auto texsize = library::get().get_texsize();
-    auto& texpen = library::get().get_texture_pen();
-    auto& texrowh = library::get().get_tex_row_h();
+    std::this_thread::yield();
+  }
+}
+
+//render thread
+void font::release_chunk( font_queue_chunk* c )
+{
+  c->instances.clear();
+  c->codepoints.clear();
+  c->records.clear();
+  queue_used[c->slot].store( false, std::memory_order_release );
+}
+
+bool font::queue_text( const font_text& text, font_inst& font_ptr, unsigned int layer, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  font_producer& p = producer;
+  library& l = library::get();
+
+  if( !p.id )
+    p.id = ++queue_producer_ids;
+
+  size_t size = decode( &text, 1, p.codepoints );
+
+  font_queue_record r;
+  r.font = &font_ptr;
+  r.layer = layer;
+  r.length = size;
+  r.color = color;
+  r.highlight_color = highlight_color;
+  r.mat = mat;
+  r.line_height = line_height;
+  r.filter = f;
+  r.markup = p.markup;
+
+  //lay out from the caches if everything is in them, the gl thread only changes them under the write lock
+  font_chunk& k = p.scan;
+  k.begin = 0;
+  k.end = size;
+  p.scratch.clear();
+
+  l.cache_lock.lock_shared();
+
+  font_inst::face* fc = font_ptr.the_face;
+  scan_chunk( &p.codepoints[0], k, font_ptr );
+  bool ready = k.missing_glyphs.empty() && k.missing_kerning.empty() && fc->find_glyph( wchar_t(-1) );
+  r.releases = l.releases;
+
+  if( ready )
+  {
+    float vert_advance = ( fc->height() - fc->linegap() ) * line_height;
+    font_markup m = p.markup;
+    font_sink out( p.scratch, ( float )layer );
+    layout_range( &p.codepoints[0], 0, size, size, 0, m, font_ptr, color, mat, highlight_color, vert_advance, f, false, out );
+  }
+
+  l.cache_lock.unlock_shared();
+
+  //the markup goes on as if the text was drawn, even if it gets dropped
+  bool* state[4] = { &p.markup.underline, &p.markup.overline, &p.markup.strikethrough, &p.markup.highlight };
+
+  for( int d = 0; d < 4; ++d )
+  {
+    if( k.switched[d] >= 0 )
+      *state[d] = k.switched[d] != 0;
+  }
+
+  //+1 for the terminating 0 layout looks ahead to
+  if( size + 1 > FONT_QUEUE_CODEPOINTS || p.scratch.size() > FONT_QUEUE_INSTANCES )
+  {
+    ++queue_dropped;
+    return false;
+  }
+
+  font_queue_chunk* c = p.last;
+
+  if( !c || c->codepoints.size() + size + 1 > FONT_QUEUE_CODEPOINTS || c->instances.size() + p.scratch.size() > FONT_QUEUE_INSTANCES || c->records.size() == FONT_QUEUE_RECORDS )
+  {
+    c = claim_chunk();
 
-    if( texsize.x == 0 || texsize.y == 0 )
+    if( !c )
     {
-      library::get().expand_tex();
+      ++queue_dropped;
+      return false;
     }
 
-    FT_Bitmap* bitmap = &theglyph->bitmap;
+    c->producer = p.id;
+    c->frame = p.frame;
+
+    if( p.last )
+      p.last->next = c;
+    else
+      p.first = c;
+
+    p.last = c;
+  }
+
+  r.first_codepoint = c->codepoints.size();
+  c->codepoints.insert( c->codepoints.end(), p.codepoints.begin(), p.codepoints.begin() + size + 1 );
+
+  r.first_instance = c->instances.size();
+  r.count = ready ? p.scratch.size() : FONT_QUEUE_DEFERRED;
+  c->instances.insert( c->instances.end(), p.scratch.begin(), p.scratch.end() );
+
+  c->records.push_back( r );
+
+  if( !ready )
+    ++queue_deferred;
+
+  return ready;
+}
+
+void font::publish_queue()
+{
+  font_producer& p = producer;
+
+  if( !p.id )
+    p.id = ++queue_producer_ids;
 
-    if( texpen.x + bitmap->width + 1 > ( int )texsize.x )
+  //an empty frame still has to replace the previous one
+  if( !p.first )
+  {
+    font_queue_chunk* c = claim_chunk();
+
+    if( !c )
     {
-      texpen.y += texrowh + 1;
-      texpen.x = 1;
-      texrowh = 0;
+      ++queue_dropped;
+      return;
+    }
+
+    c->producer = p.id;
+    c->frame = p.frame;
+    p.first = p.last = c;
+  }
+
+  //the whole frame goes in with one exchange, so its chunks stay together and in order
+  font_queue_chunk* head = queue_head.load( std::memory_order_relaxed );
+
+  do
+  {
+    p.last->next = head;
+  }
+  while( !queue_head.compare_exchange_weak( head, p.first, std::memory_order_release, std::memory_order_relaxed ) );
+
+  p.first = p.last = 0;
+  ++p.frame;
+}
+
+void font::drain_queue()
+{
+  library& l = library::get();
+
+  //newest frames first, older frames of the same producer are superseded
+  for( font_queue_chunk* c = queue_head.exchange( 0, std::memory_order_acquire ); c; )
+  {
+    font_queue_chunk* next = c->next;
+    font_queue_frame& f = queue_frames[c->producer];
+
+    if( f.chunks.empty() || c->frame > f.frame )
+    {
+      for( auto k : f.chunks )
+        release_chunk( k );
+
+      f.chunks.clear();
+      f.frame = c->frame;
     }
 
-    if( texpen.y + bitmap->rows + 1 > ( int )texsize.y )
+    if( c->frame == f.frame )
+      f.chunks.push_back( c );
+    else
+      release_chunk( c );
+
+    c = next;
+  }
+
+  //the latest frame of every producer is drawn again until a newer one arrives
+  for( auto& f : queue_frames )
+  {
+    for( auto c : f.second.chunks )
     {
-      if( !library::get().expand_tex() )
+      for( auto& r : c->records )
       {
-        //tex expansion unsuccessful
-        return false;
+        if( r.layer >= layers.size() )
+          continue;
+
+        font_layer& y = layers[r.layer];
+        size_t begin = y.list.size();
+
+        //not laid out, or some glyph was released since and its cell may hold another one now
+        if( r.count == FONT_QUEUE_DEFERRED || r.releases != l.releases )
+        {
+          font_markup m = r.markup;
+          font_sink out( y.list, ( float )r.layer );
+          layout( &c->codepoints[r.first_codepoint], r.length, *r.font, r.color, r.mat, r.highlight_color, r.line_height, r.filter, out, &m );
+        }
+        else
+        {
+          font_inst::face* fc = r.font->the_face;
+
+          if( fc->file )
+            fc->file->sizes[fc->get_size()].last_used = l.get_frame();
+
+          y.list.insert( y.list.end(), c->instances.begin() + r.first_instance, c->instances.begin() + r.first_instance + r.count );
+        }
+
+        submit( r.layer, begin );
       }
     }
+  }
+}
 
-    GLubyte* data;
-    int glyph_size = bitmap->width * bitmap->rows;
-    data = new GLubyte[glyph_size];
+//in 1/64 pixels, the same sum layout() makes: advances and the kerning inside the word
+int font::word_width( const uint32_t* word, size_t size, font_inst& font_ptr )
+{
+  library& l = library::get();
+  font_inst::face* fc = font_ptr.the_face;
+  unsigned int s = fc->get_size();
+
+  unsigned long long key = hash_bytes( &fc->file, sizeof( fc->file ) );
+  key = hash_bytes( &s, sizeof( s ), key );
+  key = hash_bytes( word, size * sizeof( uint32_t ), key );
+
+  auto it = l.word_widths.find( key );
+
+  if( it != l.word_widths.end() )
+    return it->second;
+
+  int width = 0;
+
+  for( size_t c = 0; c < size; ++c )
+  {
+    if( is_special( word[c] ) )
+      continue;
+
+    add_glyph( font_ptr, word[c] );
+
+    if( c > 0 )
+      width += ( int )std::floor( fc->kerning( word[c - 1], word[c] ) * 64.0f + 0.5f );
+
+    const glyph* g = fc->find_glyph( word[c] );
+    width += g ? ( int )g->advance.x : 0;
+  }
+
+  if( l.word_widths.size() >= FONT_WORD_CACHE )
+    l.word_widths.clear();
+
+  l.word_widths[key] = width;
+  return width;
+}
+
+//copies txt to wrap_text with the line breaks put in, the extra spacing of justified lines goes to wrap_spacing
+//greedy fitting: spaces at the end of a line hang past the edge, the space before the word that didn't fit becomes the break
+size_t font::wrap( const uint32_t* txt, size_t size, font_inst& font_ptr, float max_width, int flags )
+{
+  font_inst::face* fc = font_ptr.the_face;
+  int max = ( int )std::floor( max_width * 64.0f );
 
-    int c = 0;
+  wrap_text.clear();
+  wrap_spacing.clear();
 
-    for( int y = 0; y < bitmap->rows; y++ )
+  auto kern = [&]( uint32_t next ) -> int
+  {
+    if( wrap_text.empty() || is_special( next ) )
+      return 0;
+
+    return ( int )std::floor( fc->kerning( wrap_text.back(), next ) * 64.0f + 0.5f );
+  };
+
+  auto advance = [&]( uint32_t c ) -> int
+  {
+    if( is_special( c ) )
+      return 0;
+
+    add_glyph( font_ptr, c );
+    const glyph* g = fc->find_glyph( c );
+    return g ? ( int )g->advance.x : 0;
+  };
+
+  auto push = [&]( uint32_t c )
+  {
+    wrap_text.push_back( c );
+    wrap_spacing.push_back( 0 );
+  };
+
+  int x = 0; //pen on the current line
+  int content = 0; //pen after its last word
+  size_t line_start = 0, content_end = 0; //in wrap_text
+  size_t spaces = 0, content_spaces = 0; //spaces on the line, and before its last word
+  bool has_word = false;
+
+  auto new_line = [&]( bool stretch )
+  {
+    if( stretch && ( flags & FONT_WRAP_JUSTIFY ) && content_spaces > 0 && content < max )
     {
-      for( int x = 0; x < bitmap->width; x++ )
+      float gap = ( max - content ) / ( 64.0f * content_spaces );
+
+      for( size_t c = line_start; c < content_end; ++c )
       {
-        data[x + ( bitmap->rows - 1 - y ) * bitmap->width] = bitmap->buffer[c++];
+        if( wrap_text[c] == L' ' )
+          wrap_spacing[c] = gap;
       }
     }
 
-    GLint uplast;
-    glGetIntegerv( GL_UNPACK_ALIGNMENT, &uplast );
+    line_start = wrap_text.size();
+    content_end = line_start;
+    x = content = 0;
+    spaces = content_spaces = 0;
+    has_word = false;
+  };
+
+  for( size_t c = 0; c < size; )
+  {
+    uint32_t ch = txt[c];
 
-    if( uplast != 1 )
+    if( ch == L'\n' )
     {
-      glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+      push( ch );
+      new_line( false );
+      ++c;
+      continue;
     }
 
-    glBindTexture( GL_TEXTURE_RECTANGLE, library::get().get_tex() );
-    glTexSubImage2D( GL_TEXTURE_RECTANGLE, 0, texpen.x, texpen.y, bitmap->width, bitmap->rows, GL_RED, GL_UNSIGNED_BYTE, data );
+    if( ch == L' ' )
+    {
+      x += kern( ch ) + advance( ch );
+      push( ch );
+      ++spaces;
+      ++c;
+      continue;
+    }
 
-    delete [] data;
+    //a word runs to the next space or newline, or just past a hyphen
+    size_t e = c;
 
-    if( uplast != 1 )
+    while( e < size && txt[e] != L' ' && txt[e] != L'\n' )
     {
-      glPixelStorei( GL_UNPACK_ALIGNMENT, uplast );
+      if( txt[e++] == L'-' )
+        break;
     }
 
-    glyph* g = &( *glyphs )[size][val];
+    int w = word_width( txt + c, e - c, font_ptr );
 
-    g->glyphid = FT_Get_Char_Index( ( FT_Face )the_face, ( const FT_ULong )val );
-    
-    g->offset_x = ( float )theglyph->bitmap_left;
-    g->offset_y = ( float )theglyph->bitmap_top;
-    g->w = ( float )bitmap->width;
-    g->h = ( float )bitmap->rows;
+    if( has_word && x + kern( ch ) + w > max )
+    {
+      if( wrap_text.back() == L' ' )
+      {
+        wrap_text.back() = L'\n';
+        new_line( true );
+      }
+      else
+      {
+        //right after a hyphen
+        new_line( true );
+        push( L'\n' );
+        line_start = content_end = wrap_text.size();
+      }
+    }
 
-    if( val != wchar_t(-1) )
+    if( !has_word && x + kern( ch ) + w > max )
     {
-      g->texcoords[0] = ( float )texpen.x - 0.5f;
-      g->texcoords[1] = ( float )texpen.y - 0.5f;
-      g->texcoords[2] = ( float )texpen.x + ( float )bitmap->width + 0.5f;
-      g->texcoords[3] = ( float )texpen.y + ( float )bitmap->rows + 0.5f;
+      //too long for a line of its own, cut it where it overflows, at least one codepoint per line
+      for( size_t i = c; i < e; ++i )
+      {
+        int step = kern( txt[i] ) + advance( txt[i] );
+
+        if( x + step > max && has_word )
+        {
+          push( L'\n' );
+          new_line( false );
+          step = kern( txt[i] ) + advance( txt[i] );
+        }
+
+        x += step;
+        push( txt[i] );
+        has_word = true;
+      }
     }
     else
     {
-      g->texcoords[0] = ( float )texpen.x;
-      g->texcoords[1] = ( float )texpen.y;
-      g->texcoords[2] = ( float )texpen.x + ( float )bitmap->width;
-      g->texcoords[3] = ( float )texpen.y + ( float )bitmap->rows;
-    }
+      x += kern( ch ) + w;
 
-    texpen.x += bitmap->width + 1;
+      for( size_t i = c; i < e; ++i )
+        push( txt[i] );
 
-    if( bitmap->rows > texrowh )
-    {
-      texrowh = bitmap->rows;
+      has_word = true;
     }
 
-    g->advance = theglyph->advance;
+    content = x;
+    content_end = wrap_text.size();
+    content_spaces = spaces;
+    c = e;
   }
-  
+
+  //layout looks ahead to a terminating 0
+  size_t wrapped = wrap_text.size();
+  push( 0 );
+
+  return wrapped;
+}
+
+mm::vec2 font::add_wrapped( const font_text* segments, size_t count, font_inst& font_ptr, float max_width, int flags, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  size_t size = decode( segments, count );
+  size = wrap( &codepoints[0], size, font_ptr, max_width, flags );
+
+  size_t begin = layers[current_layer].list.size();
+  font_sink out( layers[current_layer].list, ( float )current_layer );
+  mm::vec2 p = layout( &wrap_text[0], size, font_ptr, color, mat, highlight_color, line_height, f, out, 0, ( flags & FONT_WRAP_JUSTIFY ) ? &wrap_spacing[0] : 0 );
+  submit( current_layer, begin );
+  return p;
+}
+
+mm::vec2 font::add_wrapped( const font_text& text, font_inst& font_ptr, float max_width, int flags, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+{
+  return add_wrapped( &text, 1, font_ptr, max_width, flags, color, mat, highlight_color, line_height, f );
+}
+
+font_document::font_document() : data( 0 ), size( 0 ), handle( 0 ), stop( false ), lines( 0 ), tail( 0 ), scanned( 0 ), file_size( 0 ),
+  follow( false ), first( 0 ), window_first( 0 ), window_lines( 0 ), window_scanned( 0 )
+{
+}
+
+font_document::~font_document()
+{
+  close();
+}
+
+bool font_document::open( const std::string& fn )
+{
+  close();
+
+  std::ifstream f( fn.c_str() );
+
+  if( !f.is_open() )
+  {
+    std::cerr << "Couldn't open file: " << fn << std::endl;
+    return false;
+  }
+
+  filename = fn;
+  index.assign( 1, 0 );
+  stop = false;
+  indexer = std::thread( &font_document::run_indexer, this );
   return true;
 }
 
-float font_inst::face::kerning( const uint32_t prev, const uint32_t next )
+void font_document::close()
 {
-  if( the_face )
+  if( indexer.joinable() )
   {
-    if( next && FT_HAS_KERNING( ( ( FT_Face )the_face ) ) )
+    stop = true;
+    indexer.join();
+  }
+
+  unmap_file( ( void* )data, size, handle );
+  data = 0;
+  size = 0;
+  handle = 0;
+  index.clear();
+  lines = tail = scanned = file_size = 0;
+  first = 0;
+  text.clear();
+  starts.clear();
+  window_first = window_lines = window_scanned = 0;
+}
+
+//maps the file on its own, scans it a slice at a time and publishes each
+//once it caught up it maps the file again every FONT_DOCUMENT_POLL_MS to see if it grew
+void font_document::run_indexer()
+{
+  const char* map = 0;
+  size_t map_size = 0;
+  void* map_handle = 0;
+  size_t pos = 0, count = 0, line_start = 0;
+  std::vector<size_t> found;
+
+  while( !stop.load() )
+  {
+    if( pos == map_size )
     {
-      FT_Vector kern;
-      FT_Get_Kerning( ( FT_Face )the_face, prev, next, FT_KERNING_UNFITTED, &kern );
-      return ( kern.x / (64.0f*64.0f) );
+      size_t s;
+      void* h;
+      const char* m = ( const char* )map_file( filename, s, h );
+
+      if( !m || s <= map_size )
+      {
+        unmap_file( ( void* )m, s, h );
+        std::this_thread::sleep_for( std::chrono::milliseconds( FONT_DOCUMENT_POLL_MS ) );
+        continue;
+      }
+
+      unmap_file( ( void* )map, map_size, map_handle );
+      map = m;
+      map_size = s;
+      map_handle = h;
     }
-    else
+
+    size_t end = std::min( map_size, pos + FONT_DOCUMENT_SLICE );
+
+    while( pos < end )
     {
-      return 0;
+      const char* nl = ( const char* )memchr( map + pos, '\n', end - pos );
+
+      if( !nl )
+      {
+        pos = end;
+        break;
+      }
+
+      pos = nl - map + 1;
+      line_start = pos;
+
+      if( ++count % FONT_DOCUMENT_STRIDE == 0 )
+        found.push_back( pos );
     }
+
+    index_lock.lock();
+    index.insert( index.end(), found.begin(), found.end() );
+    lines = count;
+    tail = line_start;
+    scanned = pos;
+    file_size = map_size;
+    index_lock.unlock();
+
+    found.clear();
   }
-  else
+
+  unmap_file( ( void* )map, map_size, map_handle );
+}
+
+size_t font_document::count_lines()
+{
+  //the unterminated last line only counts once the indexer got to the end of the file
+  return lines + ( scanned == file_size && scanned > tail ? 1 : 0 );
+}
+
+size_t font_document::get_line_count()
+{
+  index_lock.lock_shared();
+  size_t count = count_lines();
+  index_lock.unlock_shared();
+  return count;
+}
+
+bool font_document::is_indexed()
+{
+  index_lock.lock_shared();
+  bool done = scanned == file_size;
+  index_lock.unlock_shared();
+  return done;
+}
+
+//byte range of a line without its newline, the mapping has to cover the scanned bytes
+bool font_document::find_line( size_t line, size_t& begin, size_t& end )
+{
+  if( line >= count_lines() )
+    return false;
+
+  if( line == lines )
+  {
+    begin = tail;
+    end = scanned;
+    return true;
+  }
+
+  begin = index[line / FONT_DOCUMENT_STRIDE];
+
+  for( size_t c = line % FONT_DOCUMENT_STRIDE; c > 0; --c )
+    begin = ( const char* )memchr( data + begin, '\n', scanned - begin ) - data + 1;
+
+  end = ( const char* )memchr( data + begin, '\n', scanned - begin ) - data;
+  return true;
+}
+
+void font_document::decode_window( size_t b, size_t e )
+{
+  text.clear();
+  starts.clear();
+
+  for( size_t l = b; l < e; ++l )
   {
-    return 0;
+    size_t begin = 0, end = 0;
+    find_line( l, begin, end );
+
+    if( end > begin && data[end - 1] == '\r' )
+      --end;
+
+    //enough bytes for FONT_DOCUMENT_MAX_LINE codepoints of any length
+    end = std::min( end, begin + FONT_DOCUMENT_MAX_LINE * 4 );
+
+    size_t at = text.size();
+    starts.push_back( at );
+    text.resize( at + end - begin + 1 );
+    size_t n = decode_utf8( ( const unsigned char* )data + begin, end - begin, &text[at] );
+    text.resize( at + std::min( n, ( size_t )FONT_DOCUMENT_MAX_LINE ) );
+    text.push_back( L'\n' );
   }
+
+  starts.push_back( text.size() );
+  text.push_back( 0 );
+
+  window_first = b;
+  window_lines = e - b;
+  window_scanned = e > lines ? scanned : 0;
 }
 
-float font_inst::face::advance( const uint32_t current )
+mm::vec2 font::add_document( font_document& doc, font_inst& font_ptr, size_t visible_lines, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
 {
-  return ( ( *glyphs )[size][current].advance.x / 64.0f );
+  doc.index_lock.lock_shared();
+
+  size_t count = doc.count_lines();
+  size_t max_first = count > visible_lines ? count - visible_lines : 0;
+  doc.first = doc.follow ? max_first : std::min( doc.first, max_first );
+  size_t last = std::min( doc.first + visible_lines, count );
+
+  //decode again only if the view left the window, or the window's unterminated last line grew
+  if( doc.text.empty() || doc.first < doc.window_first || last > doc.window_first + doc.window_lines ||
+      ( doc.window_scanned && doc.window_scanned != doc.scanned ) )
+  {
+    if( doc.size < doc.scanned )
+    {
+      unmap_file( ( void* )doc.data, doc.size, doc.handle );
+      doc.data = ( const char* )map_file( doc.filename, doc.size, doc.handle );
+
+      if( !doc.data || doc.size < doc.scanned )
+      {
+        doc.index_lock.unlock_shared();
+        std::cerr << "Couldn't map file: " << doc.filename << std::endl;
+        return mm::vec2( 0 );
+      }
+    }
+
+    size_t b = doc.first > FONT_DOCUMENT_MARGIN ? doc.first - FONT_DOCUMENT_MARGIN : 0;
+    doc.decode_window( b, std::min( last + FONT_DOCUMENT_MARGIN, count ) );
+  }
+
+  doc.index_lock.unlock_shared();
+
+  if( doc.first >= last )
+    return mm::vec2( 0 );
+
+  size_t begin = doc.starts[doc.first - doc.window_first];
+  size_t end = doc.starts[last - doc.window_first] - 1; //without the newline after the last visible line
+
+  size_t list_begin = layers[current_layer].list.size();
+  font_sink out( layers[current_layer].list, ( float )current_layer );
+  font_markup m; //markup codepoints in the file don't carry over between frames
+  mm::vec2 p = layout( &doc.text[begin], end - begin, font_ptr, color, mat, highlight_color, line_height, f, out, &m );
+  submit( current_layer, list_begin );
+  return p;
 }
 
-float font_inst::face::height()
+//glyph run file: header, glyph table (codepoints, padded to an even count), runs sorted by name hash, instances, names
+struct font_run_header
 {
-  return h;
-}
+  char magic[4]; //"FRUN"
+  uint32_t version;
+  unsigned long long font_hash;
+  uint32_t size;
+  float line_height;
+  uint32_t glyph_count, run_count, instance_count, names_size;
+};
 
-float font_inst::face::linegap()
+struct font_run_entry
 {
-  return gap;
-}
+  unsigned long long name_hash;
+  uint32_t name_offset, name_length;
+  uint32_t first, count; //instances
+  float end_x, end_y; //the pen after the run
+};
 
-float font_inst::face::ascender()
+#define FONT_RUN_HIGHLIGHT 1
+
+struct font_run_glyph
 {
-  return asc;
-}
+  float vertscalebias[4]; //y relative to the top of the screen
+  uint32_t glyph; //in the glyph table
+  uint32_t flags;
+};
 
-float font_inst::face::descender()
+static unsigned long long font_file_hash( font_file* f )
 {
-  return desc;
+  if( !f->hash )
+    f->hash = hash_bytes( f->data, f->size );
+
+  return f->hash;
 }
 
-float font_inst::face::underline_position()
+static size_t run_table_size( const font_run_header* h )
 {
-  return upos;
+  return ( h->glyph_count + 1 ) / 2 * 2;
 }
 
-float font_inst::face::underline_thickness()
+font_run_file::font_run_file() : data( 0 ), size( 0 ), handle( 0 ), font( 0 ), generation( 0 ), releases( 0 ), resolved( false )
 {
-  return uthick;
 }
 
-glyph& font_inst::face::get_glyph( uint32_t i )
+font_run_file::~font_run_file()
 {
-  return ( *glyphs )[size][i];
+  close();
 }
 
-bool font_inst::face::has_glyph( uint32_t i )
+bool font_run_file::open( const std::string& filename, font_inst& font_ptr )
 {
-  try
+  close();
+
+  data = ( const char* )map_file( filename, size, handle );
+
+  if( !data )
   {
-    ( *glyphs ).at( size ).at( i );
-    return true;
+    std::cerr << "Couldn't open file: " << filename << std::endl;
+    return false;
+  }
+
+  const font_run_header* h = ( const font_run_header* )data;
+  bool valid = size >= sizeof( font_run_header ) && !memcmp( h->magic, "FRUN", 4 ) && h->version == FONT_RUN_VERSION;
+
+  if( valid )
+  {
+    size_t expected = sizeof( font_run_header ) + run_table_size( h ) * sizeof( uint32_t ) +
+                      h->run_count * sizeof( font_run_entry ) + h->instance_count * sizeof( font_run_glyph ) + h->names_size;
+    valid = size == expected;
+  }
+
+  if( valid )
+  {
+    const font_run_entry* runs = ( const font_run_entry* )( data + sizeof( font_run_header ) + run_table_size( h ) * sizeof( uint32_t ) );
+    const font_run_glyph* glyphs = ( const font_run_glyph* )( runs + h->run_count );
+
+    for( uint32_t c = 0; c < h->run_count && valid; ++c )
+    {
+      valid = runs[c].first <= h->instance_count && runs[c].count <= h->instance_count - runs[c].first &&
+              runs[c].name_offset <= h->names_size && runs[c].name_length <= h->names_size - runs[c].name_offset;
+    }
+
+    for( uint32_t c = 0; c < h->instance_count && valid; ++c )
+      valid = glyphs[c].glyph < h->glyph_count;
+  }
+
+  if( !valid )
+  {
+    std::cerr << "Invalid glyph run file: " << filename << std::endl;
+    close();
+    return false;
   }
-  catch( ... )
+
+  if( !font_ptr.the_face || !font_ptr.the_face->file || h->font_hash != font_file_hash( font_ptr.the_face->file ) )
   {
+    std::cerr << "Glyph runs were baked with another font: " << filename << std::endl;
+    close();
     return false;
   }
+
+  font = &font_ptr;
+  return true;
 }
 
-void font::set_size( font_inst& font_ptr, unsigned int s )
+void font_run_file::close()
 {
-  font_ptr.the_face->set_size( s );
-
-  std::for_each( cachestring.begin(), cachestring.end(),
-                 [&]( wchar_t & c )
-  {
-    add_glyph( font_ptr, c );
-  } );
+  unmap_file( ( void* )data, size, handle );
+  data = 0;
+  size = 0;
+  handle = 0;
+  font = 0;
+  texscalebias.clear();
+  present.clear();
+  resolved = false;
 }
 
-void font::add_glyph( font_inst& font_ptr, uint32_t c, int counter )
+int font_run_file::find( const std::string& name )
 {
-  if( font_ptr.the_face->has_glyph( c ) )
-    return;
+  if( !data )
+    return -1;
+
+  const font_run_header* h = ( const font_run_header* )data;
+  const font_run_entry* runs = ( const font_run_entry* )( data + sizeof( font_run_header ) + run_table_size( h ) * sizeof( uint32_t ) );
+  const char* names = ( const char* )( ( const font_run_glyph* )( runs + h->run_count ) + h->instance_count );
+  unsigned long long key = hash_bytes( name.data(), name.size() );
 
-  if( !font_ptr.the_face->load_glyph( c ) )
+  const font_run_entry* e = std::lower_bound( runs, runs + h->run_count, key, []( const font_run_entry& r, unsigned long long k )
   {
-    if( counter > 9 ) //at max 10 tries
-    {
-      exit( 1 ); //couldn't get enough memory or something... (extreme case) 
-    }
+    return r.name_hash < k;
+  } );
 
-    library::get().delete_glyphs();
-    add_glyph( font_ptr, c, ++counter );
-    return;
+  for( ; e != runs + h->run_count && e->name_hash == key; ++e )
+  {
+    if( e->name_length == name.size() && !memcmp( names + e->name_offset, name.data(), name.size() ) )
+      return ( int )( e - runs );
   }
 
-  auto& g = font_ptr.the_face->get_glyph( c );
-
-  g.cache_index = library::get().get_font_data_size();
-
-  mm::vec2 vertbias = mm::vec2( g.offset_x - 0.5f, -0.5f - ( g.h - g.offset_y ) );
-  mm::vec2 vertscale = mm::vec2( g.offset_x + g.w + 0.5f, 0.5f + g.h - ( g.h - g.offset_y ) ) - vertbias;
+  return -1;
+}
 
-  //texcoords
-  mm::vec2 texbias = mm::vec2( g.texcoords[0], g.texcoords[1] );
-  mm::vec2 texscale = mm::vec2( g.texcoords[2], g.texcoords[3] ) - texbias;
+size_t font_run_file::get_run_count()
+{
+  return data ? ( ( const font_run_header* )data )->run_count : 0;
+}
 
-  library::get().add_font_data( fontscalebias( vertscale, vertbias, texscale, texbias ) );
+unsigned int font_run_file::get_size()
+{
+  return data ? ( ( const font_run_header* )data )->size : 0;
 }
 
-void font::load_font( const std::string& filename, font_inst& font_ptr, unsigned int size )
+bool font::bake_runs( const std::string& filename, const std::string* names, const font_text* texts, size_t count, font_inst& font_ptr, float line_height )
 {
-  std::cout << "-Loading: " << filename << std::endl;
+  font_inst::face* fc = font_ptr.the_face;
 
-  std::fstream f( filename.c_str(), std::ios::in );
+  if( !fc || !fc->file )
+  {
+    std::cerr << "Glyph runs need a loaded font." << std::endl;
+    return false;
+  }
 
-  if( !f )
-    std::cerr << "Couldn't open file: " << filename << std::endl;
+  std::vector<font_instance> instances;
+  std::vector<font_run_entry> runs( count );
+  std::vector<font_run_glyph> glyphs;
+  std::vector<uint32_t> table;
+  std::unordered_map< uint32_t, uint32_t > slots; //codepoint to glyph table index
+  std::vector<uint32_t> instance_codepoints; //layout tells which glyph each instance is
+  std::string blob;
 
-  f.close();
+  for( size_t c = 0; c < count; ++c )
+  {
+    size_t size = decode( &texts[c], 1 );
+    instances.clear();
+    instance_codepoints.clear();
+    font_sink out( instances );
+    out.codepoints = &instance_codepoints;
+    font_markup m;
+
+    //the highlight gets a color the text doesn't have, so it can be told apart
+    mm::vec2 end = layout( &codepoints[0], size, font_ptr, mm::vec4( 1 ), mm::mat4::identity, mm::vec4( 0 ), line_height, 0, out, &m );
+
+    font_run_entry& e = runs[c];
+    e.name_hash = hash_bytes( names[c].data(), names[c].size() );
+    e.name_offset = ( uint32_t )blob.size();
+    e.name_length = ( uint32_t )names[c].size();
+    e.first = ( uint32_t )glyphs.size();
+    e.count = ( uint32_t )instances.size();
+    e.end_x = end.x;
+    e.end_y = end.y;
+    blob += names[c];
+
+    for( size_t k = 0; k < instances.size(); ++k )
+    {
+      const font_instance& i = instances[k];
+      uint32_t cp = instance_codepoints[k];
+      auto s = slots.find( cp );
 
-  library::get().set_up();
-  resize( screensize );
+      if( s == slots.end() )
+      {
+        s = slots.insert( std::make_pair( cp, ( uint32_t )table.size() ) ).first;
+        table.push_back( cp );
+      }
 
-  //load directly from font
-  font_ptr.the_face = new font_inst::face( filename, 0 );
+      font_run_glyph g;
+      g.vertscalebias[0] = i.vertscalebias.x;
+      g.vertscalebias[1] = i.vertscalebias.y;
+      g.vertscalebias[2] = i.vertscalebias.z;
+      g.vertscalebias[3] = i.vertscalebias.w - ( float )screensize.y;
+      g.glyph = s->second;
+      g.flags = i.color.w == 0 ? FONT_RUN_HIGHLIGHT : 0;
+      glyphs.push_back( g );
+    }
+  }
 
-  set_size( font_ptr, size );
+  std::stable_sort( runs.begin(), runs.end(), []( const font_run_entry& a, const font_run_entry& b )
+  {
+    return a.name_hash < b.name_hash;
+  } );
 
-  library::get().instances.push_back( &font_ptr );
-}
+  font_run_header h;
+  memcpy( h.magic, "FRUN", 4 );
+  h.version = FONT_RUN_VERSION;
+  h.font_hash = font_file_hash( fc->file );
+  h.size = fc->get_size();
+  h.line_height = line_height;
+  h.glyph_count = ( uint32_t )table.size();
+  h.run_count = ( uint32_t )runs.size();
+  h.instance_count = ( uint32_t )glyphs.size();
+  h.names_size = ( uint32_t )blob.size();
 
-void font::resize( const mm::uvec2& ss )
-{
-  screensize = ss;
-  font_frame.set_ortographic( 0.0f, ( float )ss.x, 0.0f, ( float )ss.y, 0.0f, 1.0f );
-}
+  table.resize( run_table_size( &h ), 0 );
 
-static std::vector<mm::vec4> vertscalebias;
-static std::vector<mm::vec4> texscalebias;
-static std::vector<mm::vec4> fontcolor;
-static std::vector<mm::mat4> transform;
-static std::vector<float> filter;
+  std::ofstream f( filename.c_str(), std::ios::binary );
 
-//these special unicode characters denote the text markup begin/end
-#define FONT_UNDERLINE_BEGIN L'\uE000'
-#define FONT_UNDERLINE_END L'\uE001'
-#define FONT_OVERLINE_BEGIN L'\uE002'
-#define FONT_OVERLINE_END L'\uE003'
-#define FONT_STRIKETHROUGH_BEGIN L'\uE004'
-#define FONT_STRIKETHROUGH_END L'\uE005'
-#define FONT_HIGHLIGHT_BEGIN L'\uE006'
-#define FONT_HIGHLIGHT_END L'\uE007'
+  if( !f.is_open() )
+  {
+    std::cerr << "Couldn't open file: " << filename << std::endl;
+    return false;
+  }
 
-bool is_special( wchar_t c )
-{
-  return c == FONT_UNDERLINE_BEGIN ||
-         c == FONT_UNDERLINE_END ||
-         c == FONT_OVERLINE_BEGIN ||
-         c == FONT_OVERLINE_END ||
-         c == FONT_STRIKETHROUGH_BEGIN ||
-         c == FONT_STRIKETHROUGH_END ||
-         c == FONT_HIGHLIGHT_BEGIN ||
-         c == FONT_HIGHLIGHT_END;
+  f.write( ( const char* )&h, sizeof( h ) );
+
+  if( !table.empty() )
+    f.write( ( const char* )&table[0], table.size() * sizeof( uint32_t ) );
+
+  if( !runs.empty() )
+    f.write( ( const char* )&runs[0], runs.size() * sizeof( font_run_entry ) );
+
+  if( !glyphs.empty() )
+    f.write( ( const char* )&glyphs[0], glyphs.size() * sizeof( font_run_glyph ) );
+
+  f.write( blob.data(), blob.size() );
+
+  return f.good();
 }
 
-mm::vec2 font::add_to_render_list( const std::wstring& txt, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float f )
+mm::vec2 font::add_run( font_run_file& runs, int run, const mm::vec2& offset, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float f )
 {
-  static bool underline = false;
-  static bool overline = false;
-  static bool strikethrough = false;
-  static bool highlight = false;
+  if( run < 0 || ( size_t )run >= runs.get_run_count() )
+  {
+    std::cerr << "Invalid glyph run: " << run << std::endl;
+    return offset;
+  }
 
-  float yy = 0;
-  float xx = 0;
+  const font_run_header* h = ( const font_run_header* )runs.data;
+  font_inst& font_ptr = *runs.font;
+  font_inst::face* fc = font_ptr.the_face;
 
-  float vert_advance = font_ptr.the_face->height() - font_ptr.the_face->linegap();
-  vert_advance *= line_height;
+  if( fc->get_size() != h->size )
+  {
+    std::cerr << "Glyph runs were baked at size " << h->size << ", the font is at " << fc->get_size() << std::endl;
+    return offset;
+  }
 
-  yy += vert_advance;
+  library& l = library::get();
+  fc->file->sizes[h->size].last_used = l.get_frame();
 
-  for( int c = 0; c < int( txt.size() ); c++ )
+  //atlas coordinates of the glyph table, looked up again once glyphs were dropped or evicted
+  if( !runs.resolved || runs.generation != l.generation || runs.releases != l.releases )
   {
-    char bla = txt[c];
+    const uint32_t* table = ( const uint32_t* )( runs.data + sizeof( font_run_header ) );
+    runs.texscalebias.resize( h->glyph_count );
+    runs.present.resize( h->glyph_count );
 
-    if( txt[c] == L'\n' )
-    {
-      yy += vert_advance;
-      xx = 0;
-    }
+    for( uint32_t c = 0; c < h->glyph_count; ++c )
+      add_glyph( font_ptr, table[c] );
 
-    if( c > 0 && txt[c] != L'\n' && !is_special(txt[c]) )
+    for( uint32_t c = 0; c < h->glyph_count; ++c )
     {
-      xx += font_ptr.the_face->kerning( txt[c - 1], txt[c] );
+      const glyph* g = fc->find_glyph( table[c] );
+      runs.present[c] = g != 0;
+
+      if( g )
+        runs.texscalebias[c] = l.get_font_data( g->cache_index ).texscalebias;
     }
 
-    if( txt[c] == FONT_UNDERLINE_BEGIN )
-      underline = true;
-    else if( txt[c] == FONT_UNDERLINE_END )
-      underline = false;
-    else if( txt[c] == FONT_OVERLINE_BEGIN )
-      overline = true;
-    else if( txt[c] == FONT_OVERLINE_END )
-      overline = false;
-    else if( txt[c] == FONT_STRIKETHROUGH_BEGIN )
-      strikethrough = true;
-    else if( txt[c] == FONT_STRIKETHROUGH_END )
-      strikethrough = false;
-    else if( txt[c] == FONT_HIGHLIGHT_BEGIN )
-      highlight = true;
-    else if( txt[c] == FONT_HIGHLIGHT_END )
-      highlight = false;
+    runs.generation = l.generation;
+    runs.releases = l.releases;
+    runs.resolved = true;
 
-    float finalx = xx;
-    mm::vec3 pos = mm::vec3( finalx, ( float )screensize.y - yy, 0 );
+    //glyph uploads may have touched the texture bindings
+    l.restore_gl_state();
+  }
 
-    float advancex = 0;
-    
-    int i = 0;
-    for( i = c; i < txt.size(); ++i )
-    {
-      if( !is_special( txt[i] ) )
-        break;
-    }
-    advancex = font_ptr.the_face->advance( txt[i] );
+  const font_run_entry& e = ( ( const font_run_entry* )( runs.data + sizeof( font_run_header ) + run_table_size( h ) * sizeof( uint32_t ) ) )[run];
+  const font_run_glyph* g = ( const font_run_glyph* )( ( const font_run_entry* )( runs.data + sizeof( font_run_header ) + run_table_size( h ) * sizeof( uint32_t ) ) + h->run_count ) + e.first;
+  mm::vec2 t( offset.x, ( float )screensize.y - offset.y );
 
-    if( highlight )
-    {
-      unsigned int datapos = font_ptr.the_face->get_glyph( wchar_t(-1) ).cache_index;
-      fontscalebias& fsb = library::get().get_font_data( datapos );
-      fontscalebias copy = fsb;
-      
-      //vert bias
-      copy.vertscalebias.w = font_ptr.the_face->descender();
+  std::vector<font_instance>& list = layers[current_layer].list;
+  size_t begin = list.size();
+  list.reserve( begin + e.count );
 
-      //hori bias
-      copy.vertscalebias.z = 0.0f;
-      
-      //hori scale
-      copy.vertscalebias.x = advancex;
+  for( uint32_t c = 0; c < e.count; ++c )
+  {
+    if( !runs.present[g[c].glyph] )
+      continue;
 
-      //vert scale
-      copy.vertscalebias.y = font_ptr.the_face->height() + font_ptr.the_face->linegap();
+    const float* v = g[c].vertscalebias;
+    list.push_back( font_instance( mm::vec4( v[0], v[1], v[2] + t.x, v[3] + t.y ), runs.texscalebias[g[c].glyph], ( g[c].flags & FONT_RUN_HIGHLIGHT ) ? highlight_color : color, mat, f ) );
+    list.back().layer = ( float )current_layer;
+  }
 
-      vertscalebias.push_back( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ) );
-      texscalebias.push_back( copy.texscalebias );
-      fontcolor.push_back( highlight_color );
-      transform.push_back( mat );
-      filter.push_back( f );
-    }
+  submit( current_layer, begin );
+  return mm::vec2( e.end_x + offset.x, e.end_y + offset.y );
+}
 
-    if( strikethrough )
-    {
-      unsigned int datapos = font_ptr.the_face->get_glyph( wchar_t(-1) ).cache_index;
-      fontscalebias& fsb = library::get().get_font_data( datapos );
-      fontscalebias copy = fsb;
-      
-      //vert bias
-      copy.vertscalebias.w = font_ptr.the_face->ascender() * 0.33f;
+size_t font_hit_index::line_of( size_t c ) const
+{
+  return std::upper_bound( lines.begin(), lines.end(), c ) - lines.begin() - 1;
+}
 
-      //hori bias
-      copy.vertscalebias.z = 0;
-      
-      //hori scale
-      copy.vertscalebias.x = advancex;
+size_t font_hit_index::hit_line( size_t line, float px ) const
+{
+  size_t lo = lines[line];
+  size_t hi = line + 1 < lines.size() ? lines[line + 1] - 1 : x.size() - 1; //its newline, or the end of the text
 
-      //vert scale
-      copy.vertscalebias.y = font_ptr.the_face->underline_thickness();
+  //the first codepoint whose middle is right of the point
+  while( lo < hi )
+  {
+    size_t mid = lo + ( hi - lo ) / 2;
 
-      vertscalebias.push_back( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ) );
-      texscalebias.push_back( copy.texscalebias );
-      fontcolor.push_back( color );
-      transform.push_back( mat );
-      filter.push_back( f );
-    }
+    if( ( x[mid] + x[mid + 1] ) * 0.5f > px )
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
 
-    if( underline )
-    {
-      unsigned int datapos = font_ptr.the_face->get_glyph( wchar_t(-1) ).cache_index;
-      fontscalebias& fsb = library::get().get_font_data( datapos );
-      fontscalebias copy = fsb;
-      
-      //vert bias
-      copy.vertscalebias.w = font_ptr.the_face->underline_position();
+  return lo;
+}
 
-      //hori bias
-      copy.vertscalebias.z = 0.0f;
-      
-      //hori scale
-      copy.vertscalebias.x = advancex;
+size_t font_hit_index::hit_test( const mm::vec2& p ) const
+{
+  if( lines.empty() )
+    return 0;
 
-      //vert scale
-      copy.vertscalebias.y = font_ptr.the_face->underline_thickness();
+  float l = line_advance > 0 ? std::floor( p.y / line_advance ) : 0;
+  return hit_line( l < 0 ? 0 : l >= lines.size() ? lines.size() - 1 : ( size_t )l, p.x );
+}
 
-      vertscalebias.push_back( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ) );
-      texscalebias.push_back( copy.texscalebias );
-      fontcolor.push_back( color );
-      transform.push_back( mat );
-      filter.push_back( f );
-    }
+mm::vec2 font_hit_index::caret( size_t c ) const
+{
+  if( x.empty() )
+    return mm::vec2( 0 );
 
-    if( overline )
-    {
-      unsigned int datapos = font_ptr.the_face->get_glyph( wchar_t(-1) ).cache_index;
-      fontscalebias& fsb = library::get().get_font_data( datapos );
-      fontscalebias copy = fsb;
-      
-      //vert bias
-      copy.vertscalebias.w = font_ptr.the_face->ascender();
+  c = std::min( c, x.size() - 1 );
+  return mm::vec2( x[c], line_of( c ) * line_advance );
+}
 
-      //hori bias
-      copy.vertscalebias.z = 0.0f;
-      
-      //hori scale
-      copy.vertscalebias.x = advancex;
+void font_hit_index::select( const mm::vec2& a, const mm::vec2& b, std::vector< std::pair< size_t, size_t > >& ranges ) const
+{
+  ranges.clear();
 
-      //vert scale
-      copy.vertscalebias.y = font_ptr.the_face->underline_thickness();
+  if( lines.empty() || line_advance <= 0 )
+    return;
 
-      vertscalebias.push_back( mm::vec4( copy.vertscalebias.xy, copy.vertscalebias.zw + pos.xy ) );
-      texscalebias.push_back( copy.texscalebias );
-      fontcolor.push_back( color );
-      transform.push_back( mat );
-      filter.push_back( f );
-    }
+  float top = std::floor( std::min( a.y, b.y ) / line_advance );
+  float bottom = std::floor( std::max( a.y, b.y ) / line_advance );
+  float left = std::min( a.x, b.x ), right = std::max( a.x, b.x );
 
-    if( c < txt.size() && txt[c] != L' ' && txt[c] != L'\n' && !is_special(txt[c]) )
-    {
-      add_glyph( font_ptr, txt[c] );
+  if( bottom < 0 || top >= lines.size() )
+    return;
 
-      unsigned int datapos = font_ptr.the_face->get_glyph( txt[c] ).cache_index;
-      auto thefsb = library::get().get_font_data( datapos );
-      vertscalebias.push_back( mm::vec4( thefsb.vertscalebias.xy, thefsb.vertscalebias.zw + pos.xy ) );
-      texscalebias.push_back( thefsb.texscalebias );
-      fontcolor.push_back( color );
-      transform.push_back( mat );
-      filter.push_back( f );
-    }
+  size_t first = top < 0 ? 0 : ( size_t )top;
+  size_t last = bottom >= lines.size() ? lines.size() - 1 : ( size_t )bottom;
 
-    if( !is_special(txt[c]) )
-      xx += font_ptr.the_face->advance( txt[c] );
-  }
+  for( size_t l = first; l <= last; ++l )
+    ranges.push_back( std::make_pair( hit_line( l, left ), hit_line( l, right ) ) );
+}
 
-  yy -= vert_advance;
+void font::build_hit_index( const font_text& text, font_inst& font_ptr, font_hit_index& index, float line_height )
+{
+  index.lines.assign( 1, 0 );
+  index.x.assign( 1, 0 );
+  index.line_advance = ( font_ptr.the_face->height() - font_ptr.the_face->linegap() ) * line_height * font_ptr.zoom_scale;
 
-  return mm::vec2( xx, yy );
+  //an index of one empty line, updated to the whole text
+  update_hit_index( text, font_ptr, index, 0, 1 );
 }
 
-void font::render()
+void font::update_hit_index( const font_text& text, font_inst& font_ptr, font_hit_index& index, size_t first_line, size_t old_lines )
 {
-  glDisable( GL_CULL_FACE );
-  glDisable( GL_DEPTH_TEST );
-  glEnable( GL_BLEND );
-  glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+  if( first_line >= index.lines.size() )
+  {
+    std::cerr << "Invalid hit index line: " << first_line << std::endl;
+    return;
+  }
 
-  library::get().bind_shader();
+  size_t size = decode( &text, 1 );
+  const uint32_t* txt = &codepoints[0];
 
-  //mvp is now only the projection matrix
-  mm::mat4 mat = font_frame.projection_matrix;
-  glUniformMatrix4fv( 0, 1, false, &mat[0].x );
+  size_t old_size = index.x.size() - 1;
+  size_t last = first_line + std::max( old_lines, ( size_t )1 );
+  bool to_end = last >= index.lines.size();
+  size_t a = index.lines[first_line];
+  size_t old_end = to_end ? old_size : index.lines[last] - 1; //the newline after the replaced lines
+  long long delta = ( long long )size - ( long long )old_size;
+  long long end = ( long long )old_end + delta;
 
-  glActiveTexture( GL_TEXTURE0 );
-  library::get().bind_texture();
+  //the newline after the replaced lines has to be kept by the edit, otherwise everything is laid out again
+  if( ( long long )a > end || ( !to_end && txt[end] != L'\n' ) )
+  {
+    first_line = 0;
+    last = index.lines.size();
+    to_end = true;
+    a = 0;
+    old_end = old_size;
+    end = size;
+  }
 
-  library::get().bind_vao();
+  //carets [a, end] are redone, the ones after it only move
+  if( delta > 0 )
+    index.x.insert( index.x.begin() + old_end + 1, ( size_t )delta, 0.0f );
+  else if( delta < 0 )
+    index.x.erase( index.x.begin() + ( old_end + 1 + delta ), index.x.begin() + old_end + 1 );
 
-  library::get().update_scalebiascolor( FONT_VERTSCALEBIAS, vertscalebias );
-  library::get().update_scalebiascolor( FONT_TEXSCALEBIAS, texscalebias );
-  library::get().update_scalebiascolor( FONT_COLOR, fontcolor );
-  library::get().update_scalebiascolor( FONT_TRANSFORM, transform );
-  library::get().update_scalebiascolor( FONT_FILTER, filter );
+  for( size_t c = last; c < index.lines.size(); ++c )
+    index.lines[c] += delta;
 
-  glDrawElementsInstanced( GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, vertscalebias.size() );
+  std::vector<size_t> starts;
 
-  glBindVertexArray( 0 );
+  for( size_t c = a; c < ( size_t )end; ++c )
+  {
+    if( txt[c] == L'\n' )
+      starts.push_back( c + 1 );
+  }
 
-  glUseProgram( 0 );
+  index.lines.erase( index.lines.begin() + first_line + 1, index.lines.begin() + last );
+  index.lines.insert( index.lines.begin() + first_line + 1, starts.begin(), starts.end() );
 
-  glDisable( GL_BLEND );
-  glEnable( GL_DEPTH_TEST );
-  glEnable( GL_CULL_FACE );
+  //a range starts at 0 or the newline before it
+  font_sink none( ( font_instance* )0, 0 );
+  font_markup m;
+  size_t begin = first_line ? a - 1 : 0;
+  layout_range( txt, begin, ( size_t )end, size, first_line ? ( int )first_line - 1 : 0, m, font_ptr, mm::vec4( 1 ), mm::mat4::identity, mm::vec4( 1 ), index.line_advance, 0, true, none, 0, &index );
 
-  vertscalebias.clear();
-  texscalebias.clear();
-  fontcolor.clear();
-  transform.clear();
-  filter.clear();
+  library::get().restore_gl_state();
 }
@@ -9,16 +9,556 @@
 #include <list>
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 /*
  * Based on Shikoba
  */
 
+#ifdef _WIN32
+typedef unsigned int uint32_t;
+#endif
+
 struct glyph;
+struct font_file;
+struct font_text;
+struct font_hit_index;
 class font;
 class font_inst;
 
-#define FONT_LIB_VBO_SIZE 8
+#define FONT_LIB_VBO_SIZE 17
+
+//the atlas is a texture array of fixed size square pages
+//pages are added on demand, up to FONT_ATLAS_MAX_PAGES
+#define FONT_ATLAS_PAGE_SIZE 1024
+#define FONT_ATLAS_MAX_PAGES 64
+//mip chain length of a mipmapped atlas, glyphs get 2^(levels-1) texel gutters
+#define FONT_ATLAS_MIP_LEVELS 4
+
+//atlas storage, see font::set_atlas_format
+#define FONT_ATLAS_R8 0 //one byte per texel
+#define FONT_ATLAS_PACKED 1 //four pages share an rgba8 layer, one channel each, uploads need the pack shader
+#define FONT_ATLAS_BC4 2 //half a byte per texel, cells are aligned to 4x4 blocks on every mip level
+
+//per instance sampler selection, the 'filter' argument of add_to_render_list
+#define FONT_FILTER_POINT 0
+#define FONT_FILTER_LINEAR 1
+#define FONT_FILTER_MIPMAP 2 //trilinear, needs a mipmapped atlas for minified text
+
+//layer blend modes
+#define FONT_BLEND_ALPHA 0
+#define FONT_BLEND_PREMULTIPLIED 1
+#define FONT_BLEND_ADDITIVE 2
+
+//static text block drawing, see add_static_block
+#define FONT_BLOCK_AUTO 0 //cached once it is big and stable enough
+#define FONT_BLOCK_INSTANCED 1
+#define FONT_BLOCK_CACHED 2
+
+//when the caller's gl state is read, see font::set_gl_state_capture
+#define FONT_CAPTURE_ONCE 0 //on first use and after invalidate_gl_state
+#define FONT_CAPTURE_EVERY_FRAME 1 //by the first font call of every frame, a round of glGet calls each time
+
+//codepoints a text needs before it is laid out on several threads, and the size it is cut into
+#define FONT_PARALLEL_MIN 65536
+#define FONT_PARALLEL_CHUNK 16384
+
+//submission queue: chunks in the pool, and what one chunk holds
+//one submission has to fit a chunk, the render thread keeps the latest frame of every producer
+//so the pool should cover about three frames of all producers
+#define FONT_QUEUE_CHUNKS 64
+#define FONT_QUEUE_INSTANCES 2048
+#define FONT_QUEUE_CODEPOINTS 8192
+#define FONT_QUEUE_RECORDS 256
+
+//wrapping, see add_wrapped
+#define FONT_WRAP_LEFT 0
+#define FONT_WRAP_JUSTIFY 1 //wrapped lines are stretched to the full width at their spaces
+//measured words kept, the table starts over when it is full
+#define FONT_WORD_CACHE 65536
+
+//documents, see font_document
+//lines per line index entry, finding a line scans at most this many from the entry
+#define FONT_DOCUMENT_STRIDE 64
+//lines decoded above and below the visible ones, scrolling within them decodes nothing
+#define FONT_DOCUMENT_MARGIN 32
+//codepoints shown of a line at most
+#define FONT_DOCUMENT_MAX_LINE 1024
+//bytes the indexer scans between publishing its progress
+#define FONT_DOCUMENT_SLICE ( 4 * 1024 * 1024 )
+//how often the indexer looks for appended data once it caught up
+#define FONT_DOCUMENT_POLL_MS 100
+
+//glyph run files, see font::bake_runs
+#define FONT_RUN_VERSION 1
+
+//a glyph cell copied into the compacted atlas, see font::set_defrag
+struct font_defrag_move
+{
+  glyph* g;
+  unsigned int page, x, y; //in the current atlas
+  unsigned int new_page, new_x, new_y;
+  unsigned int w, h; //the cell, gutter included
+};
+
+//memory limits, 0 means unlimited
+struct font_budget
+{
+  size_t atlas_bytes; //atlas texels used by cached glyphs, mip levels included
+  size_t glyphs; //cached glyph records
+  size_t font_data; //used library::font_data entries
+
+  font_budget( size_t a = 0, size_t g = 0, size_t f = 0 ) : atlas_bytes( a ), glyphs( g ), font_data( f ) {}
+};
+
+struct font_size_usage
+{
+  unsigned int size;
+  size_t glyphs;
+  size_t atlas_bytes;
+  unsigned int last_used; //frame
+};
+
+struct font_stats
+{
+  unsigned int frame;
+  unsigned int pages; //atlas pages holding glyphs
+  unsigned int free_pages; //emptied by trimming, reused before new pages
+  unsigned int page_capacity; //pages allocated, a packed layer holds 4
+  size_t texture_bytes; //allocated atlas memory
+  size_t atlas_bytes; //used by cached glyphs
+  size_t glyphs;
+  size_t font_data; //used entries
+  size_t font_data_free; //entries on the free list
+  size_t trimmed_sizes;
+  size_t cached_blocks; //static blocks drawn from a surface
+  size_t surface_bytes;
+  size_t upload_bytes; //instance and layer data uploaded last frame
+  size_t gl_calls; //state changes issued last frame
+  size_t gl_calls_skipped; //redundant ones elided by the state cache
+  size_t gl_gets; //state queries issued last frame, 0 unless the caller's state was captured
+  size_t queue_chunks; //submission queue chunks in use
+  size_t queue_waits; //times a producer waited for a free chunk, since startup
+  size_t queue_dropped; //submissions that found no room
+  size_t queue_deferred; //submissions laid out on the render thread, their glyphs were not cached
+  size_t defrag_passes; //atlas compactions swapped in
+  size_t defrag_moves; //glyphs left to copy in the running compaction
+  int atlas_format;
+  float atlas_error_rms, atlas_error_max; //of the texels uploaded since the format was set, in 1/255, 0 unless compressed
+  size_t pool_nodes; //glyph cache nodes in use
+  size_t pool_capacity; //nodes in the pools' chunks
+  size_t heap_allocs; //glyph path heap allocations since startup, flat once the cache is warm
+  size_t frame_heap_allocs; //of those, during the last frame
+};
+
+//font::compare_rasterizers, the warmup charset at one size
+struct font_raster_report
+{
+  unsigned int size;
+  size_t glyphs;
+  float freetype_per_sec, builtin_per_sec; //glyphs rasterized per second, loading the hinted outline included
+  float mean_diff; //absolute coverage difference over the union of the glyph boxes, in 1/255
+  int max_diff;
+  float over_16; //fraction of those texels off by more than 16/255
+  size_t box_differs; //glyphs whose pixel box differs from freetype's
+};
+
+//gpu layout tables, match the structs of shaders/font/layout.cs
+//advances and kerning are in 1/64 pixels
+struct font_gpu_glyph
+{
+  mm::vec4 vertscalebias;
+  mm::vec4 texscalebias;
+  uint32_t code;
+  int advance;
+  uint32_t pad[2];
+};
+
+struct font_gpu_kern
+{
+  uint32_t prev;
+  uint32_t next;
+  int kern;
+  uint32_t pad;
+};
+
+//one glyph quad, this is the packed per instance vertex stream
+//attribute locations: vertscalebias 2, texscalebias 3, color 4, transform 6-9, filter 10, layer 11
+struct font_instance
+{
+  mm::vec4 vertscalebias;
+  mm::vec4 texscalebias;
+  mm::vec4 color;
+  mm::mat4 transform;
+  float filter;
+  float layer; //index of the layer projection, -1 uses the projection uniform
+
+  font_instance() {}
+  font_instance( const mm::vec4& vsb, const mm::vec4& tsb, const mm::vec4& c, const mm::mat4& t, float f ) :
+    vertscalebias( vsb ), texscalebias( tsb ), color( c ), transform( t ), filter( f ), layer( -1 ) {}
+};
+
+//where layout writes instances: a growing list or fixed caller memory
+struct font_sink
+{
+  std::vector<font_instance>* list;
+  font_instance* data;
+  size_t capacity;
+  size_t count; //instances produced, may exceed capacity
+  float layer; //stamped into every instance
+  std::vector<uint32_t>* codepoints; //if set, gets the codepoint of every instance, wchar_t(-1) for decorations
+
+  font_sink( std::vector<font_instance>& l, float y = -1 ) : list( &l ), data( 0 ), capacity( 0 ), count( 0 ), layer( y ), codepoints( 0 ) {}
+  font_sink( font_instance* d, size_t c ) : list( 0 ), data( d ), capacity( c ), count( 0 ), layer( -1 ), codepoints( 0 ) {}
+
+  void push( const font_instance& i, uint32_t cp = wchar_t(-1) )
+  {
+    if( codepoints )
+      codepoints->push_back( cp );
+
+    if( list )
+    {
+      list->push_back( i );
+      list->back().layer = layer;
+    }
+    else if( count < capacity )
+    {
+      data[count] = i;
+      data[count].layer = layer;
+    }
+
+    ++count;
+  }
+};
+
+//decorations switched on by the markup characters, they stay on across calls until switched off
+struct font_markup
+{
+  bool underline, overline, strikethrough, highlight;
+
+  font_markup() : underline( false ), overline( false ), strikethrough( false ), highlight( false ) {}
+};
+
+//where the carets of a laid out text are, see font::build_hit_index
+//coordinates are the pen's: x right, y down from the top of the first line
+//every line is line_advance tall, so finding a point's line is a division, within a line the carets are sorted
+struct font_hit_index
+{
+  std::vector<size_t> lines; //first codepoint of each line
+  std::vector<float> x; //caret before each codepoint, a newline's is the end of its line, and one after the last codepoint
+  float line_advance;
+
+  font_hit_index() : line_advance( 0 ) {}
+
+  size_t line_of( size_t c ) const;
+  //the caret nearest to a point, as the codepoint it is before
+  size_t hit_test( const mm::vec2& p ) const;
+  size_t hit_line( size_t line, float px ) const;
+  //top of the caret before codepoint c, it is line_advance tall
+  mm::vec2 caret( size_t c ) const;
+  //the codepoints a rectangle selects on each line it touches, [begin, end)
+  void select( const mm::vec2& a, const mm::vec2& b, std::vector< std::pair< size_t, size_t > >& ranges ) const;
+};
+
+//many readers or one writer, spinning
+//the writer is always the gl thread, it may lock again while it holds the lock
+struct font_rw_lock
+{
+  std::atomic<int> readers;
+  std::atomic<bool> writer;
+  int depth; //the writer's nesting
+
+  font_rw_lock() : readers( 0 ), writer( false ), depth( 0 ) {}
+
+  void lock_shared()
+  {
+    for( ;; )
+    {
+      while( writer.load() )
+        std::this_thread::yield();
+
+      ++readers;
+
+      if( !writer.load() )
+        return;
+
+      --readers;
+    }
+  }
+
+  void unlock_shared()
+  {
+    --readers;
+  }
+
+  void lock()
+  {
+    if( depth++ )
+      return;
+
+    writer.store( true );
+
+    while( readers.load() )
+      std::this_thread::yield();
+  }
+
+  void unlock()
+  {
+    if( !--depth )
+      writer.store( false );
+  }
+};
+
+//threads kept for the parallel layout paths, see library::run_on_threads
+struct font_worker_pool
+{
+  std::vector<std::thread> threads;
+  std::mutex runs; //one run at a time
+  std::mutex m;
+  std::condition_variable wake, done;
+  const std::function<void()>* work;
+  size_t round; //bumped by every run
+  unsigned int wanted; //workers the run still needs
+  unsigned int running; //workers of the run not done yet
+  bool quit;
+
+  font_worker_pool() : work( 0 ), round( 0 ), wanted( 0 ), running( 0 ), quit( false ) {}
+};
+
+//one queue_text call, the text is kept so the render thread can lay it out again
+struct font_queue_record
+{
+  font_inst* font;
+  unsigned int layer;
+  size_t first_codepoint, length;
+  size_t first_instance, count; //count is FONT_QUEUE_DEFERRED if the producer couldn't lay it out
+  unsigned int releases; //library glyph releases at layout, the instances are stale if it changed
+  mm::vec4 color, highlight_color;
+  mm::mat4 mat;
+  float line_height, filter;
+  font_markup markup; //at the start
+};
+
+#define FONT_QUEUE_DEFERRED ( ( size_t )-1 )
+
+//pooled storage a producer thread fills, the render thread hands it back
+//the vectors are reserved once and never grow past the FONT_QUEUE_ limits
+struct font_queue_chunk
+{
+  font_queue_chunk* next; //in the queue or a producer's pending list
+  unsigned int slot; //in the pool
+  unsigned int producer, frame;
+  std::vector<font_instance> instances;
+  std::vector<uint32_t> codepoints;
+  std::vector<font_queue_record> records;
+};
+
+//the frame of a producer the render thread draws until a newer one is published
+struct font_queue_frame
+{
+  unsigned int frame;
+  std::vector<font_queue_chunk*> chunks;
+};
+
+//a line aligned piece of a long text, laid out on its own thread
+struct font_chunk
+{
+  size_t begin, end; //begin is a newline, except for the first chunk
+  size_t lines; //newlines inside
+  size_t glyphs; //glyph instances, assuming everything loads
+  size_t decorated[4]; //decorated characters after the chunk switched that decoration, by font_markup order
+  size_t inherited[4]; //characters before the first switch, decorated if it was on at the start
+  int switched[4]; //-1 untouched, otherwise the state at the end
+  std::vector<uint32_t> missing_glyphs;
+  std::vector< std::pair< uint32_t, uint32_t > > missing_kerning;
+  std::unordered_set<uint32_t> glyphs_seen; //scratch of font::scan_chunk, kept so it doesn't reallocate
+  std::unordered_set<uint64_t> pairs_seen;
+  size_t first_line, first_instance; //prefix sums
+  font_markup start;
+};
+
+//what a caller needs to draw instances with the font shader in its own passes
+//the texture changes when the atlas grows, query it after layout
+struct font_atlas_binding
+{
+  GLuint texture;
+  GLenum target;
+  GLuint sampler_point, sampler_linear, sampler_mip; //texture units 0, 1, 2
+  GLuint shader;
+  float page_size; //uniform location 1
+  int channels; //uniform location 5, pages per texture layer
+  mm::mat4 projection; //uniform location 0
+};
+
+//world label flags
+#define FONT_LABEL_FIXED_SIZE 1 //same pixel size at any distance
+#define FONT_LABEL_DEPTH 2 //occluded by the scene, otherwise drawn on top
+
+//the per label data of world space labels, 32 bytes, this is all that changes when labels move
+//matches the world_label struct of shaders/font/world.vs
+struct font_world_label
+{
+  mm::vec4 anchor_scale; //xyz: anchor, w: pixel size multiplier, with distance scaling the distance where the label is drawn 1:1
+  float offset_x, offset_y; //screen space, pixels
+  unsigned int flags;
+  float extent; //half diagonal in pixels, set by the font
+
+  font_world_label( const mm::vec3& a = mm::vec3( 0 ), float s = 1, const mm::vec2& o = mm::vec2( 0 ), unsigned int f = FONT_LABEL_FIXED_SIZE ) :
+    anchor_scale( a, s ), offset_x( o.x ), offset_y( o.y ), flags( f ), extent( 0 ) {}
+};
+
+//text of a world label, laid out once around its center
+struct font_world_text
+{
+  std::vector<uint32_t> text; //0 terminated
+  font_inst* font;
+  mm::vec4 color;
+  float filter;
+  std::vector<font_instance> glyphs;
+  unsigned int size; //of the font when the glyphs were laid out, kept from being trimmed
+  size_t first; //in the world glyph buffer
+  bool alive;
+
+  font_world_text() : font( 0 ), filter( 0 ), size( 0 ), first( 0 ), alive( false ) {}
+};
+
+//structure of arrays input of add_labels, the optional arrays may be 0
+struct font_label_batch
+{
+  size_t count;
+  const font_text* text;
+  const mm::vec2* position; //pen position of the first baseline in pixels, y up
+  const mm::vec4* color; //0 uses the color argument
+  const unsigned int* transform_index; //into transforms, 0 uses the identity
+  const mm::mat4* transforms;
+  font_inst* const* fonts; //0 uses the font argument
+
+  font_label_batch() : count( 0 ), text( 0 ), position( 0 ), color( 0 ), transform_index( 0 ), transforms( 0 ), fonts( 0 ) {}
+};
+
+//how a layer is drawn, consecutive layers with the same blend and target share one multi draw
+struct font_layer_params
+{
+  bool screen_projection; //the font's pixel space projection, see resize()
+  mm::mat4 projection; //used otherwise
+  int blend;
+  GLint framebuffer; //-1 keeps the bound one
+  mm::ivec4 viewport; //x, y, w, h, zero size keeps the current one
+
+  font_layer_params() : screen_projection( true ), projection( mm::mat4::identity ), blend( FONT_BLEND_ALPHA ), framebuffer( -1 ), viewport( 0 ) {}
+};
+
+//a static block of text, rendered once into an offscreen surface and drawn as one quad
+struct font_block
+{
+  unsigned long long hash; //text, font, size, colors, transform and screen size
+  unsigned int stable_frames; //frames drawn since the last change
+  unsigned int last_used;
+  size_t glyphs; //instances it lays out to
+  GLuint tex, fbo; //0 when not cached
+  mm::ivec4 rect; //x, y, w, h in pixels
+  mm::vec2 lastpos;
+
+  font_block() : hash( 0 ), stable_frames( 0 ), last_used( 0 ), glyphs( 0 ), tex( 0 ), fbo( 0 ), rect( 0 ), lastpos( 0 ) {}
+};
+
+//one submission (add_to_render_list call) of a layer, it keeps its buffer range across frames while it fits
+//unused capacity is padded with degenerate instances
+struct font_slot
+{
+  size_t begin, count; //in the layer list
+  size_t offset, capacity; //in the shared buffer
+  unsigned long long hash, uploaded_hash;
+  std::vector<unsigned long long> chunks; //hashes of the uploaded chunks, see FONT_SLOT_CHUNK
+  bool placed; //false forces an upload
+
+  font_slot() : begin( 0 ), count( 0 ), offset( 0 ), capacity( 0 ), hash( 0 ), uploaded_hash( 0 ), placed( false ) {}
+};
+
+//a named batch, its instances get a range of the shared instance buffer
+struct font_layer
+{
+  std::string name;
+  font_layer_params params;
+  std::vector<font_instance> list;
+  std::vector<font_block*> blocks; //cached surfaces, drawn after the instances
+  std::vector<font_slot> slots; //matched to this frame's submissions by order, last frame's ones are kept until end_frame
+  size_t submissions; //this frame
+  size_t first; //offset in the shared buffer, valid after upload
+  size_t count; //instances drawn from there, padding included, up to the last slot submitted
+
+  font_layer() : submissions( 0 ), first( 0 ), count( 0 ) {}
+};
+
+//the gl state the font system touches, see library::capture_gl_state
+struct font_gl_state
+{
+  GLint cull, depth, blend, depth_mask;
+  GLint blend_src_rgb, blend_dst_rgb, blend_src_alpha, blend_dst_alpha;
+  GLint program, vao, draw_framebuffer;
+  GLint viewport[4];
+  GLint unpack_alignment;
+  GLint array_buffer, indirect_buffer, storage_buffer;
+  GLint storage_buffers[8]; //indexed bindings 0-7
+  GLint active_texture; //unit index
+  GLint texture_2d[3], texture_array[3], sampler[3]; //units 0-2
+};
+
+//the glyph cache's map nodes come from free lists of FONT_POOL_CHUNK node chunks, kept for reuse until exit
+//only the gl thread allocates, under the cache write lock
+#define FONT_POOL_CHUNK 256
+
+void* font_pool_alloc( size_t size );
+void font_pool_free( void* p, size_t size );
+
+template< class T >
+struct font_pool_allocator
+{
+  typedef T value_type;
+
+  font_pool_allocator() {}
+  template< class U > font_pool_allocator( const font_pool_allocator<U>& ) {}
+
+  T* allocate( size_t n )
+  {
+    return ( T* )font_pool_alloc( sizeof( T ) * n );
+  }
+
+  void deallocate( T* p, size_t n )
+  {
+    font_pool_free( p, sizeof( T ) * n );
+  }
+};
+
+template< class T, class U >
+bool operator==( const font_pool_allocator<T>&, const font_pool_allocator<U>& )
+{
+  return true;
+}
+
+template< class T, class U >
+bool operator!=( const font_pool_allocator<T>&, const font_pool_allocator<U>& )
+{
+  return false;
+}
+
+//one size's glyphs by codepoint
+typedef std::map< uint32_t, glyph, std::less<uint32_t>, font_pool_allocator< std::pair<const uint32_t, glyph> > > font_glyph_map;
+
+//free list of one node size
+struct font_node_pool
+{
+  size_t size;
+  void* free_list;
+  std::vector<char*> chunks;
+  size_t live;
+};
 
 struct fontscalebias
 {
@@ -34,21 +574,89 @@ class library
     friend class font;
     friend class face;
     friend class font_inst;
+    friend void* font_pool_alloc( size_t size );
+    friend void font_pool_free( void* p, size_t size );
   private:
     void* the_library;
     mm::uvec2 texture_pen;
     GLint texture_row_h;
-    GLuint tex; //font texture
-    GLuint texsampler_point, texsampler_linear;
-    mm::uvec2 texsize;
+    GLuint tex; //font texture array, one layer per page
+    GLuint texsampler_point, texsampler_linear, texsampler_mip;
+    unsigned int mip_levels; //1 means no mipmaps
+    std::vector<GLubyte> mip_scratch;
+    std::vector<GLubyte> glyph_scratch; //cell being rasterized
+    std::vector<float> raster_scratch; //area and cover of the built-in rasterizer
+    std::vector<font_node_pool> node_pools; //by node size, see font_pool_alloc
+    unsigned int page_count; //pages in use
+    unsigned int page_capacity; //layers allocated in tex
+    unsigned int current_page; //page being filled
     GLuint vao; //vao
     GLuint vbos[FONT_LIB_VBO_SIZE]; //vbos
     std::vector<fontscalebias> font_data;
+    std::vector<unsigned int> font_data_free; //reusable font_data slots
+    std::vector<unsigned int> page_live; //live glyphs per page
+    std::vector<unsigned int> free_pages; //pages emptied by trimming
+    unsigned int frame;
+    unsigned int trim_frames; //sizes not drawn for this long are dropped, 0 disables
+    font_budget budget;
+    size_t trimmed_sizes;
+    unsigned int generation; //bumped when every glyph is dropped, or moved by a compaction
     GLuint the_shader; //shader program
+    GLuint the_blit_shader; //draws cached block surfaces
+    GLuint blit_vao; //no attributes, the quad comes from gl_VertexID
+    GLuint the_world_shader; //world.vs + font.ps
+    GLuint the_world_cull_shader; //world_cull.cs, optional
+    GLuint world_vao; //glyph attributes on the world glyph buffer
+    GLuint the_layout_shader; //layout.cs, optional
+    GLuint the_pack_shader; //pack.cs, writes one channel of the packed atlas
+    int atlas_format; //FONT_ATLAS_*
+    unsigned long long atlas_error_sq; //summed squared encoding error
+    size_t atlas_error_texels;
+    int atlas_error_max;
+    std::vector<GLubyte> encode_scratch;
+    GLuint gpu_vao; //glyph attributes on the gpu layout's instance buffer
+    GLint max_texture_size;
+    //state cache: what the caller had when it was captured, and what is set now
+    font_gl_state gl_caller, gl_current;
+    bool gl_valid; //captured
+    bool gl_dirty; //current differs from the caller's
+    size_t gl_calls, gl_calls_skipped, last_gl_calls, last_gl_calls_skipped;
+    size_t gl_gets, last_gl_gets; //queries by capture_gl_state
+    int gl_capture; //FONT_CAPTURE_*
     bool is_set_up;
     std::vector<font_inst*> instances;
+    //the glyph maps, kerning and font data are only changed under the write lock
+    //queue_text reads them from other threads under the shared lock
+    font_rw_lock cache_lock;
+    unsigned int releases; //glyphs released so far, their atlas cells and font data may be reused
+    //measured words in 1/64 pixels, by font file, size and word hash
+    std::unordered_map< unsigned long long, int > word_widths;
+    unsigned int frame_uploads; //glyphs rasterized this frame, compaction only runs on frames without any
+    //compaction: live glyphs are copied a few per frame into a tight second texture, swapped in at the end of a frame
+    GLuint defrag_tex; //0 while no pass runs
+    unsigned int defrag_pages;
+    unsigned int defrag_page; //last page of the plan, packing goes on there after the swap
+    mm::uvec2 defrag_pen;
+    GLint defrag_row_h;
+    std::vector<font_defrag_move> defrag_moves; //in copy order
+    size_t defrag_next; //first move not copied yet
+    unsigned int defrag_generation, defrag_releases; //a pass is dropped if glyphs were released meanwhile
+    unsigned int defrag_checked; //release count the fragmentation was last measured at
+    unsigned int defrag_budget_us; //per frame, 0 disables
+    float defrag_fill; //compact when live cells fill less than this of the allocated pages
+    size_t defrag_passes;
+    size_t heap_allocs; //the glyph path's trips to the heap: pool chunks, scratch growth, since startup
+    size_t heap_allocs_mark; //heap_allocs at the end of the last frame
+    size_t frame_heap_allocs; //during the last frame
+    font_worker_pool workers;
+    //font files are mapped and parsed once, shared by every font_inst using them
+    std::map< std::pair< std::string, unsigned int >, font_file* > font_files;
 
     void delete_glyphs();
+    void run_on_threads( unsigned int threads, const std::function<void()>& work );
+    void run_worker();
+    font_file* acquire_font_file( const std::string& filename, unsigned int index );
+    void release_font_file( font_file* f );
 
     void* get_library()
     {
@@ -60,9 +668,62 @@ class library
       return the_shader;  //load shader externally
     }
 
-    mm::uvec2 get_texsize()
+    GLuint& get_blit_shader()
+    {
+      return the_blit_shader;
+    }
+
+    GLuint& get_world_shader()
+    {
+      return the_world_shader;
+    }
+
+    GLuint& get_world_cull_shader()
+    {
+      return the_world_cull_shader;
+    }
+
+    GLuint& get_layout_shader()
+    {
+      return the_layout_shader;
+    }
+
+    GLuint& get_pack_shader()
+    {
+      return the_pack_shader;
+    }
+
+    unsigned int get_current_page()
+    {
+      return current_page;
+    }
+
+    unsigned int get_page_count()
+    {
+      return page_count;
+    }
+
+    //empty texels around each glyph
+    unsigned int get_gutter()
+    {
+      return 1 << ( mip_levels - 1 );
+    }
+
+    //cells are sized and placed in multiples of this, so each mip level (and bc4 block) maps to its own texels
+    unsigned int get_align()
     {
-      return texsize;
+      return atlas_format == FONT_ATLAS_BC4 ? 4 << ( mip_levels - 1 ) : get_gutter();
+    }
+
+    //pages per texture layer
+    unsigned int get_channels()
+    {
+      return atlas_format == FONT_ATLAS_PACKED ? 4 : 1;
+    }
+
+    unsigned int get_layers( unsigned int pages )
+    {
+      return ( pages + get_channels() - 1 ) / get_channels();
     }
 
     mm::uvec2& get_texture_pen()
@@ -93,27 +754,56 @@ class library
     void set_up();
     void destroy();
 
+    //tracked state changes, each one is skipped if the cached value matches
+    //no glGet is issued except when capturing the caller's state
+    void capture_gl_state();
+    void restore_gl_state(); //back to the captured caller state, only what differs
+    void forget_texture( GLuint t ); //deleted textures unbind themselves
+    bool gl_count( bool changed );
+    bool gl_changed( GLint& cached, GLint val );
+    void set_capability( GLenum cap, bool val );
+    void set_blend_func( GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha );
+    void set_blend_mode( int blend ); //FONT_BLEND_*
+    void use_program( GLuint p );
+    void bind_vertex_array( GLuint v );
+    void bind_draw_framebuffer( GLuint f );
+    void set_viewport( GLint x, GLint y, GLint w, GLint h );
+    void set_unpack_alignment( GLint a );
+    void bind_buffer( GLenum target, GLuint b );
+    void bind_storage_buffer( GLuint index, GLuint b );
+    void set_depth_mask( bool val );
+    void set_active_texture( GLint unit );
+    void bind_texture( GLint unit, GLenum target, GLuint t );
+    void bind_sampler( GLint unit, GLuint s );
+
+    void invalidate_gl_state()
+    {
+      gl_valid = false;
+    }
+
     void bind_shader()
     {
-      glUseProgram( the_shader );
+      use_program( the_shader );
     }
 
     void bind_texture()
     {
-      glActiveTexture( GL_TEXTURE0 );
-      glBindTexture( GL_TEXTURE_RECTANGLE, tex );
-      glActiveTexture( GL_TEXTURE1 );
-      glBindTexture( GL_TEXTURE_RECTANGLE, tex );
+      bind_texture( 0, GL_TEXTURE_2D_ARRAY, tex );
+      bind_texture( 1, GL_TEXTURE_2D_ARRAY, tex );
+      bind_texture( 2, GL_TEXTURE_2D_ARRAY, tex );
 
-      glBindSampler( 0, texsampler_point );
-      glBindSampler( 1, texsampler_linear );
+      bind_sampler( 0, texsampler_point );
+      bind_sampler( 1, texsampler_linear );
+      bind_sampler( 2, texsampler_mip );
     }
 
     void bind_vao()
     {
-      glBindVertexArray( vao );
+      bind_vertex_array( vao );
     }
 
+    void set_instance_attribs( GLuint buffer, size_t offset );
+
     template< class t >
     void update_scalebiascolor( unsigned int i, const std::vector< t >& tt )
     {
@@ -123,12 +813,45 @@ class library
         glBufferData( GL_ARRAY_BUFFER, sizeof( t ) * tt.size(), &tt[0], GL_DYNAMIC_DRAW );
     }
 
-    bool expand_tex();
+    bool add_page();
+    void upload_cell( unsigned int page, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const GLubyte* data );
+    void set_mip_levels( unsigned int levels );
+    void set_atlas_format( int format );
+    void upload_level( unsigned int page, unsigned int level, unsigned int x, unsigned int y, unsigned int w, unsigned int h, const GLubyte* data );
+    void alloc_tex( GLuint& t, unsigned int pages );
+    GLubyte* get_scratch( std::vector<GLubyte>& v, size_t n );
+    void* pool_alloc( size_t size );
+    void pool_free( void* p, size_t size );
+    void get_cell( const glyph& g, font_defrag_move& m );
+    bool plan_defrag();
+    void defrag_step();
+    bool finish_defrag();
+    void drop_defrag();
 
-    void add_font_data( const fontscalebias& fd )
+    unsigned int add_font_data( const fontscalebias& fd )
     {
+      if( !font_data_free.empty() )
+      {
+        unsigned int i = font_data_free.back();
+        font_data_free.pop_back();
+        font_data[i] = fd;
+        return i;
+      }
+
       font_data.push_back( fd );
+      return font_data.size() - 1;
+    }
+
+    unsigned int get_frame()
+    {
+      return frame;
     }
+
+    void release_glyph( const glyph& g );
+    void trim_size( font_file* f, unsigned int size );
+    void trim();
+    void get_usage( font_file* f, font_budget& b );
+    font_stats get_stats();
   protected:
     library(); //singleton
     library( const library& );
@@ -144,9 +867,44 @@ class library
     }
 };
 
-#ifdef _WIN32
-typedef unsigned int uint32_t;
-#endif
+//glyph rasterizers, see font::set_rasterizer
+#define FONT_RASTER_FREETYPE 0
+#define FONT_RASTER_BUILTIN 1 //hinted outlines from freetype, coverage by signed area accumulation (sse2/avx2 where built for)
+
+//what set_size rasterizes up front
+#define FONT_WARMUP_NONE 0
+#define FONT_WARMUP_CHARSET 1 //an explicit charset, the built-in latin set if empty
+#define FONT_WARMUP_PROFILE 2 //the glyphs recorded in the usage profile, most used first
+
+struct font_warmup
+{
+  int mode;
+  std::vector<uint32_t> charset;
+  bool background; //rasterize a few glyphs per render() instead of blocking set_size
+
+  font_warmup( int m = FONT_WARMUP_CHARSET, bool bg = false ) : mode( m ), background( bg ) {}
+};
+
+//non-owning pointer+length view over caller text
+//length is in code units (bytes for utf8)
+struct font_text
+{
+  enum encoding
+  {
+    utf8, utf16, utf32
+  };
+
+  const void* data;
+  size_t length;
+  encoding enc;
+
+  font_text( const char* s, size_t l ) : data( s ), length( l ), enc( utf8 ) {}
+  font_text( const char16_t* s, size_t l ) : data( s ), length( l ), enc( utf16 ) {}
+  font_text( const char32_t* s, size_t l ) : data( s ), length( l ), enc( utf32 ) {}
+  font_text( const wchar_t* s, size_t l ) : data( s ), length( l ), enc( sizeof( wchar_t ) == 2 ? utf16 : utf32 ) {}
+  font_text( const std::string& s ) : data( s.data() ), length( s.size() ), enc( utf8 ) {}
+  font_text( const std::wstring& s ) : data( s.data() ), length( s.size() ), enc( sizeof( wchar_t ) == 2 ? utf16 : utf32 ) {}
+};
 
 //this corresponds to a font file '*.ttf'
 //meaning if you'd like to switch to another font-type
@@ -161,6 +919,7 @@ class font_inst
     {
         friend class font;
         friend class library;
+        friend class font_run_file;
       private:
         unsigned int size;
         float asc;
@@ -169,11 +928,14 @@ class font_inst
         float gap;
         float upos;
         float uthick;
-        void* the_face; //FT_Face
-        std::map< unsigned int, std::map<uint32_t, glyph> >* glyphs;
+        void* the_face; //FT_Face, owned by the shared font_file
+        void* the_size; //FT_Size, our own scale on the shared face
+        font_file* file;
+        std::map< unsigned int, font_glyph_map >* glyphs; //shared by all instances of the file
 
+        void activate();
         void set_size( unsigned int val );
-        bool load_glyph( uint32_t val );
+        bool load_glyph( uint32_t val, int rasterizer );
 
         unsigned int get_size()
         {
@@ -182,6 +944,11 @@ class font_inst
 
         glyph& get_glyph( uint32_t i );
         bool has_glyph( uint32_t i );
+        //the pair was looked up already, or the face has no kerning
+        bool has_kerning( const uint32_t prev, const uint32_t next );
+        //lookups without inserting, safe to call from several threads while nothing is loaded
+        const glyph* find_glyph( uint32_t i );
+        float cached_kerning( const uint32_t prev, const uint32_t next );
         float advance( const uint32_t current );
         float kerning( const uint32_t prev, const uint32_t next = 0 );
         float height();
@@ -197,11 +964,131 @@ class font_inst
         ~face();
     }* the_face;
 
-    font_inst() : the_face( 0 ) {}
-    ~font_inst()
+    std::map< unsigned int, font_warmup > warmup; //by size, 0 is the default for all sizes
+    std::vector<uint32_t> warmup_queue; //background warmup, rasterized from the back
+    bool profiling;
+    std::map< unsigned int, std::map< uint32_t, unsigned int > > usage; //glyph usage histogram by size
+
+    font_budget budget; //applies to the font file, shared with other instances of it
+
+    //font::set_zoom: laid out at the drawn (cached) size and scaled to the requested one
+    float zoom; //requested size, 0 when not zooming
+    float zoom_scale; //zoom / drawn size, 1 when not zooming
+    float zoom_anchor; //where the request last settled, see font::set_zoom_hysteresis
+    unsigned int zoom_frame; //when it settled there
+    unsigned int zoom_size; //exact size being rasterized, drawn glyph by glyph as it comes, 0 if none
+    std::vector<uint32_t> zoom_queue; //its glyphs left, rasterized from the back
+
+    int rasterizer; //FONT_RASTER_*
+
+    font_inst() : the_face( 0 ), profiling( false ), zoom( 0 ), zoom_scale( 1 ), zoom_anchor( 0 ), zoom_frame( 0 ), zoom_size( 0 ), rasterizer( FONT_RASTER_FREETYPE ) {}
+    ~font_inst();
+};
+
+//a utf-8 file shown a window of lines at a time, see font::add_document
+//the file is mapped, never read as a whole, and its lines are indexed on a background thread
+//the file may grow while it is open (eg. a log being written), but it must not shrink
+class font_document
+{
+    friend class font;
+  private:
+    std::string filename;
+    const char* data; //mapping of the render thread, remapped when the file grew
+    size_t size;
+    void* handle;
+    std::thread indexer;
+    std::atomic<bool> stop;
+    font_rw_lock index_lock; //the indexer is its only writer
+    //under index_lock
+    std::vector<size_t> index; //start of every FONT_DOCUMENT_STRIDE-th line
+    size_t lines; //newlines found
+    size_t tail; //start of the line after the last newline
+    size_t scanned; //bytes indexed
+    size_t file_size; //bytes the indexer has mapped
+    //render thread
+    bool follow;
+    size_t first; //top visible line
+    std::vector<uint32_t> text; //decoded window, newline separated, 0 terminated
+    std::vector<size_t> starts; //of each window line in text, and one past the end
+    size_t window_first, window_lines;
+    size_t window_scanned; //the last window line was the unterminated one, as of this many bytes
+
+    void run_indexer();
+    size_t count_lines(); //index_lock held
+    bool find_line( size_t line, size_t& begin, size_t& end ); //index_lock held
+    void decode_window( size_t begin, size_t end );
+  protected:
+    font_document( const font_document& );
+    font_document& operator=( const font_document& );
+  public:
+    //starts indexing, the file may be empty but has to exist
+    bool open( const std::string& filename );
+    void close();
+    //lines indexed so far, an unterminated last line included
+    size_t get_line_count();
+    //the indexer reached the end of the file, it keeps watching it for appended data
+    bool is_indexed();
+
+    //the last lines stay in view as the file grows
+    void set_follow( bool val )
+    {
+      follow = val;
+    }
+
+    bool get_follow()
+    {
+      return follow;
+    }
+
+    //clamped to the line count when the document is drawn
+    void scroll_to( size_t line )
+    {
+      first = line;
+    }
+
+    void scroll( long long delta )
     {
-      delete the_face;
+      first = delta < 0 && ( size_t )-delta > first ? 0 : first + delta;
     }
+
+    size_t get_first_line()
+    {
+      return first;
+    }
+
+    font_document();
+    ~font_document();
+};
+
+//strings laid out ahead of time against one font and size, see font::bake_runs and font::add_run
+//the file is mapped, a run is drawn by copying its instances
+class font_run_file
+{
+    friend class font;
+  private:
+    const char* data;
+    size_t size;
+    void* handle;
+    font_inst* font;
+    std::vector<mm::vec4> texscalebias; //of the file's glyph table in the atlas
+    std::vector<bool> present; //the glyph is in the atlas
+    unsigned int generation, releases; //library state the table was resolved at
+    bool resolved;
+  protected:
+    font_run_file( const font_run_file& );
+    font_run_file& operator=( const font_run_file& );
+  public:
+    //checks the version and that the runs were baked with font_ptr's font file
+    bool open( const std::string& filename, font_inst& font_ptr );
+    void close();
+    //the run baked under 'name', -1 if there is none
+    int find( const std::string& name );
+    size_t get_run_count();
+    //the size the runs were laid out at, font_ptr has to be set to it when they are drawn
+    unsigned int get_size();
+
+    font_run_file();
+    ~font_run_file();
 };
 
 class font
@@ -209,25 +1096,333 @@ class font
   private:
     mm::uvec2 screensize;
     mm::frame<float> font_frame;
+    unsigned int warmup_budget; //background warmup glyphs per render()
+    float zoom_hysteresis; //size change that counts as the zoom still moving
+    unsigned int zoom_settle_frames; //frames the zoom has to stay put before its size is rasterized
+    std::vector<uint32_t> codepoints; //decode scratch, reused across calls
+    font_markup markup;
+    unsigned int layout_threads;
+    std::vector<font_chunk> chunks; //of the text being laid out in parallel
+    std::vector<font_layer> layers; //in creation order, 0 is "default"
+    std::map< std::string, unsigned int > layer_names;
+    std::vector<unsigned int> render_ids; //every layer in order, kept for render
+    unsigned int current_layer; //where add_to_render_list goes
+    bool layers_dirty; //lists changed since the last upload
+    size_t instance_capacity; //of the shared instance buffer
+    size_t upload_bytes, last_upload_bytes; //this and the previous frame
+    unsigned long long projection_hash; //of the uploaded layer projections
+    std::vector<font_instance> upload_scratch; //a run of dirty slots
+    std::vector<GLuint> draw_commands; //indirect draw scratch
+    std::map< std::string, font_block > blocks;
+    size_t block_bytes; //surface memory in use
+    size_t block_budget;
+    unsigned int block_min_glyphs; //auto caching thresholds
+    unsigned int block_stable_frames;
+    std::vector<font_instance> block_scratch;
+    unsigned int label_threads;
+    std::vector<uint32_t> label_codepoints; //all labels of a batch, 0 terminated each
+    std::vector<size_t> label_offsets; //first codepoint, then first instance of each label
+    std::vector<size_t> label_instances;
+    std::vector<float> label_line_advance;
+    std::vector<font_world_label> world_labels; //by id
+    std::vector<font_world_text> world_texts; //by id
+    std::vector<unsigned int> world_free; //removed ids
+    bool world_glyphs_dirty, world_labels_dirty;
+    unsigned int world_generation, world_releases; //library state the glyphs were laid out at
+    bool world_sort, world_gpu_cull;
+    std::vector<GLuint> world_commands; //indirect draws, one per label
+    std::vector< std::pair< float, unsigned int > > world_order;
+    std::vector<font_instance> world_scratch;
+    size_t gpu_capacity; //codepoints the gpu layout buffers hold
+    std::vector<font_gpu_glyph> gpu_glyphs; //the uploaded tables, see dispatch_gpu_layout
+    std::vector<font_gpu_kern> gpu_kerns;
+    size_t gpu_glyph_count, gpu_kern_count; //their entries, the vectors hold a dummy when empty
+    //what the tables were built from, they are built again once any of it changed
+    font_file* gpu_table_file;
+    unsigned int gpu_table_size, gpu_table_generation, gpu_table_releases;
+    size_t gpu_table_glyphs, gpu_table_kerns, gpu_table_trims;
+    std::vector<GLuint> gpu_missing; //readback scratch
+    GLsync gpu_fence; //set after a gpu layout, its missing list is read once this passed
+    font_inst* gpu_font; //font and size of that layout
+    unsigned int gpu_size;
+    font_queue_chunk* queue_pool[FONT_QUEUE_CHUNKS];
+    std::atomic<bool> queue_used[FONT_QUEUE_CHUNKS];
+    std::atomic<font_queue_chunk*> queue_head; //published chunks, newest first
+    std::atomic<unsigned int> queue_producer_ids;
+    std::atomic<size_t> queue_waits, queue_dropped, queue_deferred;
+    unsigned int queue_wait_us; //how long a producer waits for a free chunk before dropping
+    std::map< unsigned int, font_queue_frame > queue_frames; //by producer, render thread only
+    std::vector<uint32_t> wrap_text; //the text with its line breaks
+    std::vector<float> wrap_spacing; //extra advance after each codepoint, for justified lines
 
+    void upload_layers();
+    void submit( unsigned int layer, size_t begin );
+    void upload_range( const font_layer& y, const font_slot& s, size_t begin, size_t end, size_t& run_offset );
+    bool render_block( font_block& b, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float filter );
+    void release_block( font_block& b );
+    bool make_block_room( size_t bytes );
+    void draw_blocks( const unsigned int* ids, size_t count );
+    void layout_world_label( unsigned int id );
+    void layout_labels( const font_label_batch& batch, font_inst& font_ptr, const mm::vec4& color, float filter, float layer, size_t first, size_t last, font_instance* out );
+    bool dispatch_gpu_layout( const uint32_t* txt, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, float line_height, float filter );
+    void load_gpu_missing( bool wait );
     void add_glyph( font_inst& f, uint32_t c, int counter = 0 );
+    font_warmup get_warmup_set( font_inst& f, unsigned int s, std::vector<uint32_t>& set );
+    void switch_size( font_inst& f, unsigned int s );
+    void zoom_step( font_inst& f, unsigned int& budget );
+    size_t decode( const font_text* segments, size_t count );
+    size_t decode( const font_text* segments, size_t count, std::vector<uint32_t>& out );
+    mm::vec2 layout( const uint32_t* txt, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float line_height, float filter, font_sink& out, font_markup* m = 0, const float* spacing = 0 );
+    mm::vec2 layout_range( const uint32_t* txt, size_t begin, size_t end, size_t size, int line, font_markup& m, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float vert_advance, float filter, bool loading, font_sink& out, const float* spacing = 0, font_hit_index* hits = 0 );
+    void scan_chunk( const uint32_t* txt, font_chunk& k, font_inst& font_ptr );
+    bool layout_parallel( const uint32_t* txt, size_t size, font_inst& font_ptr, const mm::vec4& color, const mm::mat4& mat, const mm::vec4& highlight_color, float vert_advance, float filter, font_sink& out, font_markup& m, const float* spacing, mm::vec2& lastpos );
+    font_queue_chunk* claim_chunk();
+    size_t wrap( const uint32_t* txt, size_t size, font_inst& font_ptr, float max_width, int flags );
+    int word_width( const uint32_t* word, size_t size, font_inst& font_ptr );
+    void release_chunk( font_queue_chunk* c );
   protected:
-    font() {} //singleton
+    font() : warmup_budget( 8 ), zoom_hysteresis( 0.5f ), zoom_settle_frames( 10 ), layout_threads( 1 ), current_layer( 0 ), layers_dirty( true ), instance_capacity( 0 ),
+      upload_bytes( 0 ), last_upload_bytes( 0 ), projection_hash( 0 ),
+      block_bytes( 0 ), block_budget( 32 * 1024 * 1024 ), block_min_glyphs( 256 ), block_stable_frames( 8 ), label_threads( 1 ),
+      world_glyphs_dirty( false ), world_labels_dirty( false ), world_generation( 0 ), world_releases( 0 ), world_sort( true ), world_gpu_cull( false ),
+      gpu_capacity( 0 ), gpu_glyph_count( 0 ), gpu_kern_count( 0 ), gpu_table_file( 0 ), gpu_table_size( 0 ), gpu_table_generation( 0 ), gpu_table_releases( 0 ),
+      gpu_table_glyphs( 0 ), gpu_table_kerns( 0 ), gpu_table_trims( 0 ), gpu_fence( 0 ), gpu_font( 0 ), gpu_size( 0 ),
+      queue_head( 0 ), queue_producer_ids( 0 ), queue_waits( 0 ), queue_dropped( 0 ), queue_deferred( 0 ), queue_wait_us( 0 ) //singleton
+    {
+      for( int c = 0; c < FONT_QUEUE_CHUNKS; ++c )
+      {
+        queue_pool[c] = 0;
+        queue_used[c] = false;
+      }
+
+      get_layer( "default" );
+    }
     font( const font& );
     font( font && );
     font& operator=( const font& );
   public:
     void load_font( const std::string& filename, font_inst& font_ptr, unsigned int size );
     mm::vec2 add_to_render_list( const std::wstring& text, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    //zero-copy overloads, length in code units
+    mm::vec2 add_to_render_list( const char* utf8, size_t length, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    mm::vec2 add_to_render_list( const char16_t* utf16, size_t length, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    mm::vec2 add_to_render_list( const char32_t* utf32, size_t length, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    //segments are laid out as if they were concatenated (kerning included)
+    mm::vec2 add_to_render_list( const font_text* segments, size_t count, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    //draws every layer in creation order, then ends the frame
     void render();
 
+    //layers are created on first use, their lists live until end_frame()
+    unsigned int get_layer( const std::string& name );
+    void set_layer( unsigned int layer );
+    void set_layer_params( unsigned int layer, const font_layer_params& p );
+    //all layers are uploaded once, the first time any of them is drawn in a frame
+    void render_layer( unsigned int layer );
+    void render_layers( const unsigned int* layers, size_t count );
+    //clears the layers, trims the cache and runs background warmup
+    void end_frame();
+
+    //text that rarely changes, 'id' names the block across frames
+    //in auto mode big blocks that stayed the same for a few frames are drawn from a cached surface
+    mm::vec2 add_static_block( const std::string& id, const font_text* segments, size_t count, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0, int mode = FONT_BLOCK_AUTO );
+
+    //lays out many short labels in one pass into one contiguous instance range of the current layer
+    //markup is not interpreted, returns the number of instances produced
+    size_t add_labels( const font_label_batch& batch, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+
+    //worker threads add_labels may split a batch across, 1 lays out on the calling thread only
+    void set_label_threads( unsigned int n )
+    {
+      label_threads = n > 0 ? n : 1;
+    }
+
+    //threads a long text (FONT_PARALLEL_MIN codepoints and up) is laid out on, split at newlines
+    //the output is the same as on one thread, 1 disables
+    void set_layout_threads( unsigned int n )
+    {
+      layout_threads = n > 0 ? n : 1;
+    }
+
+    //world space labels: laid out once, then only their 32 byte anchor record changes
+    //drawn with the world shader, billboarded and scaled on the gpu
+    unsigned int add_world_label( const font_text& text, font_inst& font_ptr, const font_world_label& l = font_world_label(), const mm::vec4& color = mm::vec4( 1 ), float filter = FONT_FILTER_LINEAR );
+    void set_world_label_text( unsigned int id, const font_text& text, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ) );
+    void set_world_label( unsigned int id, const font_world_label& l );
+    void set_world_label_anchor( unsigned int id, const mm::vec3& anchor );
+    void remove_world_label( unsigned int id );
+    //draws every world label, back to front if sorting is on, culled by the compute prepass if enabled
+    void render_world_labels( const mm::mat4& view, const mm::mat4& projection );
+
+    //gpu culling needs the world cull shader
+    void set_world_label_options( bool sort, bool gpu_cull )
+    {
+      world_sort = sort;
+      world_gpu_cull = gpu_cull;
+    }
+
+    //wraps at spaces and after hyphens so lines fit 'max_width' pixels, words longer than that are cut
+    //word widths are cached, so wrapping the same text to another width only runs the line fitting again
+    mm::vec2 add_wrapped( const font_text* segments, size_t count, font_inst& font_ptr, float max_width, int flags = FONT_WRAP_LEFT, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    mm::vec2 add_wrapped( const font_text& text, font_inst& font_ptr, float max_width, int flags = FONT_WRAP_LEFT, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+
+    //draws 'visible_lines' lines of the document from its first line on, placed like add_to_render_list places text
+    //only the window around them is decoded, lines longer than FONT_DOCUMENT_MAX_LINE are cut
+    mm::vec2 add_document( font_document& doc, font_inst& font_ptr, size_t visible_lines, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+
+    //lays out 'count' texts with font_ptr at its current size and writes them to a glyph run file
+    //markup is baked in, the highlight instances are drawn with the highlight color
+    bool bake_runs( const std::string& filename, const std::string* names, const font_text* texts, size_t count, font_inst& font_ptr, float line_height = 1 );
+    //copies a baked run's instances to the current layer, moved by 'offset' (pixels, y down like the returned pen)
+    mm::vec2 add_run( font_run_file& runs, int run, const mm::vec2& offset = mm::vec2( 0 ), const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float filter = 0 );
+
+    //lays a text out without drawing it and records every caret position, markup and kerning included
+    void build_hit_index( const font_text& text, font_inst& font_ptr, font_hit_index& index, float line_height = 1 );
+    //after an edit replaced the lines [first_line, first_line + old_lines) of the indexed text, the rest being unchanged
+    //only the new lines are laid out again, 'text' is the whole text after the edit
+    void update_hit_index( const font_text& text, font_inst& font_ptr, font_hit_index& index, size_t first_line, size_t old_lines );
+
+    //submission queue, for threads other than the gl thread
+    //producers lay out into pooled chunks, nothing in here blocks on the render thread
+    //the layer has to exist already (see get_layer), markup state is kept per producer thread
+    //returns false if the text could not be laid out right away: its glyphs are not cached yet
+    //(the render thread lays it out) or there was no room for it (counted in the stats)
+    bool queue_text( const font_text& text, font_inst& font_ptr, unsigned int layer = 0, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0 );
+    //end of the producer's frame, it replaces the previous one on the render thread
+    void publish_queue();
+    //render thread, before render(): adds the latest published frame of every producer to the layers
+    void drain_queue();
+
+    //0 drops a submission right away when the pool is empty, otherwise the producer waits this long first
+    void set_queue_wait( unsigned int microseconds )
+    {
+      queue_wait_us = microseconds;
+    }
+
+    //plain text laid out by the layout compute shader straight into a gpu instance buffer, drawn right away
+    //markup is not interpreted. glyphs and kerning pairs missing from the cache are reported back
+    //and loaded on the next call, from then on the output matches layout() bit for bit
+    void render_gpu_text( const font_text& text, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, float line_height = 1, float filter = 0 );
+    //lays 'text' out on both paths and compares the instances, returns how many differ
+    size_t verify_gpu_layout( const font_text& text, font_inst& font_ptr, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, float line_height = 1, float filter = 0 );
+
+    //auto mode thresholds and the surface memory limit, least recently drawn surfaces go first
+    void set_block_caching( unsigned int min_glyphs, unsigned int stable_frames, size_t budget_bytes )
+    {
+      block_min_glyphs = min_glyphs;
+      block_stable_frames = stable_frames;
+      block_budget = budget_bytes;
+    }
+
+    //lower level path: lay out straight into caller memory (eg. a mapped buffer) instead of the render list
+    //returns the number of instances produced, only the first 'capacity' are written
+    size_t layout_to_buffer( const font_text* segments, size_t count, font_inst& font_ptr, font_instance* buffer, size_t capacity, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0, mm::vec2* lastpos = 0 );
+    size_t layout_to_buffer( const font_text& text, font_inst& font_ptr, font_instance* buffer, size_t capacity, const mm::vec4& color = mm::vec4( 1 ), const mm::mat4& mat = mm::mat4::identity, const mm::vec4& highlight_color = mm::vec4( 1 ), float line_height = 1, float filter = 0, mm::vec2* lastpos = 0 );
+    font_atlas_binding get_atlas_binding();
+    //points the bound vao's font attributes at 'buffer', the quad geometry and index buffer included
+    void set_instance_attribs( GLuint buffer, size_t offset = 0 );
+
     void set_size( font_inst& f, unsigned int s );
 
+    //warmup policy for one size of a font, or for all of its sizes if size is 0
+    void set_warmup( font_inst& f, const font_warmup& w, unsigned int size = 0 )
+    {
+      f.warmup[size] = w;
+    }
+
+    void set_warmup_budget( unsigned int glyphs_per_frame )
+    {
+      warmup_budget = glyphs_per_frame;
+    }
+
+    //draws at 'size' right away, scaled from the nearest cached size (cpu layout only)
+    //once the request stays put, its exact size is rasterized within the warmup budget and swapped in glyph by glyph
+    //call it every frame of a zoom animation, set_size ends zooming
+    void set_zoom( font_inst& f, float size );
+
+    //FONT_RASTER_*, glyphs rasterized from now on, the cache is shared with other instances of the file
+    void set_rasterizer( font_inst& f, int rasterizer )
+    {
+      f.rasterizer = rasterizer;
+    }
+
+    //times both rasterizers on the warmup charset at 'size' and compares their coverage, the atlas is not touched
+    font_raster_report compare_rasterizers( font_inst& f, unsigned int size, unsigned int passes = 10 );
+
+    //the request counts as settled once it moved less than 'sizes' for 'frames' frames
+    //drawing also switches to another cached size only if that is nearer by more than 'sizes'
+    void set_zoom_hysteresis( float sizes, unsigned int frames )
+    {
+      zoom_hysteresis = sizes;
+      zoom_settle_frames = frames;
+    }
+
+    //record which glyphs are drawn, for FONT_WARMUP_PROFILE on the next run
+    void set_glyph_profiling( font_inst& f, bool val )
+    {
+      f.profiling = val;
+    }
+
+    //library wide limits, least recently drawn sizes are trimmed first
+    void set_memory_budget( const font_budget& b )
+    {
+      library::get().budget = b;
+    }
+
+    void set_memory_budget( font_inst& f, const font_budget& b )
+    {
+      f.budget = b;
+    }
+
+    //drop sizes that were not drawn for this many frames, 0 disables
+    void set_trim_frames( unsigned int frames )
+    {
+      library::get().trim_frames = frames;
+    }
+
+    std::vector<font_size_usage> get_memory_usage( font_inst& f );
+
+    font_stats get_stats();
+
+    bool save_glyph_profile( font_inst& f, const std::string& filename );
+    bool load_glyph_profile( font_inst& f, const std::string& filename );
+
     void resize( const mm::uvec2& ss );
 
-    void destroy()
+    //compacts a fragmented atlas on frames that rasterized no glyphs, spending up to 'budget_us' of cpu time per frame
+    //a pass starts when the live glyphs fill less than 'max_fill' of the allocated pages, 0 disables
+    void set_defrag( unsigned int budget_us, float max_fill = 0.5f )
+    {
+      library::get().defrag_budget_us = budget_us;
+      library::get().defrag_fill = max_fill;
+    }
+
+    //switches the atlas between plain and mipmapped storage
+    //all cached glyphs are dropped and reloaded on demand
+    void set_mipmapped_atlas( bool val )
+    {
+      library::get().set_mip_levels( val ? FONT_ATLAS_MIP_LEVELS : 1 );
+    }
+
+    //FONT_ATLAS_*, all cached glyphs are dropped and reloaded on demand
+    //the packed format needs the pack shader, see font_stats for the compression error
+    void set_atlas_format( int format )
+    {
+      library::get().set_atlas_format( format );
+    }
+
+    void destroy();
+
+    //the font tracks the gl state it touches and restores the caller's values after drawing
+    //call this when your code changed any of it (see font_gl_state) since the last font call
+    void invalidate_gl_state()
+    {
+      library::get().invalidate_gl_state();
+    }
+
+    //FONT_CAPTURE_*, capturing every frame saves the invalidate_gl_state calls but costs a round of glGet calls per frame
+    void set_gl_state_capture( int mode )
     {
-      library::get().destroy();
+      library::get().gl_capture = mode;
     }
 
     GLuint& get_shader()
@@ -235,6 +1430,36 @@ class font
       return library::get().get_shader();
     }
 
+    //shaders/font/blit.vs and blit.ps, load it externally like the font shader
+    GLuint& get_blit_shader()
+    {
+      return library::get().get_blit_shader();
+    }
+
+    //shaders/font/world.vs and font.ps
+    GLuint& get_world_shader()
+    {
+      return library::get().get_world_shader();
+    }
+
+    //shaders/font/world_cull.cs
+    GLuint& get_world_cull_shader()
+    {
+      return library::get().get_world_cull_shader();
+    }
+
+    //shaders/font/layout.cs, needed by render_gpu_text
+    GLuint& get_layout_shader()
+    {
+      return library::get().get_layout_shader();
+    }
+
+    //shaders/font/pack.cs, needed by the packed atlas format
+    GLuint& get_pack_shader()
+    {
+      return library::get().get_pack_shader();
+    }
+
     static font& get()
     {
       static font instance;
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <sstream>
 #include <fstream>
+#include <cstring>
 
 #include "SFML/Window.hpp"
 
@@ -78,6 +79,13 @@ int main( int argc, char** argv )
          "       --screenx num //set screen width (default:1280)" << endl <<
          "       --screeny num //set screen height (default:720)" << endl <<
          "       --fullscreen  //set fullscreen, windowed by default" << endl <<
+         "       --glyph-profile file //warm up from and record glyph usage to file" << endl <<
+         "       --verify-gpu-layout //compare the compute shader layout to the cpu one and exit" << endl <<
+         "       --bench-layout //time a long text's layout on 1 to all cores and exit" << endl <<
+         "       --bake-runs file //bake 'name<tab>text' lines to file.runs at the default size and exit" << endl <<
+         "       --bench-raster //time freetype's and the built-in rasterizer at sizes 8-128, compare their coverage and exit" << endl <<
+         "       --atlas-report //print the atlas size and encoding error of each storage format for the demo text and exit" << endl <<
+         "       --document file //view a utf-8 (log) file, arrows/page keys scroll, end follows its tail" << endl <<
          "       --help        //display this information" << endl;
     return 0;
   }
@@ -152,9 +160,29 @@ int main( int argc, char** argv )
 
   load_shader( font::get().get_shader(), GL_VERTEX_SHADER, "../shaders/font/font.vs" );
   load_shader( font::get().get_shader(), GL_FRAGMENT_SHADER, "../shaders/font/font.ps" );
+  load_shader( font::get().get_blit_shader(), GL_VERTEX_SHADER, "../shaders/font/blit.vs" );
+  load_shader( font::get().get_blit_shader(), GL_FRAGMENT_SHADER, "../shaders/font/blit.ps" );
+  load_shader( font::get().get_world_shader(), GL_VERTEX_SHADER, "../shaders/font/world.vs" );
+  load_shader( font::get().get_world_shader(), GL_FRAGMENT_SHADER, "../shaders/font/font.ps" );
+  load_shader( font::get().get_world_cull_shader(), GL_COMPUTE_SHADER, "../shaders/font/world_cull.cs" );
+  load_shader( font::get().get_layout_shader(), GL_COMPUTE_SHADER, "../shaders/font/layout.cs" );
+  load_shader( font::get().get_pack_shader(), GL_COMPUTE_SHADER, "../shaders/font/pack.cs" );
 
   font_inst instance;
+
+  string glyph_profile = args["--glyph-profile"];
+
+  if( !glyph_profile.empty() )
+  {
+    //replay last run's glyph usage in the background, and keep recording
+    font::get().load_glyph_profile( instance, glyph_profile );
+    font::get().set_warmup( instance, font_warmup( FONT_WARMUP_PROFILE, true ) );
+    font::get().set_glyph_profiling( instance, true );
+  }
+
   font::get().resize( screen );
+  font::get().set_trim_frames( 600 ); //sizes left behind by +/- are dropped after ~10s
+  font::get().set_defrag( 1000 ); //and the holes they leave are compacted away, 1ms per idle frame
   int size = 22;
   font::get().load_font( "../resources/font.ttf", instance, size );
 
@@ -167,6 +195,131 @@ int main( int argc, char** argv )
   for( int c = 0; c < 43; ++c )
     text += L" 0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+!%/=()~|$[]<>#&@{},.-?:_;*`^'\".aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\n";
 
+  //works on a software renderer too, eg. LIBGL_ALWAYS_SOFTWARE=1 with mesa
+  if( args.count( "--verify-gpu-layout" ) )
+  {
+    size_t differ = font::get().verify_gpu_layout( font_text( text ), instance );
+    cout << "Gpu layout: " << ( differ ? "differs from" : "matches" ) << " the cpu layout" << endl;
+    font::get().destroy();
+    return differ ? 1 : 0;
+  }
+
+  if( args.count( "--bench-layout" ) )
+  {
+    wstring big;
+
+    while( big.size() < ( 1 << 19 ) )
+      big += text;
+
+    font_text big_text( big );
+    vector<font_instance> out( big.size() ), reference;
+    unsigned int cores = max( thread::hardware_concurrency(), 1u );
+    float single = 0;
+
+    for( unsigned int t = 1; t <= cores; t = t < cores && t * 2 > cores ? cores : t * 2 )
+    {
+      font::get().set_layout_threads( t );
+      size_t count = font::get().layout_to_buffer( big_text, instance, &out[0], out.size() ); //loads the glyphs
+
+      sf::Clock clock;
+
+      for( int c = 0; c < 5; ++c )
+        font::get().layout_to_buffer( big_text, instance, &out[0], out.size() );
+
+      float ms = clock.getElapsedTime().asMicroseconds() / 5000.0f;
+
+      if( t == 1 )
+      {
+        single = ms;
+        reference.assign( out.begin(), out.begin() + count );
+      }
+
+      //the tail padding of font_instance is not compared
+      bool same = count == reference.size();
+
+      for( size_t c = 0; c < count && same; ++c )
+        same = !memcmp( &out[c], &reference[c], ( char* )&out[c].layer - ( char* )&out[c] + sizeof( float ) );
+
+      cout << t << " threads: " << ms << " ms, " << single / ms << "x" << ( same ? "" : ", output differs from 1 thread" ) << endl;
+    }
+
+    font::get().destroy();
+    return 0;
+  }
+
+  if( args.count( "--bench-raster" ) )
+  {
+    unsigned int sizes[] = { 8, 12, 16, 24, 32, 48, 64, 96, 128 };
+
+    for( auto s : sizes )
+    {
+      font_raster_report r = font::get().compare_rasterizers( instance, s );
+      cout << s << "px: freetype " << ( int )r.freetype_per_sec << " glyphs/s, built-in " << ( int )r.builtin_per_sec << " glyphs/s (" << r.builtin_per_sec / r.freetype_per_sec << "x), " <<
+           "coverage difference mean " << r.mean_diff << " max " << r.max_diff << " (of 255), " << r.over_16 * 100 << "% over 16, " << r.box_differs << " boxes differ" << endl;
+    }
+
+    font::get().destroy();
+    return 0;
+  }
+
+  if( args.count( "--atlas-report" ) )
+  {
+    const char* names[] = { "r8", "packed", "bc4" };
+    vector<font_instance> out( text.size() );
+
+    for( int f = FONT_ATLAS_R8; f <= FONT_ATLAS_BC4; ++f )
+    {
+      font::get().set_atlas_format( f );
+      font::get().layout_to_buffer( font_text( text ), instance, &out[0], out.size() ); //loads the glyphs
+
+      font_stats s = font::get().get_stats();
+      cout << names[f] << ": " << s.texture_bytes / 1024 << " KiB for " << s.pages << " pages, " << s.atlas_bytes / 1024 << " KiB in cells";
+
+      if( f == FONT_ATLAS_BC4 )
+        cout << ", error rms " << s.atlas_error_rms << " max " << s.atlas_error_max << " (of 255)";
+
+      cout << endl;
+    }
+
+    font::get().destroy();
+    return 0;
+  }
+
+  if( args.count( "--bake-runs" ) )
+  {
+    string filename = args["--bake-runs"];
+    ifstream f( filename.c_str() );
+    vector<string> names, texts;
+    string line;
+
+    while( getline( f, line ) )
+    {
+      size_t tab = line.find( '\t' );
+
+      if( tab == string::npos )
+        continue;
+
+      names.push_back( line.substr( 0, tab ) );
+      texts.push_back( line.substr( tab + 1 ) );
+    }
+
+    vector<font_text> segments( texts.begin(), texts.end() );
+    bool baked = !names.empty() && font::get().bake_runs( filename + ".runs", &names[0], &segments[0], names.size(), instance );
+
+    font_run_file runs;
+    baked = baked && runs.open( filename + ".runs", instance );
+    cout << ( baked ? "Baked " : "Couldn't bake " ) << names.size() << " glyph runs to " << filename << ".runs" << endl;
+    runs.close();
+    font::get().destroy();
+    return baked ? 0 : 1;
+  }
+
+  font::get().set_layout_threads( thread::hardware_concurrency() );
+
+  font_document document;
+  bool show_document = args.count( "--document" ) && document.open( args["--document"] );
+  size_t document_lines = 0;
+
   /*
    * Handle events
    */
@@ -205,18 +358,44 @@ int main( int argc, char** argv )
           if( ev.key.code == sf::Keyboard::Escape )
             run = false;
 
+          if( show_document )
+          {
+            long long page = document_lines - 1;
+
+            if( ev.key.code == sf::Keyboard::Up || ev.key.code == sf::Keyboard::Down ||
+                ev.key.code == sf::Keyboard::PageUp || ev.key.code == sf::Keyboard::PageDown )
+              document.set_follow( false );
+
+            if( ev.key.code == sf::Keyboard::Up )
+              document.scroll( -1 );
+
+            if( ev.key.code == sf::Keyboard::Down )
+              document.scroll( 1 );
+
+            if( ev.key.code == sf::Keyboard::PageUp )
+              document.scroll( -page );
+
+            if( ev.key.code == sf::Keyboard::PageDown )
+              document.scroll( page );
+
+            if( ev.key.code == sf::Keyboard::Home )
+              document.scroll_to( 0 );
+
+            if( ev.key.code == sf::Keyboard::End )
+              document.set_follow( true );
+          }
+
+          //animated, see set_zoom below
           if( ev.key.code == sf::Keyboard::Add )
           {
-            ++size;
-            font::get().set_size( instance, size );
+            size += 4;
           }
 
           if( ev.key.code == sf::Keyboard::Subtract )
           {
-            if( size > 1 )
+            if( size > 4 )
             {
-              --size;
-              font::get().set_size( instance, size );
+              size -= 4;
             }
           }
         }
@@ -238,6 +417,8 @@ int main( int argc, char** argv )
 
   sf::Event the_event;
 
+  float zoom = ( float )size;
+
   while( run )
   {
     while( the_window.pollEvent( the_event ) )
@@ -256,7 +437,22 @@ int main( int argc, char** argv )
     //mat = mat * create_scale( vec3( 0.5 ) );
     mat = mat * create_rotation( radians( -thetimer.getElapsedTime().asMilliseconds() * 0.001f ), vec3( 0, 0, 1 ) );
     //mat = mat * create_translation( vec3( 0, 10, 0 ) );
-    lastpos = font::get().add_to_render_list( text + L"_" + L"\n", instance, vec4( vec3(0), 1 ), mat );
+    font_text segments[] = { font_text( text ), font_text( L"_\n", 2 ) };
+
+    //drawn scaled from a cached size on the way, the target size is rasterized once the zoom stops
+    zoom += ( size - zoom ) * 0.2f;
+
+    if( abs( size - zoom ) < 0.01f )
+      zoom = ( float )size;
+
+    font::get().set_zoom( instance, zoom );
+
+    document_lines = screen.y / size; //a little more than fit, the last one is cut
+
+    if( show_document )
+      lastpos = font::get().add_document( document, instance, document_lines, vec4( vec3(0), 1 ) );
+    else
+      lastpos = font::get().add_to_render_list( segments, 2, instance, vec4( vec3(0), 1 ), mat );
     /**
     lastpos = font::get().add_to_render_list( L"\uE000\uE002\uE004\uE006Lorem ipsum dolor sit amet, consectetur adipiscing \uE007\uE005\uE003\uE001\n", instance, vec4( vec3(0),1 ), lastpos, vec4( 0.5, 0.8, 0.5, 1 ) );
     lastpos = font::get().add_to_render_list( L"elit. Vestibulum ultrices nibh vitae augue rhoncus, in \n", instance, vec4( vec3(0),1 ), lastpos );
@@ -300,6 +496,13 @@ int main( int argc, char** argv )
     the_window.display();
   };
 
+  document.close();
+
+  if( !glyph_profile.empty() )
+  {
+    font::get().save_glyph_profile( instance, glyph_profile );
+  }
+
   font::get().destroy();
 
   return 0;
@@ -0,0 +1,14 @@
+#version 430
+
+layout(location=0) uniform mat4 mvp;
+layout(location=1) uniform vec4 rect; //x, y, w, h in pixels
+
+out vec2 tex_coord;
+
+void main()
+{
+  //triangle strip quad, no vertex buffers
+  tex_coord = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+
+  gl_Position = mvp * vec4(rect.xy + tex_coord * rect.zw, 0, 1);
+}
\ No newline at end of file
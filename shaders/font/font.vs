@@ -1,6 +1,8 @@
 #version 430
 
 layout(location=0) uniform mat4 mvp;
+layout(location=1) uniform float page_size;
+layout(location=5) uniform int atlas_channels; //pages per layer, 4 when channel packed
 
 layout(location=0) in vec2 in_vertex;
 layout(location=1) in vec2 in_texture;
@@ -8,15 +10,35 @@ layout(location=2) in vec4 instance_vertscalebias;
 layout(location=3) in vec4 instance_texscalebias;
 layout(location=4) in vec4 instance_color;
 layout(location=6) in mat4 instance_transform;
+layout(location=10) in float instance_filter;
+layout(location=11) in float instance_layer;
+
+//per layer projections, instances outside of layers (layer < 0) use mvp
+layout(std430, binding=0) buffer font_layers
+{
+  mat4 layer_projection[];
+};
 
 out vec2 tex_coord;
 flat out vec4 texscalebias;
+flat out float texlayer;
+flat out int texchannel;
 flat out vec4 fontcolor;
+flat out int sampling;
 
 void main()
 {
   fontcolor = instance_color;
   tex_coord = in_texture.xy;
-  texscalebias = instance_texscalebias;
-  gl_Position = (mvp) * vec4((instance_transform * vec4(in_vertex.xy, 0, 1)).xy * instance_vertscalebias.xy + instance_vertscalebias.zw, 0, 1);
+  sampling = int(instance_filter);
+
+  //texel space x bias holds page * page_size, split it into layer, channel and normalized coords
+  float page = floor( instance_texscalebias.z / page_size );
+  texlayer = floor( page / float(atlas_channels) );
+  texchannel = int(page - texlayer * float(atlas_channels));
+  texscalebias = vec4( instance_texscalebias.xy, instance_texscalebias.z - page * page_size, instance_texscalebias.w ) / page_size;
+
+  mat4 proj = instance_layer < 0 ? mvp : layer_projection[int(instance_layer)];
+
+  gl_Position = proj * vec4((instance_transform * vec4(in_vertex.xy, 0, 1)).xy * instance_vertscalebias.xy + instance_vertscalebias.zw, 0, 1);
 }
\ No newline at end of file
@@ -0,0 +1,319 @@
+#version 430
+
+//plain text layout for huge buffers, matches font::layout bit for bit
+//pen positions are integer sums of 1/64 pixel advances and kerning, so the scan order doesn't matter
+//pass 0: scans within each block, pass 1: scan of the block totals (one workgroup), pass 2: instances
+layout(local_size_x=256) in;
+
+layout(location=0) uniform uint count;
+layout(location=1) uniform uint pass;
+layout(location=2) uniform uint glyph_count;
+layout(location=3) uniform uint kern_count;
+layout(location=4) uniform float vert_advance;
+layout(location=5) uniform float screen_y;
+layout(location=6) uniform vec4 color;
+layout(location=7) uniform mat4 transform;
+layout(location=11) uniform float sampling;
+layout(location=12) uniform uint use_kerning;
+layout(location=13) uniform uint block_count;
+layout(location=14) uniform uint missing_capacity;
+
+struct glyph_entry
+{
+  vec4 vertscalebias;
+  vec4 texscalebias;
+  uint code;
+  int advance;
+  uint pad0;
+  uint pad1;
+};
+
+struct kern_entry
+{
+  uint prev;
+  uint next;
+  int kern;
+  uint pad;
+};
+
+//x: pen after the last newline (from the block start if there is none), lines and instances
+struct block_total
+{
+  int x;
+  uint newline;
+  uint lines;
+  uint emits;
+};
+
+struct instance
+{
+  vec4 vertscalebias;
+  vec4 texscalebias;
+  vec4 color;
+  mat4 transform;
+  float filter_mode;
+  float layer;
+};
+
+layout(std430, binding=0) readonly buffer font_codepoints
+{
+  uint codepoints[];
+};
+
+//sorted by code
+layout(std430, binding=1) readonly buffer font_glyph_table
+{
+  glyph_entry glyphs[];
+};
+
+//sorted by prev, then next
+layout(std430, binding=2) readonly buffer font_kern_table
+{
+  kern_entry kerns[];
+};
+
+layout(std430, binding=3) buffer font_blocks
+{
+  block_total blocks[];
+};
+
+layout(std430, binding=4) writeonly buffer font_instances
+{
+  instance instances[];
+};
+
+//indirect draw, then what the cpu should load: ( codepoint, ~0 ) or a kerning pair
+layout(std430, binding=5) buffer font_status
+{
+  uint index_count;
+  uint instance_count;
+  uint first_index;
+  int base_vertex;
+  uint base_instance;
+  uint missing_count;
+  uvec2 missing[];
+};
+
+shared int scan_x[256];
+shared uint scan_newline[256];
+shared uint scan_lines[256];
+shared uint scan_emits[256];
+
+bool is_special( uint c )
+{
+  return c >= 0xE000u && c <= 0xE007u;
+}
+
+int find_glyph( uint c )
+{
+  int lo = 0, hi = int(glyph_count) - 1;
+
+  while( lo <= hi )
+  {
+    int mid = (lo + hi) / 2;
+    uint code = glyphs[mid].code;
+
+    if( code == c )
+      return mid;
+    else if( code < c )
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+
+  return -1;
+}
+
+bool find_kern( uint prev, uint next, out int kern )
+{
+  int lo = 0, hi = int(kern_count) - 1;
+  kern = 0;
+
+  while( lo <= hi )
+  {
+    int mid = (lo + hi) / 2;
+    kern_entry e = kerns[mid];
+
+    if( e.prev == prev && e.next == next )
+    {
+      kern = e.kern;
+      return true;
+    }
+    else if( e.prev < prev || ( e.prev == prev && e.next < next ) )
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+
+  return false;
+}
+
+void report( uint a, uint b )
+{
+  uint i = atomicAdd( missing_count, 1u );
+
+  if( i < missing_capacity )
+    missing[i] = uvec2( a, b );
+}
+
+//the pen moves by w before codepoint i: its kerning plus the previous codepoint's advance
+//a newline restarts the pen, that is the segment flag of the x scan
+void element( uint i, bool reporting, out int w, out uint newline, out uint emit, out int g )
+{
+  w = 0;
+  newline = 0u;
+  emit = 0u;
+  g = -1;
+
+  if( i >= count )
+    return;
+
+  uint c = codepoints[i];
+
+  if( c == 10u )
+  {
+    newline = 1u;
+    return;
+  }
+
+  if( !is_special( c ) )
+  {
+    g = find_glyph( c );
+
+    if( g < 0 && reporting )
+      report( c, 0xFFFFFFFFu );
+
+    emit = g >= 0 && c != 32u ? 1u : 0u;
+  }
+
+  if( i == 0u )
+    return;
+
+  uint p = codepoints[i - 1u];
+
+  //a newline's advance counts too, layout() adds it after restarting the pen
+  if( !is_special( p ) )
+  {
+    int pg = find_glyph( p );
+
+    if( pg >= 0 )
+      w += glyphs[pg].advance;
+  }
+
+  if( use_kerning != 0u && !is_special( c ) )
+  {
+    int k;
+
+    if( !find_kern( p, c, k ) && reporting )
+      report( p, c );
+
+    w += k;
+  }
+}
+
+//inclusive scans over the workgroup, x is a segmented sum
+void scan( uint l, int w, uint newline, uint lines, uint emit )
+{
+  scan_x[l] = w;
+  scan_newline[l] = newline;
+  scan_lines[l] = lines;
+  scan_emits[l] = emit;
+  barrier();
+
+  for( uint o = 1u; o < 256u; o <<= 1 )
+  {
+    int ax = 0;
+    uint an = 0u, al = 0u, ae = 0u;
+
+    if( l >= o )
+    {
+      ax = scan_x[l - o];
+      an = scan_newline[l - o];
+      al = scan_lines[l - o];
+      ae = scan_emits[l - o];
+    }
+
+    barrier();
+
+    if( l >= o )
+    {
+      scan_x[l] = scan_newline[l] != 0u ? scan_x[l] : scan_x[l] + ax;
+      scan_newline[l] |= an;
+      scan_lines[l] += al;
+      scan_emits[l] += ae;
+    }
+
+    barrier();
+  }
+}
+
+void main()
+{
+  uint i = gl_GlobalInvocationID.x;
+  uint l = gl_LocalInvocationID.x;
+  uint b = gl_WorkGroupID.x;
+
+  if( pass == 1u )
+  {
+    //exclusive scan of the block totals, in place, 256 at a time on top of the ones before
+    int carry_x = 0;
+    uint carry_newline = 0u, carry_lines = 0u, carry_emits = 0u;
+
+    for( uint first = 0u; first < block_count; first += 256u )
+    {
+      uint c = first + l;
+      block_total t = c < block_count ? blocks[c] : block_total( 0, 0u, 0u, 0u );
+      scan( l, t.x, t.newline, t.lines, t.emits );
+
+      int x = l > 0u ? scan_x[l - 1u] : 0;
+      uint newline = l > 0u ? scan_newline[l - 1u] : 0u;
+      uint lines = l > 0u ? scan_lines[l - 1u] : 0u;
+      uint emits = l > 0u ? scan_emits[l - 1u] : 0u;
+
+      if( c < block_count )
+        blocks[c] = block_total( newline != 0u ? x : carry_x + x, carry_newline | newline, carry_lines + lines, carry_emits + emits );
+
+      carry_x = scan_newline[255] != 0u ? scan_x[255] : carry_x + scan_x[255];
+      carry_newline |= scan_newline[255];
+      carry_lines += scan_lines[255];
+      carry_emits += scan_emits[255];
+      barrier();
+    }
+
+    if( l == 0u )
+      instance_count = carry_emits;
+
+    return;
+  }
+
+  int w, g;
+  uint newline, emit;
+  element( i, pass == 0u, w, newline, emit, g );
+  scan( l, w, newline, newline, emit );
+
+  if( pass == 0u )
+  {
+    if( l == 255u )
+      blocks[b] = block_total( scan_x[l], scan_newline[l], scan_lines[l], scan_emits[l] );
+
+    return;
+  }
+
+  if( emit == 0u )
+    return;
+
+  block_total p = blocks[b];
+
+  int x = scan_x[l] + ( scan_newline[l] != 0u ? 0 : p.x );
+  uint line = p.lines + scan_lines[l];
+  uint slot = p.emits + scan_emits[l] - 1u;
+
+  //same operations as the cpu: exact pen, then one multiply and one subtraction
+  precise float yy = vert_advance * float( line + 1u );
+  precise vec2 pos = vec2( float( x ) / 64.0, screen_y - yy );
+
+  glyph_entry e = glyphs[g];
+  precise vec2 bias = e.vertscalebias.zw + pos;
+
+  instances[slot] = instance( vec4( e.vertscalebias.xy, bias ), e.texscalebias, color, transform, sampling, -1.0 );
+}
\ No newline at end of file
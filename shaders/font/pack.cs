@@ -0,0 +1,32 @@
+#version 430
+
+//writes one channel of a cell of the channel packed atlas, the other three pages in the layer are kept
+layout(local_size_x=8, local_size_y=8) in;
+
+layout(location=0) uniform ivec4 cell; //x, y, w, h in texels of the bound level
+layout(location=1) uniform int layer;
+layout(location=2) uniform int channel;
+
+layout(binding=0, rgba8) uniform image2DArray atlas;
+
+//r8 texels of the cell, rows tightly packed, four to a uint
+layout(std430, binding=0) readonly buffer font_pack_texels
+{
+  uint texels[];
+};
+
+void main()
+{
+  ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+
+  if( p.x >= cell.z || p.y >= cell.w )
+    return;
+
+  int i = p.y * cell.z + p.x;
+  float v = float((texels[i >> 2] >> ((i & 3) * 8)) & 255u) / 255.0;
+
+  ivec3 c = ivec3(cell.xy + p, layer);
+  vec4 t = imageLoad(atlas, c);
+  t[channel] = v;
+  imageStore(atlas, c, t);
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#version 430
+
+//world space labels, used with font.ps
+layout(location=0) uniform mat4 view;
+layout(location=1) uniform float page_size;
+layout(location=2) uniform mat4 projection;
+layout(location=3) uniform vec2 viewport_size;
+layout(location=5) uniform int atlas_channels;
+
+layout(location=0) in vec2 in_vertex;
+layout(location=1) in vec2 in_texture;
+layout(location=2) in vec4 instance_vertscalebias;
+layout(location=3) in vec4 instance_texscalebias;
+layout(location=4) in vec4 instance_color;
+layout(location=6) in mat4 instance_transform;
+layout(location=10) in float instance_filter;
+layout(location=11) in float instance_layer; //label index
+
+//font_world_label
+struct world_label
+{
+  vec4 anchor_scale;
+  vec2 offset;
+  uint flags;
+  float extent;
+};
+
+layout(std430, binding=1) readonly buffer font_world_labels
+{
+  world_label labels[];
+};
+
+out vec2 tex_coord;
+flat out vec4 texscalebias;
+flat out float texlayer;
+flat out int texchannel;
+flat out vec4 fontcolor;
+flat out int sampling;
+
+void main()
+{
+  fontcolor = instance_color;
+  tex_coord = in_texture.xy;
+  sampling = int(instance_filter);
+
+  float page = floor( instance_texscalebias.z / page_size );
+  texlayer = floor( page / float(atlas_channels) );
+  texchannel = int(page - texlayer * float(atlas_channels));
+  texscalebias = vec4( instance_texscalebias.xy, instance_texscalebias.z - page * page_size, instance_texscalebias.w ) / page_size;
+
+  world_label l = labels[int(instance_layer)];
+  vec4 clip = projection * view * vec4(l.anchor_scale.xyz, 1);
+
+  //behind the camera
+  if( clip.w <= 0 )
+  {
+    gl_Position = vec4(2, 2, 2, 1);
+    return;
+  }
+
+  //billboarded: the glyph quad is offset in screen space around the projected anchor
+  float s = (l.flags & 1u) != 0u ? l.anchor_scale.w : l.anchor_scale.w / clip.w;
+  vec2 p = (instance_transform * vec4(in_vertex.xy, 0, 1)).xy * instance_vertscalebias.xy + instance_vertscalebias.zw;
+  vec2 ndc = (p * s + l.offset) * 2 / viewport_size;
+
+  gl_Position = clip + vec4(ndc * clip.w, 0, 0);
+
+  //on top of the scene unless depth tested
+  if( (l.flags & 2u) == 0u )
+    gl_Position.z = -gl_Position.w;
+}
\ No newline at end of file
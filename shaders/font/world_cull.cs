@@ -0,0 +1,63 @@
+#version 430
+
+//world label frustum culling, zeroes the instance count of invisible labels' draws
+layout(local_size_x=64) in;
+
+layout(location=0) uniform mat4 view;
+layout(location=2) uniform mat4 projection;
+layout(location=3) uniform vec2 viewport_size;
+layout(location=4) uniform uint command_count;
+
+struct world_label
+{
+  vec4 anchor_scale;
+  vec2 offset;
+  uint flags;
+  float extent;
+};
+
+layout(std430, binding=1) readonly buffer font_world_labels
+{
+  world_label labels[];
+};
+
+//indirect draw plus the label it draws
+struct draw_command
+{
+  uint count;
+  uint instance_count;
+  uint first_index;
+  int base_vertex;
+  uint base_instance;
+  uint label;
+};
+
+layout(std430, binding=3) buffer font_world_commands
+{
+  draw_command commands[];
+};
+
+void main()
+{
+  uint i = gl_GlobalInvocationID.x;
+
+  if( i >= command_count )
+    return;
+
+  world_label l = labels[commands[i].label];
+  vec4 clip = projection * view * vec4(l.anchor_scale.xyz, 1);
+
+  bool visible = clip.w > 0;
+
+  if( visible )
+  {
+    //the label's screen extent widens the frustum
+    float s = (l.flags & 1u) != 0u ? l.anchor_scale.w : l.anchor_scale.w / clip.w;
+    vec2 margin = (vec2(l.extent * s) + abs(l.offset)) * 2 / viewport_size * clip.w;
+
+    visible = all(lessThanEqual(abs(clip.xy), vec2(clip.w) + margin)) && clip.z <= clip.w;
+  }
+
+  if( !visible )
+    commands[i].instance_count = 0;
+}
\ No newline at end of file